@@ -23,15 +23,12 @@ int main(int argc, char* argv[])
 			<< "Resulting model is in " << argv[3] << "."
 			<< std::endl;
 
-		const Matrix m = read_model_file(argv[1]);
+		Stats report;
 
-		std::cerr << "R: " << m.r() << std::endl;
-
-		System s(m);
-		Assembler b(s);
+		const Matrix m = timed(report, "load",
+			[&]() { return read_model_file(argv[1]); });
 
-		b.run();
-		b.halt();
+		std::cerr << "R: " << m.r() << std::endl;
 
 		std::ofstream f(argv[2], std::ios::binary);
 		if(!f)
@@ -39,11 +36,44 @@ int main(int argc, char* argv[])
 			throw std::runtime_error("Can't open " + std::string(argv[2]));
 		}
 
-		std::cerr << "Energy: " << s.energy() << std::endl;
+		ThreadPool pool;
+		Portfolio portfolio(pool);
+
+		{
+			PhaseTimer timer(report, "analysis");
+			const CostModel model(m);
+			portfolio.prune([&](const Portfolio::Config& c) {
+				CostModel::Plan plan;
+				plan.bots = c.bots;
+				plan.sweep = c.sweep;
+				return model.estimate(plan).energy;
+			});
+		}
+
+		System s = portfolio.run([&](const Portfolio::Config& c) {
+			System s(m);
+			Assembler a(s, c.bots, c.sweep);
+			a.run();
+			a.halt();
+			return s;
+		});
+		report.merge(s.stats());
+		TraceOptimizer optimizer(m.r());
+		const Trace trace = timed(report, "optimization",
+			[&]() { return optimizer.run(s.trace()); });
+		report = optimizer.stats(report);
+		timed(report, "serialization", [&]() { trace.serialize(f); });
+
+		std::cerr << "Config: " << portfolio.best() << std::endl;
+		std::cerr << "Energy: " << s.energy() - optimizer.saved() << std::endl;
 
-		s.serialize_trace(f);
+		timed(report, "write",
+			[&]() { write_model_file(s.out_matrix(), argv[3]); });
 
-		write_model_file(s.out_matrix(), argv[3]);
+		if(Stats::enabled)
+		{
+			report.write_json(std::cerr);
+		}
 	}
 	catch(const std::runtime_error& e)
 	{
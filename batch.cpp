@@ -0,0 +1,348 @@
+/// ICFPC2018 solution code chunks.
+/// Copyright (C) 2018 cybevnm
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "icfpc-2018.hpp"
+
+using namespace icfpc2018;
+
+namespace {
+
+struct Job
+{
+	enum class Type { Assemble, Disassemble, Reassemble };
+
+	Type type;
+	/// Problem name, e.g. FA001.
+	std::string name;
+	size_t size;
+
+	/// Loaded only while the job is in the work.
+	std::unique_ptr<Matrix> src;
+	std::unique_ptr<Matrix> tgt;
+
+	uint64_t energy = 0;
+	/// Of the written trace.
+	Stats stats;
+	Portfolio::Config config = Portfolio::Config{ 1, Tracer::Sweep::Voxels };
+	std::string error;
+};
+
+bool ends_with(const std::string& s, const std::string& suffix)
+{
+	return s.size() >= suffix.size()
+		&& s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+size_t file_size(const std::string& path)
+{
+	struct stat st;
+	return (stat(path.c_str(), &st) == 0) ? st.st_size : 0;
+}
+
+/// @throw std::runtime_error
+std::vector<Job> list_jobs(const std::string& problems)
+{
+	DIR* dir = opendir(problems.c_str());
+	if(!dir)
+	{
+		throw std::runtime_error("Can't open " + problems);
+	}
+
+	std::vector<Job> jobs;
+	while(const dirent* e = readdir(dir))
+	{
+		const std::string file = e->d_name;
+		if(file.size() < 2 || file[0] != 'F')
+		{
+			continue;
+		}
+
+		Job job;
+		if(file[1] == 'A' && ends_with(file, "_tgt.mdl"))
+		{
+			job.type = Job::Type::Assemble;
+		}
+		else if(file[1] == 'D' && ends_with(file, "_src.mdl"))
+		{
+			job.type = Job::Type::Disassemble;
+		}
+		else if(file[1] == 'R' && ends_with(file, "_src.mdl"))
+		{
+			job.type = Job::Type::Reassemble;
+		}
+		else
+		{
+			continue;
+		}
+
+		job.name = file.substr(0, file.size() - 8);
+		job.size = file_size(problems + "/" + file);
+		jobs.push_back(std::move(job));
+	}
+	closedir(dir);
+
+	// Biggest first, so the small ones fill the gaps at the end.
+	std::sort(jobs.begin(), jobs.end(), [](const Job& a, const Job& b) {
+		return a.size > b.size || (a.size == b.size && a.name < b.name);
+	});
+
+	return jobs;
+}
+
+void load(Job& job, const std::string& problems)
+{
+	const std::string prefix = problems + "/" + job.name;
+
+	if(job.type != Job::Type::Assemble)
+	{
+		job.src.reset(new Matrix(read_model_file(prefix + "_src.mdl")));
+	}
+	if(job.type != Job::Type::Disassemble)
+	{
+		job.tgt.reset(new Matrix(read_model_file(prefix + "_tgt.mdl")));
+	}
+}
+
+/// Runs the portfolio of the configs left by the cost model estimates on
+/// the pool, the calling task helps with them.
+System solve_portfolio(Job& job, ThreadPool& pool)
+{
+	Portfolio portfolio(pool);
+
+	// Only the layers above the common ones are rebuilt.
+	const int common = (job.type == Job::Type::Reassemble)
+		? job.src->common_layers(*job.tgt) : 0;
+	{
+		std::unique_ptr<CostModel> up;
+		std::unique_ptr<CostModel> down;
+		if(job.tgt)
+		{
+			up.reset(new CostModel(*job.tgt));
+		}
+		if(job.src)
+		{
+			down.reset(new CostModel(*job.src));
+		}
+
+		portfolio.prune([&](const Portfolio::Config& c) {
+			CostModel::Plan plan;
+			plan.bots = c.bots;
+			plan.sweep = c.sweep;
+			plan.min_y = common;
+			uint64_t energy = up ? up->estimate(plan).energy : 0;
+			if(down)
+			{
+				plan.dir = Tracer::Direction::Down;
+				energy += down->estimate(plan).energy;
+			}
+			return energy;
+		});
+	}
+
+	System result = portfolio.run([&](const Portfolio::Config& c) {
+		if(job.type == Job::Type::Assemble)
+		{
+			System s(*job.tgt);
+			Assembler a(s, c.bots, c.sweep);
+			a.run();
+			a.halt();
+			return s;
+		}
+		else if(job.type == Job::Type::Disassemble)
+		{
+			System s(*job.src);
+			Disassembler d(s, c.bots, c.sweep);
+			d.run();
+			d.halt();
+			return s;
+		}
+		else
+		{
+			System ds(*job.src);
+			return reassemble(ds, *job.tgt, c.bots, c.sweep);
+		}
+	});
+
+	job.config = portfolio.best();
+	return result;
+}
+
+void solve(Job& job, ThreadPool& pool, const std::string& results,
+	const std::string& models)
+{
+	System s = solve_portfolio(job, pool);
+	if(job.type == Job::Type::Disassemble)
+	{
+		if(s.out_matrix().any())
+		{
+			throw std::runtime_error("Model is not disassembled");
+		}
+	}
+	else if(s.out_matrix() != *job.tgt)
+	{
+		throw std::runtime_error("Wrong model");
+	}
+
+	// Traces of the failed writes do not stay to look like results.
+	const std::string trace_path = results + "/" + job.name + ".nbt";
+	try
+	{
+		std::ofstream f(trace_path, std::ios::binary);
+		if(!f)
+		{
+			throw std::runtime_error("Can't open " + trace_path);
+		}
+
+		TraceOptimizer optimizer(s.out_matrix().r());
+		optimizer.run(s.trace()).serialize(f);
+		f.close();
+		if(!f)
+		{
+			throw std::runtime_error("Can't write " + trace_path);
+		}
+
+		job.energy = s.energy() - optimizer.saved();
+		job.stats = optimizer.stats(s.stats());
+	}
+	catch(...)
+	{
+		std::remove(trace_path.c_str());
+		throw;
+	}
+
+	if(job.type != Job::Type::Disassemble && !models.empty())
+	{
+		write_model_file(s.out_matrix(),
+			models + "/" + job.name + "_tgt.mdl");
+	}
+}
+
+} //
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		if(argc != 3 && argc != 4)
+		{
+			throw std::runtime_error("Wrong argv");
+		}
+
+		const std::string problems = argv[1];
+		const std::string results = argv[2];
+		const std::string models = (argc == 4) ? argv[3] : "";
+
+		std::vector<Job> jobs = list_jobs(problems);
+
+		ThreadPool pool;
+
+		std::cerr
+			<< "Solving " << jobs.size() << " problems of " << problems
+			<< " into " << results << " on " << pool.size() << " threads."
+			<< std::endl;
+
+		std::mutex log_mutex;
+		const auto log = [&](const std::string& line) {
+			std::lock_guard<std::mutex> lock(log_mutex);
+			std::cerr << line << std::endl;
+		};
+
+		// Models are loaded ahead of the solving, but only a few of them
+		// are kept in memory at once.
+
+		std::atomic<size_t> next_load(0);
+		std::function<void()> load_next;
+		load_next = [&]() {
+			const size_t i = next_load++;
+			if(i >= jobs.size())
+			{
+				return;
+			}
+
+			Job& job = jobs[i];
+			try
+			{
+				load(job, problems);
+			}
+			catch(const std::exception& e)
+			{
+				job.error = e.what();
+				log(job.name + ": " + job.error);
+				job.src.reset();
+				job.tgt.reset();
+				load_next();
+				return;
+			}
+
+			pool.submit([&]() {
+				try
+				{
+					solve(job, pool, results, models);
+					std::ostringstream os;
+					os << job.name << ": " << job.energy << " (" << job.config << ")";
+					log(os.str());
+				}
+				catch(const std::exception& e)
+				{
+					job.error = e.what();
+					log(job.name + ": " + job.error);
+				}
+				job.src.reset();
+				job.tgt.reset();
+
+				pool.submit(load_next);
+			});
+		};
+
+		for(size_t i = 0; i < 2 * pool.size() && i < jobs.size(); ++i)
+		{
+			pool.submit(load_next);
+		}
+		pool.wait();
+
+		uint64_t energy = 0;
+		size_t failed = 0;
+		Stats report;
+		for(const auto& job : jobs)
+		{
+			energy += job.energy;
+			failed += !job.error.empty();
+			report.merge(job.stats);
+		}
+
+		std::cerr << "Energy: " << energy << std::endl;
+		if(Stats::enabled)
+		{
+			report.write_json(std::cerr);
+		}
+		if(failed != 0)
+		{
+			std::cerr << "Failed: " << failed << std::endl;
+			return 1;
+		}
+	}
+	catch(const std::runtime_error& e)
+	{
+		std::cerr << e.what() << std::endl;
+		std::cout << "Usage: batch problems_dir results_dir [models_dir]"
+			<< std::endl;
+		return 1;
+	}
+	catch(const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
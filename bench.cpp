@@ -0,0 +1,352 @@
+/// ICFPC2018 solution code chunks.
+/// Copyright (C) 2018 cybevnm
+
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <cstdio>
+
+#include <unistd.h>
+
+#include "icfpc-2018.hpp"
+
+using namespace icfpc2018;
+
+namespace {
+
+// Models fill the space the rules leave: [1, R - 2] by x and z, [0, R - 2]
+// by y. All of them are grounded.
+
+Matrix solid_cube(unsigned r)
+{
+	Matrix m(r);
+	for(int y = 0; y <= int(r) - 2; ++y)
+	{
+		for(int x = 1; x <= int(r) - 2; ++x)
+		{
+			for(int z = 1; z <= int(r) - 2; ++z)
+			{
+				m.set_voxel(Vec(x, y, z), true);
+			}
+		}
+	}
+	return m;
+}
+
+/// Walls, floor and roof one voxel thick.
+Matrix hollow_shell(unsigned r)
+{
+	const int lo = 1;
+	const int hi = r - 2;
+
+	Matrix m(r);
+	for(int y = 0; y <= hi; ++y)
+	{
+		for(int x = lo; x <= hi; ++x)
+		{
+			for(int z = lo; z <= hi; ++z)
+			{
+				if(y == 0 || y == hi
+					|| x == lo || x == hi || z == lo || z == hi)
+				{
+					m.set_voxel(Vec(x, y, z), true);
+				}
+			}
+		}
+	}
+	return m;
+}
+
+/// Ball touching the floor with the single voxel below its center.
+Matrix sphere(unsigned r)
+{
+	const int c = (r - 1) / 2;
+	const int radius = c - 1;
+
+	Matrix m(r);
+	for(int y = 0; y <= int(r) - 2; ++y)
+	{
+		for(int x = 1; x <= int(r) - 2; ++x)
+		{
+			for(int z = 1; z <= int(r) - 2; ++z)
+			{
+				const int dx = x - c;
+				const int dy = y - radius;
+				const int dz = z - c;
+				if(dx * dx + dy * dy + dz * dz <= radius * radius)
+				{
+					m.set_voxel(Vec(x, y, z), true);
+				}
+			}
+		}
+	}
+	return m;
+}
+
+/// Grid of 2x2 columns of random heights.
+Matrix towers(unsigned r)
+{
+	std::mt19937 rng(r);
+	std::uniform_int_distribution<int> height(0, r - 2);
+
+	Matrix m(r);
+	for(int x = 1; x + 1 <= int(r) - 2; x += 4)
+	{
+		for(int z = 1; z + 1 <= int(r) - 2; z += 4)
+		{
+			const int h = height(rng);
+			for(int y = 0; y <= h; ++y)
+			{
+				for(const Vec& d : { Vec(0, 0, 0), Vec(1, 0, 0),
+					Vec(0, 0, 1), Vec(1, 0, 1) })
+				{
+					m.set_voxel(Vec(x, y, z) + d, true);
+				}
+			}
+		}
+	}
+	return m;
+}
+
+/// Blobs grown voxel by voxel from a few floor seeds, an eighth of the
+/// space full.
+Matrix random_grounded(unsigned r)
+{
+	std::mt19937 rng(r);
+	std::uniform_int_distribution<int> coord(1, r - 2);
+
+	const Vec dirs[] = {
+		Vec(1, 0, 0), Vec(-1, 0, 0), Vec(0, 1, 0),
+		Vec(0, -1, 0), Vec(0, 0, 1), Vec(0, 0, -1)
+	};
+
+	const auto inside = [&](const Vec& p) {
+		return p.x >= 1 && p.x <= int(r) - 2
+			&& p.y >= 0 && p.y <= int(r) - 2
+			&& p.z >= 1 && p.z <= int(r) - 2;
+	};
+
+	Matrix m(r);
+	std::vector<Vec> full;
+	for(int i = 0; i < 4; ++i)
+	{
+		const Vec p(coord(rng), 0, coord(rng));
+		if(!m.voxel(p))
+		{
+			m.set_voxel(p, true);
+			full.push_back(p);
+		}
+	}
+
+	const size_t target = size_t(r - 2) * (r - 1) * (r - 2) / 8;
+	while(full.size() < target)
+	{
+		const Vec p = full[rng() % full.size()] + dirs[rng() % 6];
+		if(inside(p) && !m.voxel(p))
+		{
+			m.set_voxel(p, true);
+			full.push_back(p);
+		}
+	}
+	return m;
+}
+
+double seconds_of(const std::function<void()>& f)
+{
+	const auto start = std::chrono::steady_clock::now();
+	f();
+	return std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+/// One JSON object per measurement.
+class Report
+{
+public:
+	explicit Report(std::ostream& s)
+	: m_s(s)
+	{
+		m_s << "{\n\t\"results\": [";
+	}
+
+	~Report()
+	{
+		m_s << "\n\t]\n}" << std::endl;
+	}
+
+	/// Zero steps and energy are left out.
+	void add(const std::string& model, unsigned r, size_t voxels,
+		const std::string& op, double seconds,
+		uint64_t steps = 0, uint64_t energy = 0)
+	{
+		m_s << (m_first ? "\n" : ",\n")
+			<< "\t\t{ \"model\": \"" << model << "\""
+			<< ", \"r\": " << r
+			<< ", \"voxels\": " << voxels
+			<< ", \"op\": \"" << op << "\""
+			<< ", \"seconds\": " << seconds;
+		if(steps)
+		{
+			m_s << ", \"steps\": " << steps
+				<< ", \"steps_per_second\": " << uint64_t(steps / seconds);
+		}
+		if(energy)
+		{
+			m_s << ", \"energy\": " << energy;
+		}
+		m_s << " }";
+		m_s.flush();
+		m_first = false;
+	}
+
+private:
+	std::ostream& m_s;
+
+	bool m_first = true;
+};
+
+const char* sweep_name(Tracer::Sweep sweep)
+{
+	static const char* const names[] = { "voxels", "rectangles", "swaths" };
+	return names[int(sweep)];
+}
+
+/// Single bot in the empty space flying back and forth, or filling and
+/// voiding the voxel below.
+void bench_steps(Report& report, unsigned r)
+{
+	const uint64_t steps = 100000;
+
+	System s(Matrix(r), nullptr);
+	s.move_to(Vec(1, 1, 1));
+	report.add("empty", r, 0, "step_smove", seconds_of([&]() {
+		for(uint64_t i = 0; i < steps; ++i)
+		{
+			s.push_and_step(Command::smove_z((i % 2) ? -1 : 1));
+		}
+	}), steps);
+
+	System f(Matrix(r), nullptr);
+	f.move_to(Vec(1, 1, 1));
+	report.add("empty", r, 0, "step_fill_void", seconds_of([&]() {
+		for(uint64_t i = 0; i < steps; ++i)
+		{
+			f.push_and_step((i % 2)
+				? Command::voiid_below() : Command::fill_below());
+		}
+	}), steps);
+}
+
+void bench_model(Report& report, const std::string& name, const Matrix& m,
+	const std::string& tmp)
+{
+	const size_t voxels = m.popcount();
+
+	report.add(name, m.r(), voxels, "write_model_file",
+		seconds_of([&]() { write_model_file(m, tmp); }));
+
+	std::unique_ptr<Matrix> read;
+	report.add(name, m.r(), voxels, "read_model_file",
+		seconds_of([&]() { read.reset(new Matrix(read_model_file(tmp))); }));
+	std::remove(tmp.c_str());
+	if(*read != m)
+	{
+		throw std::runtime_error("Model is read back wrong");
+	}
+
+	// Copies keep the summaries, the rows written afresh are scanned.
+	Matrix rows(m.r());
+	for(int y = m.next_layer(0); y < int(m.r()); y = m.next_layer(y + 1))
+	{
+		std::copy(m.layer(y), m.layer(y) + m.layer_words(), rows.row(0, y));
+	}
+	report.add(name, m.r(), voxels, "calc_bounding_region",
+		seconds_of([&]() {
+			rows.summarize_all();
+			rows.calc_bounding_region();
+		}));
+
+	for(auto sweep : { Tracer::Sweep::Voxels, Tracer::Sweep::Rectangles,
+		Tracer::Sweep::Swaths })
+	{
+		System a(m);
+		const double assembling = seconds_of([&]() {
+			Assembler assembler(a, max_bots, sweep);
+			assembler.run();
+			assembler.halt();
+		});
+		report.add(name, m.r(), voxels,
+			std::string("assemble_") + sweep_name(sweep), assembling,
+			a.steps(), a.energy());
+
+		std::ostringstream trace;
+		report.add(name, m.r(), voxels,
+			std::string("serialize_trace_") + sweep_name(sweep),
+			seconds_of([&]() { a.serialize_trace(trace); }));
+
+		System d(m);
+		const double disassembling = seconds_of([&]() {
+			Disassembler disassembler(d, max_bots, sweep);
+			disassembler.run();
+			disassembler.halt();
+		});
+		report.add(name, m.r(), voxels,
+			std::string("disassemble_") + sweep_name(sweep), disassembling,
+			d.steps(), d.energy());
+	}
+}
+
+} //
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		std::vector<unsigned> sizes;
+		for(int i = 1; i < argc; ++i)
+		{
+			const int r = std::atoi(argv[i]);
+			if(r < 4 || r > 250)
+			{
+				throw std::runtime_error("Wrong R " + std::string(argv[i]));
+			}
+			sizes.push_back(r);
+		}
+		if(sizes.empty())
+		{
+			sizes = { 20, 60, 120, 250 };
+		}
+
+		const char* tmpdir = std::getenv("TMPDIR");
+		const std::string tmp = std::string(tmpdir ? tmpdir : "/tmp")
+			+ "/bench-" + std::to_string(getpid()) + ".mdl";
+
+		const std::pair<const char*, Matrix (*)(unsigned)> generators[] = {
+			{ "solid_cube", solid_cube },
+			{ "hollow_shell", hollow_shell },
+			{ "sphere", sphere },
+			{ "towers", towers },
+			{ "random_grounded", random_grounded }
+		};
+
+		Report report(std::cout);
+		for(unsigned r : sizes)
+		{
+			bench_steps(report, r);
+			for(const auto& g : generators)
+			{
+				bench_model(report, g.first, g.second(r), tmp);
+			}
+		}
+	}
+	catch(const std::runtime_error& e)
+	{
+		std::cerr << e.what() << std::endl;
+		std::cerr << "Usage: bench [R...]" << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
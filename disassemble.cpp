@@ -21,17 +21,12 @@ int main(int argc, char* argv[])
 			<< "Building trace for disassembling " << argv[1]
 			<< " into " << argv[2] << std::endl;
 
-		const Matrix m = read_model_file(argv[1]);
+		Stats report;
 
-		std::cerr << "R: " << m.r() << std::endl;
-
-		System s(m);
-		Disassembler b(s);
+		const Matrix m = timed(report, "load",
+			[&]() { return read_model_file(argv[1]); });
 
-		b.run();
-		b.halt();
-		assert(!s.out_matrix().calc_bounding_region().first
-			&& "Empty out matrix assumed.");
+		std::cerr << "R: " << m.r() << std::endl;
 
 		std::ofstream f(argv[2], std::ios::binary);
 		if(!f)
@@ -39,9 +34,44 @@ int main(int argc, char* argv[])
 			throw std::runtime_error("Can't open " + std::string(argv[2]));
 		}
 
-		std::cerr << "Energy: " << s.energy() << std::endl;
+		ThreadPool pool;
+		Portfolio portfolio(pool);
+
+		{
+			PhaseTimer timer(report, "analysis");
+			const CostModel model(m);
+			portfolio.prune([&](const Portfolio::Config& c) {
+				CostModel::Plan plan;
+				plan.dir = Tracer::Direction::Down;
+				plan.bots = c.bots;
+				plan.sweep = c.sweep;
+				return model.estimate(plan).energy;
+			});
+		}
+
+		System s = portfolio.run([&](const Portfolio::Config& c) {
+			System s(m);
+			Disassembler d(s, c.bots, c.sweep);
+			d.run();
+			d.halt();
+			return s;
+		});
+		assert(!s.out_matrix().calc_bounding_region().first
+			&& "Empty out matrix assumed.");
+		report.merge(s.stats());
+		TraceOptimizer optimizer(m.r());
+		const Trace trace = timed(report, "optimization",
+			[&]() { return optimizer.run(s.trace()); });
+		report = optimizer.stats(report);
+		timed(report, "serialization", [&]() { trace.serialize(f); });
 
-		s.serialize_trace(f);
+		std::cerr << "Config: " << portfolio.best() << std::endl;
+		std::cerr << "Energy: " << s.energy() - optimizer.saved() << std::endl;
+
+		if(Stats::enabled)
+		{
+			report.write_json(std::cerr);
+		}
 	}
 	catch(const std::runtime_error& e)
 	{
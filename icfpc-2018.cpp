@@ -5,718 +5,5643 @@
 #include <limits>
 #include <algorithm>
 #include <sstream>
+#include <cstring>
+#include <atomic>
+#include <numeric>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace icfpc2018 {
 
-std::pair<bool, Region> Matrix::calc_bounding_region() const
+namespace {
+
+inline int lowest_bit(Matrix::Word w)
 {
-	const int max = std::numeric_limits<int>::max();
-	const int min = std::numeric_limits<int>::min();
+	assert(w);
+	return __builtin_ctzll(w);
+}
 
-	Vec a(max, max, max);
-	Vec b(min, min, min);
+inline int highest_bit(Matrix::Word w)
+{
+	assert(w);
+	return Matrix::word_bits - 1 - __builtin_clzll(w);
+}
 
-	for(int x = 0; x < r(); ++x)
-	{
-		for(int y = 0; y < r(); ++y)
-		{
-			for(int z = 0; z < r(); ++z)
-			{
-				if(voxel(Vec(x, y, z)))
-				{
-					a.x = std::min(x, a.x);
-					a.y = std::min(y, a.y);
-					a.z = std::min(z, a.z);
+inline size_t bits_count(Matrix::Word w)
+{
+	return __builtin_popcountll(w);
+}
 
-					b.x = std::max(x, b.x);
-					b.y = std::max(y, b.y);
-					b.z = std::max(z, b.z);
-				}
-			}
-		}
-	}
-	
-	if(b.x < a.x || b.y < a.y || b.z < a.z)
+inline bool words_any(const Matrix::Word* w, size_t n)
+{
+	Matrix::Word acc = 0;
+	for(size_t i = 0; i < n; ++i)
 	{
-		return std::make_pair(false, Region());
+		acc |= w[i];
 	}
-	else
+	return acc != 0;
+}
+
+inline size_t words_popcount(const Matrix::Word* w, size_t n)
+{
+	size_t result = 0;
+	for(size_t i = 0; i < n; ++i)
 	{
-		return std::make_pair(true, Region(a, b));
+		result += bits_count(w[i]);
 	}
+	return result;
 }
 
-std::pair<bool, Region> Matrix::calc_bounding_region_y(int y) const
-{
-	const int max = std::numeric_limits<int>::max();
-	const int min = std::numeric_limits<int>::min();
+} //
 
-	Vec a(max, y, max);
-	Vec b(min, y, min);
+bool Matrix::row_any(int x, int y) const
+{
+	return words_any(row(x, y), m_row_words);
+}
 
-	for(int x = 0; x < r(); ++x)
-	{
-		for(int z = 0; z < r(); ++z)
-		{
-			if(voxel(Vec(x, y, z)))
-			{
-				a.x = std::min(x, a.x);
-				a.z = std::min(z, a.z);
+size_t Matrix::row_popcount(int x, int y) const
+{
+	return words_popcount(row(x, y), m_row_words);
+}
 
-				b.x = std::max(x, b.x);
-				b.z = std::max(z, b.z);
-			}
-		}
-	}
+std::pair<int, int> Matrix::row_z_range(int x, int y) const
+{
+	const Word* w = row(x, y);
 
-	if(b.x < a.x || b.z < a.z)
+	int first = 0;
+	while(!w[first])
 	{
-		return std::make_pair(false, Region());
+		++first;
+		assert(first < int(m_row_words) && "empty row");
 	}
-	else
+
+	int last = m_row_words - 1;
+	while(!w[last])
 	{
-		return std::make_pair(true, Region(a, b));
+		--last;
 	}
+
+	return std::make_pair(
+		first * int(word_bits) + lowest_bit(w[first]),
+		last * int(word_bits) + highest_bit(w[last]));
 }
 
-void Matrix::print(std::ostream& s) const
+bool Matrix::any() const
 {
-	for(auto y = 0; y < r(); ++y)
+	for(int y = 0; y < int(m_r); ++y)
 	{
-		for(auto x = 0; x < r(); ++x)
+		if(layer_any(y))
 		{
-			for(auto z = 0; z < r(); ++z)
-			{
-				s << (voxel(Vec(x,y,z)) ? 'x' : '.');
-			}
-			s << std::endl;
+			return true;
 		}
-		s << "---------------------" << std::endl;
 	}
+	return false;
 }
 
-Matrix read_model_file(const std::string& path)
+size_t Matrix::popcount() const
 {
-	std::ifstream f(path);
-	if(!f)
+	size_t result = 0;
+	for(int y = 0; y < int(m_r); ++y)
 	{
-		throw std::runtime_error("Can't open " + path);
+		result += layer_popcount(y);
 	}
+	return result;
+}
 
-	unsigned char r = 0;
-	f.read(reinterpret_cast<char*>(&r), 1);
+int Matrix::common_layers(const Matrix& other) const
+{
+	const auto difference = first_difference(other);
+	return difference.first ? difference.second.y : int(m_r);
+}
 
-	if(!f || f.gcount() != 1 || r == 0)
+bool Matrix::operator==(const Matrix& other) const
+{
+	if(m_r != other.m_r)
 	{
-		throw std::runtime_error("Can't read R from " + path);
+		return false;
 	}
 
-	Matrix result(r);
+	for(int y = 0; y < int(m_r); ++y)
+	{
+		if(m_pages[y] != other.m_pages[y]
+			&& !std::equal(layer(y), layer(y) + layer_words(), other.layer(y)))
+		{
+			return false;
+		}
+	}
+	return true;
+}
 
-	const unsigned rrr = r * r * r;
-	std::vector<char> data((rrr / 8) + ((rrr % 8) ? 1 : 0));
-	f.read(data.data(), data.size());
-	if(!f || f.gcount() != data.size())
+void Matrix::apply(SetOp op, const Matrix& other)
+{
+	assert(m_r == other.m_r);
+	for(int y = 0; y < int(m_r); ++y)
 	{
-		throw std::runtime_error("Can't read data from " + path);
+		apply_layer(op, other, y);
 	}
+}
+
+void Matrix::apply_layer(SetOp op, const Matrix& other, int y)
+{
+	assert(m_r == other.m_r);
+
+	const Page& a = m_pages[y];
+	const Page& b = other.m_pages[y];
+	const Page& zero = zero_page();
 
-	for(int x = 0; x < r; ++x)
+	// Layers left as they are, or made empty, without a scan.
+	const bool same = (a == b);
+	switch(op)
 	{
-		for(int y = 0; y < r; ++y)
+	case SetOp::And:
+		if(same || a == zero)
 		{
-			for(int z = 0; z < r; ++z)
-			{
-				const size_t i = x * r * r + y * r + z;
-				const uint8_t byte = data[i / 8];
-				const bool full = byte & (1 << i % 8);
-				result.set_voxel(Vec(x, y, z), full);
-			}
+			return;
+		}
+		if(b == zero)
+		{
+			m_pages[y] = zero;
+			m_layers[y] = LayerSummary();
+			m_dirty[y] = false;
+			return;
+		}
+		break;
+
+	case SetOp::Or:
+		if(same || b == zero)
+		{
+			return;
+		}
+		if(a == zero)
+		{
+			m_pages[y] = b;
+			m_layers[y] = other.layer_summary(y);
+			m_dirty[y] = false;
+			return;
+		}
+		break;
+
+	case SetOp::Xor:
+	case SetOp::AndNot:
+		if(b == zero)
+		{
+			return;
+		}
+		if(same)
+		{
+			m_pages[y] = zero;
+			m_layers[y] = LayerSummary();
+			m_dirty[y] = false;
+			return;
+		}
+		if(a == zero && op == SetOp::AndNot)
+		{
+			return;
 		}
+		break;
 	}
 
-	return result;
+	const Word* src = other.layer(y);
+	Word* dst = writable_layer(y);
+	const size_t n = layer_words();
+
+	// Plain loops over the words, the compiler vectorizes them.
+	switch(op)
+	{
+	case SetOp::And:
+		for(size_t i = 0; i < n; ++i)
+		{
+			dst[i] &= src[i];
+		}
+		break;
+
+	case SetOp::Or:
+		for(size_t i = 0; i < n; ++i)
+		{
+			dst[i] |= src[i];
+		}
+		break;
+
+	case SetOp::Xor:
+		for(size_t i = 0; i < n; ++i)
+		{
+			dst[i] ^= src[i];
+		}
+		break;
+
+	case SetOp::AndNot:
+		for(size_t i = 0; i < n; ++i)
+		{
+			dst[i] &= ~src[i];
+		}
+		break;
+	}
+	summarize(y);
 }
 
-void write_model_file(const Matrix& m, const std::string& path)
+size_t Matrix::count_layer_differences(const Matrix& other, int y) const
 {
-	std::ofstream f(path);
-	if(!f)
+	assert(m_r == other.m_r);
+
+	if(m_pages[y] == other.m_pages[y])
 	{
-		throw std::runtime_error("Can't open " + path);
+		return 0;
 	}
 
-	unsigned char r = m.r();
-	f.write(reinterpret_cast<char*>(&r), 1);
-	if(!f)
+	const Word* a = layer(y);
+	const Word* b = other.layer(y);
+	size_t result = 0;
+	for(size_t i = 0; i < layer_words(); ++i)
 	{
-		throw std::runtime_error("Can't write R to " + path);
+		result += bits_count(a[i] ^ b[i]);
+	}
+	return result;
+}
+
+size_t Matrix::count_differences(const Matrix& other) const
+{
+	size_t result = 0;
+	for(int y = 0; y < int(m_r); ++y)
+	{
+		result += count_layer_differences(other, y);
 	}
+	return result;
+}
 
-	const unsigned rrr = r * r * r;
-	std::vector<char> data((rrr / 8) + ((rrr % 8) ? 1 : 0));
+std::pair<bool, Vec> Matrix::first_difference(const Matrix& other) const
+{
+	assert(m_r == other.m_r);
 
-	for(int x = 0; x < r; ++x)
+	for(int y = 0; y < int(m_r); ++y)
 	{
-		for(int y = 0; y < r; ++y)
+		if(m_pages[y] == other.m_pages[y])
+		{
+			continue;
+		}
+
+		const Word* a = layer(y);
+		const Word* b = other.layer(y);
+		for(size_t i = 0; i < layer_words(); ++i)
 		{
-			for(int z = 0; z < r; ++z)
+			if(a[i] != b[i])
 			{
-				const size_t i = x * r * r + y * r + z;
-				char& byte = data.at(i / 8);
-				if(m.voxel(Vec(x, y, z)))
-				{
-					byte = byte | (1 << i % 8);
-				}
+				return std::make_pair(true, Vec(i / m_row_words, y,
+					(i % m_row_words) * word_bits + lowest_bit(a[i] ^ b[i])));
 			}
 		}
 	}
-
-	f.write(data.data(), data.size());
-	if(!f)
-	{
-		throw std::runtime_error("Can't write data to " + path);
-	}
+	return std::make_pair(false, Vec());
 }
 
-Command Command::halt()
+const Matrix::Page& Matrix::zero_page()
 {
-	return Command(Halt);
+	static const Page page(
+		new Word[max_layer_words](), std::default_delete<Word[]>());
+	return page;
 }
 
-Command Command::flip()
+void Matrix::unshare(int y)
 {
-	return Command(Flip);
+	Page page(new Word[layer_words()], std::default_delete<Word[]>());
+	std::copy(layer(y), layer(y) + layer_words(), page.get());
+	m_pages[y] = std::move(page);
 }
 
-Command Command::smove(const Vec& arg)
+std::pair<bool, Region> Matrix::calc_bounding_region(int min_y) const
 {
-	if(!arg.lld())
+	bool found = false;
+	Region result;
+
+	for(int y = std::max(min_y, 0); y < int(r()); ++y)
 	{
-		throw std::runtime_error("smove: arg is not lld");
+		const LayerSummary& l = layer_summary(y);
+		if(l.empty())
+		{
+			continue;
+		}
+
+		if(!found)
+		{
+			found = true;
+			result = l.region;
+		}
+		else
+		{
+			result.a.x = std::min(result.a.x, l.region.a.x);
+			result.a.z = std::min(result.a.z, l.region.a.z);
+
+			result.b.x = std::max(result.b.x, l.region.b.x);
+			result.b.y = y;
+			result.b.z = std::max(result.b.z, l.region.b.z);
+		}
 	}
-	Command c(SMove);
-	c.m_arg0.first = true;
-	c.m_arg0.second = arg;
-	return c;
-}
 
-Command Command::smove_x(int x)
-{
-	return smove(Vec(x, 0, 0));
+	return std::make_pair(found, result);
 }
 
-Command Command::smove_y(int y)
+std::pair<bool, Region> Matrix::calc_bounding_region_y(int y) const
 {
-	return smove(Vec(0, y, 0));
+	const LayerSummary& l = layer_summary(y);
+	return std::make_pair(!l.empty(), l.region);
 }
 
-Command Command::smove_z(int z)
+std::pair<bool, Region> Matrix::calc_bounding_region_y(
+	int y, int x0, int x1) const
 {
-	return smove(Vec(0, 0, z));
-}
+	const LayerSummary& l = layer_summary(y);
+	if(l.empty() || x1 < l.region.a.x || x0 > l.region.b.x)
+	{
+		return std::make_pair(false, Region());
+	}
+	if(x0 <= l.region.a.x && x1 >= l.region.b.x)
+	{
+		return std::make_pair(true, l.region);
+	}
 
-Command Command::fill(const Vec& arg)
-{
-	if(!arg.nd())
+	const int max = std::numeric_limits<int>::max();
+	const int min = std::numeric_limits<int>::min();
+
+	Vec a(max, y, max);
+	Vec b(min, y, min);
+
+	const int last = std::min(x1, l.region.b.x);
+	for(int x = next_row(std::max(x0, l.region.a.x), y); x <= last;
+		x = next_row(x + 1, y))
 	{
-		throw std::runtime_error("fill: arg is not nd");
+		const auto z_range = row_z_range(x, y);
+
+		a.x = std::min(x, a.x);
+		a.z = std::min(z_range.first, a.z);
+
+		b.x = std::max(x, b.x);
+		b.z = std::max(z_range.second, b.z);
 	}
 
-	Command c(Fill);
-	c.m_arg0.first = true;
-	c.m_arg0.second = arg;
-	return c;
+	if(b.x < a.x)
+	{
+		return std::make_pair(false, Region());
+	}
+
+	return std::make_pair(true, Region(a, b));
 }
 
-Command Command::fill_below()
+void Matrix::row_spans(int x, int y, std::vector<Span>& spans) const
 {
-	return fill(Vec(0, -1, 0));
+	// A run starts at a full bit after the empty one and ends at a full
+	// bit before the empty one, the neighbour words carry the edge bits.
+
+	spans.clear();
+
+	const Word* w = row(x, y);
+	size_t closing = 0;
+	for(unsigned i = 0; i < m_row_words; ++i)
+	{
+		const Word before = (i > 0) ? (w[i - 1] >> (word_bits - 1)) : 0;
+		const Word after = (i + 1 < m_row_words)
+			? (w[i + 1] << (word_bits - 1)) : 0;
+
+		const int base = i * word_bits;
+		for(Word starts = w[i] & ~((w[i] << 1) | before); starts != 0;
+			starts &= starts - 1)
+		{
+			spans.emplace_back(base + lowest_bit(starts), -1);
+		}
+		for(Word ends = w[i] & ~((w[i] >> 1) | after); ends != 0;
+			ends &= ends - 1)
+		{
+			spans[closing++].second = base + lowest_bit(ends);
+		}
+	}
+	assert(closing == spans.size());
 }
 
-Command Command::voiid(const Vec& arg)
+void Matrix::shrink_region(const Vec& c)
 {
-	if(!arg.nd())
+	LayerSummary& l = m_layers[c.y];
+	Region& r = l.region;
+
+	if(c.x == r.a.x || c.x == r.b.x)
 	{
-		throw std::runtime_error("void: arg is not nd");
+		int first = 0;
+		while(!l.rows[first])
+		{
+			++first;
+		}
+		int last = m_row_words - 1;
+		while(!l.rows[last])
+		{
+			--last;
+		}
+		r.a.x = first * int(word_bits) + lowest_bit(l.rows[first]);
+		r.b.x = last * int(word_bits) + highest_bit(l.rows[last]);
 	}
 
-	Command c(Void);
-	c.m_arg0.first = true;
-	c.m_arg0.second = arg;
-	return c;
+	if(c.z != r.a.z && c.z != r.b.z)
+	{
+		return;
+	}
+
+	const Word* layer = m_pages[c.y].get();
+	const unsigned word = c.z / word_bits;
+	const Word bit = Word(1) << (c.z % word_bits);
+	for(int x = r.a.x; x <= r.b.x; ++x)
+	{
+		if(layer[x * m_row_words + word] & bit)
+		{
+			return;
+		}
+	}
+
+	// Rows are OR-ed together for the z range, as in summarize().
+
+	std::array<Word, max_row_words> acc = {};
+	for(int x = r.a.x; x <= r.b.x; ++x)
+	{
+		for(unsigned i = 0; i < m_row_words; ++i)
+		{
+			acc[i] |= layer[x * m_row_words + i];
+		}
+	}
+
+	int first = 0;
+	while(!acc[first])
+	{
+		++first;
+	}
+	int last = m_row_words - 1;
+	while(!acc[last])
+	{
+		--last;
+	}
+	r.a.z = first * int(word_bits) + lowest_bit(acc[first]);
+	r.b.z = last * int(word_bits) + highest_bit(acc[last]);
 }
 
-Command Command::voiid_below()
+void Matrix::summarize_all()
 {
-	return voiid(Vec(0, -1, 0));
+	for(int y = 0; y < int(m_r); ++y)
+	{
+		if(m_dirty[y])
+		{
+			summarize(y);
+		}
+	}
 }
 
-void Command::serialize(std::ostream& s) const
+void Matrix::summarize(int y)
 {
-	switch(type())
+	// Rows are OR-ed together for the z range.
+
+	LayerSummary& l = m_layers[y];
+	l = LayerSummary();
+
+	std::array<Word, max_row_words> acc = {};
+	int x0 = -1;
+	int x1 = -1;
+
+	// The zero page has nothing to count.
+	if(m_pages[y] == zero_page())
 	{
-	case Halt:
+		m_dirty[y] = false;
+		return;
+	}
+
+	const Word* layer = m_pages[y].get();
+	for(int x = 0; x < int(m_r); ++x)
+	{
+		const Word* w = layer + x * m_row_words;
+		Word any = 0;
+		for(unsigned i = 0; i < m_row_words; ++i)
 		{
-			const char a = 0xff;
-			s.write(&a, 1);
-			break;
+			any |= w[i];
+			acc[i] |= w[i];
+			l.count += bits_count(w[i]);
 		}
 
-	case Flip:
+		if(any)
 		{
-			const char a = 0xfd;
-			s.write(&a, 1);
-			break;
+			x0 = (x0 < 0) ? x : x0;
+			x1 = x;
+			l.rows[x / word_bits] |= Word(1) << (x % word_bits);
 		}
+	}
 
-	case SMove:
+	if(l.count != 0)
+	{
+		int first = 0;
+		while(!acc[first])
 		{
-			assert(m_arg0.first);
-			assert(m_arg0.second.lld());
-
-			unsigned a = 0;
-			unsigned b = 0;
+			++first;
+		}
+		int last = m_row_words - 1;
+		while(!acc[last])
+		{
+			--last;
+		}
+
+		l.region = Region(
+			Vec(x0, y, first * int(word_bits) + lowest_bit(acc[first])),
+			Vec(x1, y, last * int(word_bits) + highest_bit(acc[last])));
+	}
+
+	m_dirty[y] = false;
+}
+
+void Matrix::print(std::ostream& s) const
+{
+	for(auto y = 0; y < r(); ++y)
+	{
+		for(auto x = 0; x < r(); ++x)
+		{
+			for(auto z = 0; z < r(); ++z)
+			{
+				s << (voxel(Vec(x,y,z)) ? 'x' : '.');
+			}
+			s << std::endl;
+		}
+		s << "---------------------" << std::endl;
+	}
+}
+
+namespace {
+
+/// Read-only mapping of the whole file.
+class MappedFile
+{
+public:
+	explicit MappedFile(const std::string& path)
+	{
+		m_fd = ::open(path.c_str(), O_RDONLY);
+		if(m_fd < 0)
+		{
+			throw std::runtime_error("Can't open " + path);
+		}
+
+		struct stat st;
+		if(::fstat(m_fd, &st) != 0)
+		{
+			::close(m_fd);
+			throw std::runtime_error("Can't stat " + path);
+		}
+
+		m_size = st.st_size;
+		if(m_size > 0)
+		{
+			void* p = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+			if(p == MAP_FAILED)
+			{
+				::close(m_fd);
+				throw std::runtime_error("Can't map " + path);
+			}
+			m_data = static_cast<const uint8_t*>(p);
+		}
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile()
+	{
+		if(m_data)
+		{
+			::munmap(const_cast<uint8_t*>(m_data), m_size);
+		}
+		::close(m_fd);
+	}
+
+	const uint8_t* data() const
+	{
+		return m_data;
+	}
+
+	size_t size() const
+	{
+		return m_size;
+	}
+
+private:
+	int m_fd = -1;
+	const uint8_t* m_data = nullptr;
+	size_t m_size = 0;
+};
+
+inline Matrix::Word load_word(const uint8_t* p)
+{
+	Matrix::Word w;
+	std::memcpy(&w, p, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	w = __builtin_bswap64(w);
+#endif
+	return w;
+}
+
+inline void store_word(uint8_t* p, Matrix::Word w)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	w = __builtin_bswap64(w);
+#endif
+	std::memcpy(p, &w, sizeof(w));
+}
+
+/// Up to 64 bits of the LSB-first bitstream starting at the bit offset.
+/// Bytes past the size are treated as zeroes.
+inline Matrix::Word load_bits(const uint8_t* data, size_t size, size_t offset)
+{
+	const size_t byte = offset / 8;
+	const unsigned shift = offset % 8;
+
+	Matrix::Word w = 0;
+	if(byte + 9 <= size)
+	{
+		w = load_word(data + byte) >> shift;
+		if(shift)
+		{
+			w |= Matrix::Word(data[byte + 8]) << (64 - shift);
+		}
+	}
+	else
+	{
+		for(size_t i = byte; i < size && i < byte + 9; ++i)
+		{
+			const int bit = int(8 * (i - byte)) - int(shift);
+			if(bit >= 64)
+			{
+				break;
+			}
+			else if(bit >= 0)
+			{
+				w |= Matrix::Word(data[i]) << bit;
+			}
+			else
+			{
+				w |= Matrix::Word(data[i]) >> -bit;
+			}
+		}
+	}
+
+	return w;
+}
+
+/// Packs bits LSB-first and flushes them to the stream in fixed chunks.
+class BitWriter
+{
+public:
+	explicit BitWriter(std::ostream& s)
+	: m_s(s)
+	{
+	}
+
+	/// Appends the lowest n bits of w, the rest of w must be zero.
+	void push(Matrix::Word w, unsigned n)
+	{
+		assert(n > 0 && n <= 64);
+		assert(n == 64 || (w >> n) == 0);
+
+		m_acc |= w << m_acc_bits;
+		if(m_acc_bits + n >= 64)
+		{
+			put(m_acc);
+			m_acc = m_acc_bits ? (w >> (64 - m_acc_bits)) : 0;
+			m_acc_bits = m_acc_bits + n - 64;
+		}
+		else
+		{
+			m_acc_bits += n;
+		}
+	}
+
+	void finish()
+	{
+		for(unsigned i = 0; i < m_acc_bits; i += 8)
+		{
+			m_buffer[m_size++] = uint8_t(m_acc >> i);
+		}
+		m_acc = 0;
+		m_acc_bits = 0;
+		flush();
+	}
+
+private:
+	void put(Matrix::Word w)
+	{
+		if(m_size + 8 > sizeof(m_buffer))
+		{
+			flush();
+		}
+		store_word(m_buffer + m_size, w);
+		m_size += 8;
+	}
+
+	void flush()
+	{
+		m_s.write(reinterpret_cast<const char*>(m_buffer), m_size);
+		m_size = 0;
+	}
+
+	std::ostream& m_s;
+	Matrix::Word m_acc = 0;
+	unsigned m_acc_bits = 0;
+	uint8_t m_buffer[64 * 1024];
+	size_t m_size = 0;
+};
+
+} //
+
+Matrix read_model_file(const std::string& path)
+{
+	const MappedFile f(path);
+
+	if(f.size() < 1 || f.data()[0] == 0)
+	{
+		throw std::runtime_error("Can't read R from " + path);
+	}
+
+	const unsigned r = f.data()[0];
+	const size_t rrr = size_t(r) * r * r;
+	const size_t size = (rrr / 8) + ((rrr % 8) ? 1 : 0);
+	if(f.size() - 1 < size)
+	{
+		throw std::runtime_error("Can't read data from " + path);
+	}
+
+	Matrix result(r);
+
+	// File rows go x-major, each (x, y) row is R consecutive z bits, which
+	// is exactly the in-memory row format.
+	const uint8_t* data = f.data() + 1;
+	const unsigned last_bits = r % Matrix::word_bits;
+	const Matrix::Word last_mask = last_bits
+		? ((Matrix::Word(1) << last_bits) - 1) : ~Matrix::Word(0);
+
+	// Zero rows are not written, so the empty layers stay on the zero page.
+	std::array<Matrix::Word, Matrix::max_row_words> words;
+	size_t offset = 0;
+	for(int x = 0; x < int(r); ++x)
+	{
+		for(int y = 0; y < int(r); ++y)
+		{
+			for(unsigned i = 0; i < result.row_words(); ++i)
+			{
+				words[i] = load_bits(data, size, offset + i * Matrix::word_bits);
+			}
+			words[result.row_words() - 1] &= last_mask;
+			offset += r;
+
+			Matrix::Word any = 0;
+			for(unsigned i = 0; i < result.row_words(); ++i)
+			{
+				any |= words[i];
+			}
+
+			if(any)
+			{
+				std::copy(words.begin(), words.begin() + result.row_words(),
+					result.row(x, y));
+			}
+		}
+	}
+	result.summarize_all();
+
+	return result;
+}
+
+void write_model_file(const Matrix& m, const std::string& path)
+{
+	std::ofstream f(path, std::ios::binary);
+	if(!f)
+	{
+		throw std::runtime_error("Can't open " + path);
+	}
+
+	unsigned char r = m.r();
+	f.write(reinterpret_cast<char*>(&r), 1);
+	if(!f)
+	{
+		throw std::runtime_error("Can't write R to " + path);
+	}
+
+	const unsigned last_bits = r - (m.row_words() - 1) * Matrix::word_bits;
+
+	BitWriter w(f);
+	for(int x = 0; x < int(r); ++x)
+	{
+		for(int y = 0; y < int(r); ++y)
+		{
+			const Matrix::Word* row = m.row(x, y);
+			for(unsigned i = 0; i + 1 < m.row_words(); ++i)
+			{
+				w.push(row[i], Matrix::word_bits);
+			}
+			w.push(row[m.row_words() - 1], last_bits);
+		}
+	}
+	w.finish();
+
+	if(!f)
+	{
+		throw std::runtime_error("Can't write data to " + path);
+	}
+}
+
+Command Command::halt()
+{
+	return Command(Halt);
+}
+
+Command Command::wait()
+{
+	return Command(Wait);
+}
+
+Command Command::flip()
+{
+	return Command(Flip);
+}
+
+Command Command::smove(const Vec& arg)
+{
+	if(!arg.lld())
+	{
+		throw std::runtime_error("smove: arg is not lld");
+	}
+	Command c(SMove);
+	pack(c.m_arg0, arg);
+	return c;
+}
+
+Command Command::smove_x(int x)
+{
+	return smove(Vec(x, 0, 0));
+}
+
+Command Command::smove_y(int y)
+{
+	return smove(Vec(0, y, 0));
+}
+
+Command Command::smove_z(int z)
+{
+	return smove(Vec(0, 0, z));
+}
+
+Command Command::lmove(const Vec& sld1, const Vec& sld2)
+{
+	if(!sld1.sld() || !sld2.sld())
+	{
+		throw std::runtime_error("lmove: arg is not sld");
+	}
+	Command c(LMove);
+	pack(c.m_arg0, sld1);
+	pack(c.m_arg1, sld2);
+	return c;
+}
+
+Command Command::fission(const Vec& nd, unsigned m)
+{
+	if(!nd.nd())
+	{
+		throw std::runtime_error("fission: arg is not nd");
+	}
+	if(m > 255)
+	{
+		throw std::runtime_error("fission: m is too big");
+	}
+	Command c(Fission);
+	pack(c.m_arg0, nd);
+	c.m_m = m;
+	return c;
+}
+
+Command Command::fill(const Vec& arg)
+{
+	if(!arg.nd())
+	{
+		throw std::runtime_error("fill: arg is not nd");
+	}
+
+	Command c(Fill);
+	pack(c.m_arg0, arg);
+	return c;
+}
+
+Command Command::fill_below()
+{
+	return fill(Vec(0, -1, 0));
+}
+
+Command Command::voiid(const Vec& arg)
+{
+	if(!arg.nd())
+	{
+		throw std::runtime_error("void: arg is not nd");
+	}
+
+	Command c(Void);
+	pack(c.m_arg0, arg);
+	return c;
+}
+
+Command Command::voiid_below()
+{
+	return voiid(Vec(0, -1, 0));
+}
+
+Command Command::fusion_p(const Vec& nd)
+{
+	if(!nd.nd())
+	{
+		throw std::runtime_error("fusionp: arg is not nd");
+	}
+	Command c(FusionP);
+	pack(c.m_arg0, nd);
+	return c;
+}
+
+Command Command::fusion_s(const Vec& nd)
+{
+	if(!nd.nd())
+	{
+		throw std::runtime_error("fusions: arg is not nd");
+	}
+	Command c(FusionS);
+	pack(c.m_arg0, nd);
+	return c;
+}
+
+Command Command::gfill(const Vec& nd, const Vec& fd)
+{
+	if(!nd.nd() || !fd.fd())
+	{
+		throw std::runtime_error("gfill: args are not nd and fd");
+	}
+	Command c(GFill);
+	pack(c.m_arg0, nd);
+	pack(c.m_arg1, fd);
+	return c;
+}
+
+Command Command::gvoid(const Vec& nd, const Vec& fd)
+{
+	if(!nd.nd() || !fd.fd())
+	{
+		throw std::runtime_error("gvoid: args are not nd and fd");
+	}
+	Command c(GVoid);
+	pack(c.m_arg0, nd);
+	pack(c.m_arg1, fd);
+	return c;
+}
+
+namespace {
+
+unsigned encode_nd(const Vec& nd)
+{
+	assert(nd.nd());
+	return 9 * (nd.x + 1) + 3 * (nd.y + 1) + 1 * (nd.z + 1);
+}
+
+Vec decode_nd(unsigned a)
+{
+	return Vec(int(a / 9) - 1, int(a / 3 % 3) - 1, int(a % 3) - 1);
+}
+
+/// Axis code and the value of the linear difference.
+std::pair<unsigned, int> encode_ld(const Vec& ld)
+{
+	assert(ld.ld());
+	if(ld.x != 0)
+	{
+		return std::make_pair(0x1, ld.x);
+	}
+	else if(ld.y != 0)
+	{
+		return std::make_pair(0x2, ld.y);
+	}
+	else
+	{
+		return std::make_pair(0x3, ld.z);
+	}
+}
+
+Vec decode_ld(unsigned a, int d)
+{
+	switch(a)
+	{
+	case 1: return Vec(d, 0, 0);
+	case 2: return Vec(0, d, 0);
+	case 3: return Vec(0, 0, d);
+	default: return Vec();
+	}
+}
+
+} //
+
+size_t Command::encode(uint8_t* out) const
+{
+	const Vec arg = arg0();
+
+	switch(type())
+	{
+	case Halt:
+		out[0] = 0xff;
+		return 1;
+
+	case Wait:
+		out[0] = 0xfe;
+		return 1;
+
+	case Flip:
+		out[0] = 0xfd;
+		return 1;
+
+	case SMove:
+		{
+			assert(arg.lld());
+			const auto ld = encode_ld(arg);
+			out[0] = (ld.first << 4) | 0x4;
+			out[1] = 0x1f & (ld.second + 15);
+			return 2;
+		}
+
+	case LMove:
+		{
+			assert(arg.sld() && arg1().sld());
+			const auto ld1 = encode_ld(arg);
+			const auto ld2 = encode_ld(arg1());
+			out[0] = (ld2.first << 6) | (ld1.first << 4) | 0xc;
+			out[1] = ((0xf & (ld2.second + 5)) << 4) | (0xf & (ld1.second + 5));
+			return 2;
+		}
+
+	case Fission:
+		out[0] = (encode_nd(arg) << 3) | 0x5;
+		out[1] = m();
+		return 2;
+
+	case Fill:
+		out[0] = (encode_nd(arg) << 3) | 0x3;
+		return 1;
+
+	case Void:
+		out[0] = (encode_nd(arg) << 3) | 0x2;
+		return 1;
+
+	case FusionP:
+		out[0] = (encode_nd(arg) << 3) | 0x7;
+		return 1;
+
+	case FusionS:
+		out[0] = (encode_nd(arg) << 3) | 0x6;
+		return 1;
+
+	case GFill:
+	case GVoid:
+		assert(arg1().fd());
+		out[0] = (encode_nd(arg) << 3) | (type() == GFill ? 0x1 : 0x0);
+		out[1] = arg1().x + 30;
+		out[2] = arg1().y + 30;
+		out[3] = arg1().z + 30;
+		return 4;
+
+	default:
+		assert(false);
+		return 0;
+	}
+}
+
+size_t Command::decode(const uint8_t* data, size_t size, Command& out)
+{
+	assert(size > 0);
+	const unsigned a = data[0];
+
+	if(a == 0xff)
+	{
+		out = halt();
+		return 1;
+	}
+	else if(a == 0xfe)
+	{
+		out = wait();
+		return 1;
+	}
+	else if(a == 0xfd)
+	{
+		out = flip();
+		return 1;
+	}
+	else if((a & 0xf) == 0x4)
+	{
+		if(size < 2)
+		{
+			throw std::runtime_error("Truncated SMove");
+		}
+		out = smove(decode_ld((a >> 4) & 0x3, int(data[1] & 0x1f) - 15));
+		return 2;
+	}
+	else if((a & 0xf) == 0xc)
+	{
+		if(size < 2)
+		{
+			throw std::runtime_error("Truncated LMove");
+		}
+		out = lmove(
+			decode_ld((a >> 4) & 0x3, int(data[1] & 0xf) - 5),
+			decode_ld((a >> 6) & 0x3, int(data[1] >> 4) - 5));
+		return 2;
+	}
+
+	const Vec nd = decode_nd(a >> 3);
+
+	switch(a & 0x7)
+	{
+	case 0x7:
+		out = fusion_p(nd);
+		return 1;
+
+	case 0x6:
+		out = fusion_s(nd);
+		return 1;
+
+	case 0x5:
+		if(size < 2)
+		{
+			throw std::runtime_error("Truncated Fission");
+		}
+		out = fission(nd, data[1]);
+		return 2;
+
+	case 0x3:
+		out = fill(nd);
+		return 1;
+
+	case 0x2:
+		out = voiid(nd);
+		return 1;
+
+	default:
+		{
+			if(size < 4)
+			{
+				throw std::runtime_error("Truncated GFill/GVoid");
+			}
+			const Vec fd(int(data[1]) - 30, int(data[2]) - 30, int(data[3]) - 30);
+			out = (a & 0x7) ? gfill(nd, fd) : gvoid(nd, fd);
+			return 4;
+		}
+	}
+}
+
+void Command::serialize(std::ostream& s) const
+{
+	uint8_t data[max_encoded_size];
+	s.write(reinterpret_cast<const char*>(data), encode(data));
+}
+
+namespace {
+
+/// Searches pop the last one first, so they go down first.
+const Vec neighbours[] = {
+	Vec(0, 1, 0),
+	Vec(1, 0, 0), Vec(-1, 0, 0),
+	Vec(0, 0, 1), Vec(0, 0, -1),
+	Vec(0, -1, 0)
+};
+
+bool inside(const Matrix& m, const Vec& p)
+{
+	const int r = m.r();
+	return p.valid_coordinate() && p.x < r && p.y < r && p.z < r;
+}
+
+uint32_t voxel_index(const Matrix& m, const Vec& p)
+{
+	return (uint32_t(p.y) * m.r() + p.x) * m.r() + p.z;
+}
+
+} //
+
+Groundedness::Groundedness(const Groundedness& other)
+{
+	*this = other;
+}
+
+Groundedness& Groundedness::operator=(const Groundedness& other)
+{
+	if(this == &other)
+	{
+		return *this;
+	}
+
+	m_parent.clear();
+	m_floating = 0;
+	m_marks.clear();
+	m_stack.clear();
+	m_marked.clear();
+
+	switch(other.m_state)
+	{
+	case State::Tracked:
+		// An empty matrix stays tracked with no union-find to rebuild.
+		if(other.m_parent.empty())
+		{
+			m_state = State::Tracked;
+		}
+		else
+		{
+			m_state = State::Voided;
+			m_all_grounded = (other.m_floating == 0);
+		}
+		m_suspects.clear();
+		break;
+
+	case State::Voided:
+		m_state = State::Voided;
+		m_all_grounded = other.m_all_grounded;
+		m_suspects = other.m_suspects;
+		break;
+
+	case State::Unknown:
+		m_state = State::Unknown;
+		m_suspects.clear();
+		break;
+	}
+	return *this;
+}
+
+void Groundedness::reset()
+{
+	m_state = State::Unknown;
+	m_suspects.clear();
+}
+
+void Groundedness::fill(const Matrix& m, const Vec& p)
+{
+	if(m_state == State::Tracked)
+	{
+		add(m, p, true);
+	}
+	else if(m_state == State::Voided && m_all_grounded
+		&& m_suspects.size() < max_suspects)
+	{
+		// Fills detach nothing, only the new voxel has to reach the ground.
+		m_suspects.push_back(p);
+	}
+	else
+	{
+		rebuild(m);
+	}
+}
+
+void Groundedness::voiid(const Matrix& m, const Vec& p)
+{
+	if(m_state == State::Tracked)
+	{
+		m_all_grounded = (m_floating == 0);
+		m_state = State::Voided;
+	}
+
+	if(m_state == State::Voided)
+	{
+		if(!m_all_grounded || m_suspects.size() + 6 > max_suspects)
+		{
+			m_state = State::Unknown;
+			m_suspects.clear();
+			return;
+		}
+
+		for(const auto& n : neighbours)
+		{
+			if(inside(m, p + n))
+			{
+				m_suspects.push_back(p + n);
+			}
+		}
+	}
+}
+
+bool Groundedness::grounded(const Matrix& m)
+{
+	switch(m_state)
+	{
+	case State::Tracked:
+		return m_floating == 0;
+
+	case State::Voided:
+		// Nothing has changed since the failed check, the voids since
+		// would have made it Unknown.
+		if(!m_all_grounded)
+		{
+			return false;
+		}
+
+		// Everything was grounded, so only the neighbours of the voids
+		// may be detached now.
+		for(const auto& p : m_suspects)
+		{
+			if(m.voxel(p) && !reaches_ground(m, p))
+			{
+				m_all_grounded = false;
+				break;
+			}
+		}
+		for(const auto& p : m_marked)
+		{
+			m_marks[voxel_index(m, p)] = 0;
+		}
+		m_marked.clear();
+		m_suspects.clear();
+		break;
+
+	case State::Unknown:
+		m_all_grounded = flood(m);
+		break;
+	}
+
+	m_state = State::Voided;
+	return m_all_grounded;
+}
+
+uint32_t Groundedness::find(uint32_t i)
+{
+	while(m_parent[i] != i)
+	{
+		m_parent[i] = m_parent[m_parent[i]];
+		i = m_parent[i];
+	}
+	return i;
+}
+
+void Groundedness::unite(uint32_t a, uint32_t b)
+{
+	a = find(a);
+	b = find(b);
+	if(a != b)
+	{
+		// The ground node stays the root.
+		if(a > b)
+		{
+			m_parent[b] = a;
+		}
+		else
+		{
+			m_parent[a] = b;
+		}
+		--m_floating;
+	}
+}
+
+void Groundedness::add(const Matrix& m, const Vec& p, bool all_neighbours)
+{
+	const uint32_t r = m.r();
+	const uint32_t ground = r * r * r;
+	if(m_parent.empty())
+	{
+		m_parent.resize(ground + 1);
+		m_parent[ground] = ground;
+	}
+
+	const uint32_t i = voxel_index(m, p);
+	m_parent[i] = i;
+	++m_floating;
+
+	if(p.y == 0)
+	{
+		unite(i, ground);
+	}
+
+	for(const auto& n : neighbours)
+	{
+		const Vec q = p + n;
+		// In the rebuild the voxels are added in the index order, so
+		// only the preceding neighbours are there.
+		if((all_neighbours || voxel_index(m, q) < i)
+			&& inside(m, q) && m.voxel(q))
+		{
+			unite(i, voxel_index(m, q));
+		}
+	}
+}
+
+void Groundedness::rebuild(const Matrix& m)
+{
+	m_parent.clear();
+	m_floating = 0;
+	m_suspects.clear();
+	m_state = State::Tracked;
+
+	const int r = m.r();
+	for(int y = 0; y < r; ++y)
+	{
+		if(!m.layer_any(y))
+		{
+			continue;
+		}
+
+		for(int x = m.next_row(0, y); x < r; x = m.next_row(x + 1, y))
+		{
+			const Matrix::Word* row = m.row(x, y);
+			for(size_t w = 0; w < m.row_words(); ++w)
+			{
+				for(Matrix::Word bits = row[w]; bits != 0; bits &= bits - 1)
+				{
+					const int z = w * Matrix::word_bits + __builtin_ctzll(bits);
+					add(m, Vec(x, y, z), false);
+				}
+			}
+		}
+	}
+}
+
+bool Groundedness::reaches_ground(const Matrix& m, const Vec& p)
+{
+	// Marks are 1 for the visited voxels and 2 for the grounded ones, the
+	// later searches of the same check stop at the grounded voxels.
+
+	if(m_marks.size() < size_t(m.r()) * m.r() * m.r())
+	{
+		m_marks.assign(size_t(m.r()) * m.r() * m.r(), 0);
+	}
+
+	const size_t first_marked = m_marked.size();
+	const auto visit = [&](const Vec& q) {
+		m_marks[voxel_index(m, q)] = 1;
+		m_marked.push_back(q);
+		m_stack.push_back(q);
+	};
+
+	bool found = false;
+
+	m_stack.clear();
+	if(m_marks[voxel_index(m, p)] == 2)
+	{
+		return true;
+	}
+	else if(m_marks[voxel_index(m, p)] == 0)
+	{
+		visit(p);
+	}
+
+	while(!m_stack.empty() && !found)
+	{
+		const Vec q = m_stack.back();
+		m_stack.pop_back();
+
+		if(q.y == 0)
+		{
+			found = true;
+			break;
+		}
+
+		for(const auto& n : neighbours)
+		{
+			const Vec t = q + n;
+			if(!inside(m, t) || !m.voxel(t))
+			{
+				continue;
+			}
+
+			const uint8_t mark = m_marks[voxel_index(m, t)];
+			if(mark == 2)
+			{
+				found = true;
+				break;
+			}
+			else if(mark == 0)
+			{
+				visit(t);
+			}
+		}
+	}
+
+	// Everything visited is connected to p.
+	if(found)
+	{
+		for(size_t i = first_marked; i < m_marked.size(); ++i)
+		{
+			m_marks[voxel_index(m, m_marked[i])] = 2;
+		}
+	}
+
+	return found;
+}
+
+bool Groundedness::flood(const Matrix& m)
+{
+	const int r = m.r();
+
+	if(m_marks.size() < size_t(r) * r * r)
+	{
+		m_marks.assign(size_t(r) * r * r, 0);
+	}
+
+	const auto visit = [&](const Vec& q) {
+		m_marks[voxel_index(m, q)] = 1;
+		m_marked.push_back(q);
+		m_stack.push_back(q);
+	};
+
+	m_stack.clear();
+	m_marked.clear();
+	for(int x = m.next_row(0, 0); x < r; x = m.next_row(x + 1, 0))
+	{
+		for(int z = 0; z < r; ++z)
+		{
+			if(m.voxel(Vec(x, 0, z)))
+			{
+				visit(Vec(x, 0, z));
+			}
+		}
+	}
+
+	while(!m_stack.empty())
+	{
+		const Vec q = m_stack.back();
+		m_stack.pop_back();
+
+		for(const auto& n : neighbours)
+		{
+			const Vec t = q + n;
+			if(inside(m, t) && m.voxel(t) && !m_marks[voxel_index(m, t)])
+			{
+				visit(t);
+			}
+		}
+	}
+
+	const size_t count = m_marked.size();
+	for(const auto& q : m_marked)
+	{
+		m_marks[voxel_index(m, q)] = 0;
+	}
+	m_marked.clear();
+
+	return count == m.popcount();
+}
+
+void StreamTraceSink::write(const uint8_t* data, size_t size)
+{
+	m_s.write(reinterpret_cast<const char*>(data), size);
+	if(!m_s)
+	{
+		throw std::runtime_error("Can't write trace");
+	}
+}
+
+void Stats::merge(const Stats& other)
+{
+	low_steps += other.low_steps;
+	high_steps += other.high_steps;
+	for(size_t i = 0; i < commands.size(); ++i)
+	{
+		commands[i] += other.commands[i];
+	}
+	for(size_t i = 0; i < energy.size(); ++i)
+	{
+		energy[i] += other.energy[i];
+	}
+	peak_trace_bytes = std::max(peak_trace_bytes, other.peak_trace_bytes);
+	phases.insert(phases.end(), other.phases.begin(), other.phases.end());
+}
+
+void Stats::write_json(std::ostream& s) const
+{
+	static const char* const command_names[] = {
+		"undefined", "halt", "wait", "flip", "smove", "lmove", "fission",
+		"fill", "void", "fusionp", "fusions", "gfill", "gvoid"
+	};
+	static_assert(sizeof(command_names) / sizeof(command_names[0])
+		== std::tuple_size<decltype(commands)>::value, "command names");
+
+	static const char* const energy_names[] = {
+		"field_low", "field_high", "upkeep", "moves", "fissions",
+		"fills", "voids"
+	};
+	static_assert(sizeof(energy_names) / sizeof(energy_names[0])
+		== energy_kinds, "energy names");
+
+	s << "{\n\t\"steps\": { \"low\": " << low_steps
+		<< ", \"high\": " << high_steps << " },\n";
+
+	s << "\t\"commands\": {";
+	// Undefined is never executed.
+	for(size_t i = Command::Halt; i < commands.size(); ++i)
+	{
+		s << (i == Command::Halt ? " " : ", ")
+			<< "\"" << command_names[i] << "\": " << commands[i];
+	}
+	s << " },\n";
+
+	int64_t total = 0;
+	s << "\t\"energy\": {";
+	for(size_t i = 0; i < energy.size(); ++i)
+	{
+		s << (i ? ", " : " ") << "\"" << energy_names[i] << "\": " << energy[i];
+		total += energy[i];
+	}
+	s << ", \"total\": " << total << " },\n";
+
+	s << "\t\"peak_trace_bytes\": " << peak_trace_bytes << ",\n";
+
+	s << "\t\"phases\": [";
+	for(size_t i = 0; i < phases.size(); ++i)
+	{
+		s << (i ? ",\n\t\t" : "\n\t\t") << "{ \"name\": \"" << phases[i].first
+			<< "\", \"seconds\": " << phases[i].second << " }";
+	}
+	s << (phases.empty() ? "]\n}" : "\n\t]\n}") << std::endl;
+}
+
+System::System(const Matrix& matrix, TraceSink* sink)
+: m_matrix(matrix)
+, m_out_matrix(matrix.r())
+, m_sink(sink)
+{
+	std::vector<unsigned> seeds;
+	for(unsigned id = 2; id <= max_bots; ++id)
+	{
+		seeds.push_back(id);
+	}
+	m_bots.push_back(Bot(1, 0, Vec(), seeds));
+
+	if(m_sink)
+	{
+		m_trace.reserve(Trace::chunk_size + Command::max_encoded_size);
+	}
+}
+
+System::System(const System& src, const Matrix& matrix)
+: System(matrix, src.m_sink)
+{
+	m_out_matrix = src.m_out_matrix;
+	m_harmonics = src.m_harmonics;
+	m_energy = src.m_energy;
+	m_steps = src.m_steps;
+	m_stats = src.m_stats;
+	m_strict = src.m_strict;
+	m_bots = src.m_bots;
+	assert(src.m_commands.empty());
+	m_trace = src.m_trace;
+}
+
+void System::serialize_trace(std::ostream& s)
+{
+	assert(!m_sink && "streamed trace is not kept");
+	m_trace.serialize(s);
+}
+
+void System::flush_trace()
+{
+	if(m_sink && !m_trace.empty())
+	{
+		m_trace.for_each_block([&](const uint8_t* data, size_t size) {
+			m_sink->write(data, size);
+		});
+		m_trace.clear();
+	}
+}
+
+void System::push(Command command)
+{
+	assert(m_commands.size() < m_bots.size()
+		&& "one command per bot per step");
+	m_commands.push_back(command);
+}
+
+void System::step()
+{
+	assert(m_commands.size() == m_bots.size());
+
+	++m_steps;
+
+	// Global field energy.
+	if(m_harmonics == Harmonics::Low)
+	{
+		charge(Stats::FieldLow,
+			3 * m_matrix.r() * m_matrix.r() * m_matrix.r());
+#ifdef ICFPC_STATS
+		++m_stats.low_steps;
+#endif
+	}
+	else
+	{
+		charge(Stats::FieldHigh,
+			30 * m_matrix.r() * m_matrix.r() * m_matrix.r());
+#ifdef ICFPC_STATS
+		++m_stats.high_steps;
+#endif
+	}
+
+	// Bots energy.
+	charge(Stats::Upkeep, 20 * m_bots.size());
+
+	m_volatile.clear();
+	if(m_strict)
+	{
+		m_grid.next_step(m_matrix.r());
+	}
+
+	std::vector<Bot> born;
+	bool fusions = false;
+	bool groups = false;
+
+	// Commands.
+	for(size_t i = 0; i < m_bots.size(); ++i)
+	{
+		Bot& bot = m_bots[i];
+		const Command& command = m_commands[i];
+
+		mark_volatile(bot.pos());
+
+#ifdef ICFPC_STATS
+		++m_stats.commands[command.type()];
+#endif
+
+		switch(command.type())
+		{
+		case Command::Halt:
+			assert(m_bots.size() == 1);
+			if(m_strict && (m_bots.size() != 1 || bot.pos() != Vec()
+				|| m_harmonics != Harmonics::Low))
+			{
+				throw std::runtime_error(
+					"Halt not by the single bot at the origin in Low");
+			}
+			break;
+
+		case Command::Wait:
+			break;
+
+		case Command::Flip:
+			if(m_harmonics == Harmonics::Low)
+			{
+				m_harmonics = Harmonics::High;
+			}
+			else
+			{
+				m_harmonics = Harmonics::Low;
+			}
+			break;
+
+		case Command::SMove:
+			{
+				assert(command.arg0().lld());
+
+				const Vec d = command.arg0();
+				const Vec tgt = bot.pos() + d;
+				check_position(tgt);
+
+				const Vec unit(d.x / d.mlen(), d.y / d.mlen(), d.z / d.mlen());
+				for(Vec p = bot.pos(); p != tgt; )
+				{
+					p = p + unit;
+					mark_volatile(p);
+					check_empty(p);
+				}
+
+				bot.pos() = tgt;
+				charge(Stats::Moves, 2 * d.mlen());
+
+				break;
+			}
+
+		case Command::LMove:
+			{
+				assert(command.arg0().sld() && command.arg1().sld());
+
+				Vec p = bot.pos();
+				for(const Vec& d : { command.arg0(), command.arg1() })
+				{
+					const Vec tgt = p + d;
+					check_position(tgt);
+
+					const Vec unit(
+						d.x / d.mlen(), d.y / d.mlen(), d.z / d.mlen());
+					while(p != tgt)
+					{
+						p = p + unit;
+						mark_volatile(p);
+						check_empty(p);
+					}
+				}
+
+				bot.pos() = p;
+				charge(Stats::Moves,
+					2 * (command.arg0().mlen() + 2 + command.arg1().mlen()));
+
+				break;
+			}
+
+		case Command::Fission:
+			{
+				assert(command.arg0().nd());
+
+				const Vec tgt = bot.pos() + command.arg0();
+				check_position(tgt);
+				mark_volatile(tgt);
+				check_empty(tgt);
+
+				auto& seeds = bot.seeds();
+				if(seeds.size() < command.m() + 1)
+				{
+					throw std::runtime_error("Not enough seeds for fission");
+				}
+
+				born.push_back(Bot(seeds[0], bot.id(), tgt,
+					std::vector<unsigned>(
+						seeds.begin() + 1, seeds.begin() + 1 + command.m())));
+				seeds.erase(seeds.begin(), seeds.begin() + 1 + command.m());
+
+				charge(Stats::Fissions, 24);
+
+				break;
+			}
+
+		case Command::Fill:
+			{
+				assert(command.arg0().nd());
+
+				const Vec tgt = bot.pos() + command.arg0();
+				mark_volatile(tgt);
+
+				if(m_out_matrix.voxel(tgt))
+				{
+					charge(Stats::Fills, 6);
+				}
+				else
+				{
+					set_voxel(tgt, true);
+					charge(Stats::Fills, 12);
+				}
+
+				break;
+			}
+
+		case Command::Void:
+			{
+				assert(command.arg0().nd());
+
+				const Vec tgt = bot.pos() + command.arg0();
+				mark_volatile(tgt);
+
+				if(m_out_matrix.voxel(tgt))
+				{
+					set_voxel(tgt, false);
+					assert(m_energy >= 12);
+					charge(Stats::Voids, -12);
+				}
+				else
+				{
+					charge(Stats::Voids, 3);
+				}
+
+				break;
+			}
+
+		case Command::FusionP:
+		case Command::FusionS:
+			// Both positions are already volatile.
+			assert(command.arg0().nd());
+			fusions = true;
+			break;
+
+		case Command::GFill:
+		case Command::GVoid:
+			assert(command.arg0().nd());
+			assert(command.arg1().fd());
+			check_position(bot.pos() + command.arg0());
+			check_position(bot.pos() + command.arg0() + command.arg1());
+			groups = true;
+			break;
+
+		default:
+			assert(false);
+		}
+	}
+
+	if(groups)
+	{
+		step_groups();
+	}
+
+	if(m_bots.size() > 1)
+	{
+		std::sort(m_volatile.begin(), m_volatile.end());
+		const auto it = std::adjacent_find(m_volatile.begin(), m_volatile.end());
+		if(it != m_volatile.end())
+		{
+			const unsigned r = m_matrix.r();
+			std::ostringstream os;
+			os << "Interference at " << Vec(*it / r % r, *it / r / r, *it % r);
+			throw std::runtime_error(os.str());
+		}
+	}
+
+	if(fusions)
+	{
+		for(size_t i = 0; i < m_bots.size(); ++i)
+		{
+			if(m_commands[i].type() != Command::FusionP)
+			{
+				continue;
+			}
+
+			Bot& primary = m_bots[i];
+			const Vec tgt = primary.pos() + m_commands[i].arg0();
+
+			size_t j = 0;
+			while(j < m_bots.size()
+				&& !(m_commands[j].type() == Command::FusionS
+					&& m_bots[j].pos() == tgt
+					&& tgt + m_commands[j].arg0() == primary.pos()))
+			{
+				++j;
+			}
+			if(j == m_bots.size())
+			{
+				throw std::runtime_error("FusionP without FusionS");
+			}
+
+			Bot& secondary = m_bots[j];
+			primary.seeds().push_back(secondary.id());
+			primary.seeds().insert(primary.seeds().end(),
+				secondary.seeds().begin(), secondary.seeds().end());
+			std::sort(primary.seeds().begin(), primary.seeds().end());
+			secondary.seeds().clear();
+
+			assert(m_energy >= 24);
+			charge(Stats::Fissions, -24);
+		}
+
+		// Fused secondaries are the only bots giving their ids away.
+		std::vector<Bot> bots;
+		for(size_t i = 0; i < m_bots.size(); ++i)
+		{
+			if(m_commands[i].type() != Command::FusionS)
+			{
+				bots.push_back(m_bots[i]);
+			}
+		}
+
+		if(2 * (m_bots.size() - bots.size())
+			!= size_t(std::count_if(m_commands.begin(), m_commands.end(),
+				[](const Command& c) {
+					return c.type() == Command::FusionP
+						|| c.type() == Command::FusionS;
+				})))
+		{
+			throw std::runtime_error("FusionS without FusionP");
+		}
+
+		m_bots.swap(bots);
+	}
+
+	if(!born.empty())
+	{
+		m_bots.insert(m_bots.end(), born.begin(), born.end());
+		std::sort(m_bots.begin(), m_bots.end(),
+			[](const Bot& a, const Bot& b) { return a.id() < b.id(); });
+	}
+
+	for(const auto& c : m_commands)
+	{
+		m_trace.push_back(c);
+	}
+#ifdef ICFPC_STATS
+	m_stats.peak_trace_bytes =
+		std::max(m_stats.peak_trace_bytes, m_trace.size());
+#endif
+	if(m_sink && m_trace.size() >= Trace::chunk_size)
+	{
+		flush_trace();
+	}
+
+	m_commands.clear();
+}
+
+void System::step_groups()
+{
+	// Bots of a group stand at the distinct corners of the same region.
+
+	struct Member
+	{
+		Command::Type type;
+		Region region;
+		Vec corner;
+	};
+
+	std::vector<Member> members;
+	for(size_t i = 0; i < m_bots.size(); ++i)
+	{
+		const Command& c = m_commands[i];
+		if(c.type() == Command::GFill || c.type() == Command::GVoid)
+		{
+			const Vec corner = m_bots[i].pos() + c.arg0();
+			members.push_back(
+				Member{ c.type(), Region(corner, corner + c.arg1()), corner });
+		}
+	}
+
+	const auto key = [](const Member& m) {
+		return std::make_tuple(m.type,
+			m.region.a.x, m.region.a.y, m.region.a.z,
+			m.region.b.x, m.region.b.y, m.region.b.z,
+			m.corner.x, m.corner.y, m.corner.z);
+	};
+	std::sort(members.begin(), members.end(),
+		[&](const Member& a, const Member& b) { return key(a) < key(b); });
+
+	for(size_t first = 0; first < members.size(); )
+	{
+		const Member& g = members[first];
+
+		size_t last = first + 1;
+		while(last < members.size()
+			&& members[last].type == g.type
+			&& members[last].region.a == g.region.a
+			&& members[last].region.b == g.region.b)
+		{
+			if(members[last].corner == members[last - 1].corner)
+			{
+				throw std::runtime_error("Group bots at the same corner");
+			}
+			++last;
+		}
+
+		const Vec size = g.region.size();
+		const unsigned dim = (size.x > 1) + (size.y > 1) + (size.z > 1);
+		if(last - first != (1u << dim))
+		{
+			throw std::runtime_error("Wrong number of bots in the group");
+		}
+
+		for(int x = g.region.a.x; x <= g.region.b.x; ++x)
+		{
+			for(int y = g.region.a.y; y <= g.region.b.y; ++y)
+			{
+				for(int z = g.region.a.z; z <= g.region.b.z; ++z)
+				{
+					const Vec p(x, y, z);
+					mark_volatile(p);
+
+					const bool full = m_out_matrix.voxel(p);
+					if(g.type == Command::GFill)
+					{
+						if(full)
+						{
+							charge(Stats::Fills, 6);
+						}
+						else
+						{
+							set_voxel(p, true);
+							charge(Stats::Fills, 12);
+						}
+					}
+					else if(full)
+					{
+						set_voxel(p, false);
+						assert(m_energy >= 12);
+						charge(Stats::Voids, -12);
+					}
+					else
+					{
+						charge(Stats::Voids, 3);
+					}
+				}
+			}
+		}
+
+		first = last;
+	}
+}
+
+void System::push_and_step(Command command)
+{
+	assert(m_bots.size() == 1);
+	push(command);
+	step();
+}
+
+void System::check_position(const Vec& p) const
+{
+	if(!p.valid_coordinate()
+		|| p.x >= int(m_matrix.r())
+		|| p.y >= int(m_matrix.r())
+		|| p.z >= int(m_matrix.r()))
+	{
+		std::ostringstream os;
+		os << "Wrong position mat.R = " << m_matrix.r()
+			<< ", pos = " << p;
+		throw std::runtime_error(os.str());
+	}
+}
+
+void System::set_voxel(const Vec& p, bool full)
+{
+	m_out_matrix.set_voxel(p, full);
+	if(!m_track_grounded)
+	{
+		return;
+	}
+
+	if(full)
+	{
+		m_grounded.fill(m_out_matrix, p);
+	}
+	else
+	{
+		m_grounded.voiid(m_out_matrix, p);
+	}
+}
+
+void System::mark_volatile(const Vec& p)
+{
+	if(m_strict)
+	{
+		check_position(p);
+		if(!m_grid.mark(p))
+		{
+			std::ostringstream os;
+			os << "Interference at " << p;
+			throw std::runtime_error(os.str());
+		}
+	}
+	else if(m_bots.size() > 1)
+	{
+		m_volatile.push_back((p.y * m_matrix.r() + p.x) * m_matrix.r() + p.z);
+	}
+}
+
+void System::check_empty(const Vec& p) const
+{
+	if(m_strict && m_out_matrix.voxel(p))
+	{
+		std::ostringstream os;
+		os << "Bot in the full voxel " << p;
+		throw std::runtime_error(os.str());
+	}
+}
+
+void System::move_to(const Vec& tgt, MovementOrder order)
+{
+	// No volatile points in the volume assumed.
+
+	assert(m_bots.size() == 1);
+
+	BotPlan plan(bot_pos());
+	plan.move_to(tgt, order);
+	for(const auto& c : plan.commands())
+	{
+		push_and_step(c);
+	}
+}
+
+void System::plan_path(BotPlan& plan, const Vec& tgt)
+{
+	std::vector<Vec> blocked;
+	for(const auto& b : m_bots)
+	{
+		if(b.pos() != plan.pos())
+		{
+			blocked.push_back(b.pos());
+		}
+	}
+
+	if(!m_planner.move_to(m_out_matrix, plan, tgt, blocked))
+	{
+		std::ostringstream os;
+		os << "No path from " << plan.pos() << " to " << tgt;
+		throw std::runtime_error(os.str());
+	}
+}
+
+void System::run_plans(const std::vector<BotPlan>& plans)
+{
+	assert(plans.size() == m_bots.size());
+
+	size_t steps = 0;
+	for(const auto& p : plans)
+	{
+		steps = std::max(steps, p.commands().size());
+	}
+
+	for(size_t i = 0; i < steps; ++i)
+	{
+		for(const auto& p : plans)
+		{
+			push(i < p.commands().size() ? p.commands()[i] : Command::wait());
+		}
+		step();
+	}
+}
+
+void System::run_plans(
+	const std::vector<BotPlan>& plans, const std::vector<bool>& high)
+{
+	assert(plans.size() == m_bots.size());
+
+	size_t steps = 0;
+	for(const auto& p : plans)
+	{
+		steps = std::max(steps, p.commands().size());
+	}
+	assert(high.size() == steps);
+
+	const auto flip_step = [this]() {
+		push(Command::flip());
+		for(size_t k = 1; k < m_bots.size(); ++k)
+		{
+			push(Command::wait());
+		}
+		step();
+	};
+
+	for(size_t i = 0; i < steps; ++i)
+	{
+		// Going Low for a single step is not worth the flips.
+		const bool to_high = high[i];
+		const bool to_low = !high[i] && (i + 1 == steps || !high[i + 1]);
+		const bool flip = (m_harmonics == Harmonics::Low)
+			? to_high : to_low;
+
+		size_t flipper = plans.size();
+		for(size_t k = 0; k < plans.size() && flip; ++k)
+		{
+			const auto& commands = plans[k].commands();
+			if(i >= commands.size() || commands[i].type() == Command::Wait)
+			{
+				flipper = k;
+				break;
+			}
+		}
+
+		if(flip && flipper == plans.size() && to_high)
+		{
+			flip_step();
+		}
+
+		for(size_t k = 0; k < plans.size(); ++k)
+		{
+			const auto& commands = plans[k].commands();
+			if(k == flipper)
+			{
+				push(Command::flip());
+			}
+			else
+			{
+				push(i < commands.size() ? commands[i] : Command::wait());
+			}
+		}
+		step();
+
+		if(flip && flipper == plans.size() && to_low)
+		{
+			flip_step();
+		}
+	}
+}
+
+namespace {
+const int max_step_len = 15;
+const int max_short_step_len = 5;
+} //
+
+void BotPlan::push(Command command)
+{
+	if(command.type() == Command::SMove)
+	{
+		m_pos = m_pos + command.arg0();
+	}
+	else if(command.type() == Command::LMove)
+	{
+		m_pos = m_pos + command.arg0() + command.arg1();
+	}
+
+	m_commands.push_back(command);
+}
+
+void BotPlan::move_to(const Vec& tgt, System::MovementOrder order)
+{
+	// The bot goes axis by axis as ordered, but the end of every axis leg
+	// may be joined with the beginning of the next one into the LMove. The
+	// visited voxels are the same, so only the steps count changes.
+
+	const Vec x(1, 0, 0);
+	const Vec y(0, 1, 0);
+	const Vec z(0, 0, 1);
+
+	const Vec axes[] = {
+		(order == System::MovementOrder::XZY) ? x : y,
+		z,
+		(order == System::MovementOrder::XZY) ? y : x
+	};
+
+	const Vec d = tgt - m_pos;
+
+	Vec units[3];
+	int lens[3];
+	size_t n = 0;
+	for(const Vec& a : axes)
+	{
+		const int len = a.x * d.x + a.y * d.y + a.z * d.z;
+		if(len != 0)
+		{
+			units[n] = a * ((len > 0) ? 1 : -1);
+			lens[n] = abs(len);
+			++n;
+		}
+	}
+
+	if(n == 0)
+	{
+		return;
+	}
+
+	// Parts of every leg taken by the LMoves before and after it. Longest
+	// parts are the best, so the only choice is which joints are used.
+
+	int heads[3];
+	int tails[3];
+	const auto split = [&](unsigned joints) {
+		int steps = __builtin_popcount(joints);
+		for(size_t i = 0; i < n; ++i)
+		{
+			const bool head = (i > 0) && ((joints >> (i - 1)) & 1);
+			const bool tail = (i + 1 < n) && ((joints >> i) & 1);
+			if(lens[i] < head + tail)
+			{
+				return std::numeric_limits<int>::max();
+			}
+
+			heads[i] = head ? std::min(max_short_step_len, lens[i] - tail) : 0;
+			tails[i] = tail ? std::min(max_short_step_len, lens[i] - heads[i]) : 0;
+			steps += (lens[i] - heads[i] - tails[i] + max_step_len - 1)
+				/ max_step_len;
+		}
+		return steps;
+	};
+
+	unsigned best_joints = 0;
+	int best_steps = split(0);
+	for(unsigned joints = 1; joints < (1u << (n - 1)); ++joints)
+	{
+		const int steps = split(joints);
+		if(steps < best_steps)
+		{
+			best_joints = joints;
+			best_steps = steps;
+		}
+	}
+	split(best_joints);
+
+	for(size_t i = 0; i < n; ++i)
+	{
+		const int rem = lens[i] - heads[i] - tails[i];
+		for(int j = 0; j < rem / max_step_len; ++j)
+		{
+			push(Command::smove(units[i] * max_step_len));
+		}
+		if(rem % max_step_len != 0)
+		{
+			push(Command::smove(units[i] * (rem % max_step_len)));
+		}
+
+		if(tails[i] != 0)
+		{
+			push(Command::lmove(
+				units[i] * tails[i], units[i + 1] * heads[i + 1]));
+		}
+	}
+	assert(m_pos == tgt);
+}
+
+namespace {
+
+const Vec directions[] = {
+	Vec(1, 0, 0), Vec(-1, 0, 0),
+	Vec(0, 1, 0), Vec(0, -1, 0),
+	Vec(0, 0, 1), Vec(0, 0, -1)
+};
+
+int axis_of(const Vec& d)
+{
+	return (d.x != 0) ? 0 : ((d.y != 0) ? 1 : 2);
+}
+
+/// Fewest SMove/LMove steps for the d move in the empty space.
+unsigned free_space_steps(const Vec& d)
+{
+	// Three LMoves along the same pair of axes are never better than two
+	// SMoves, so at most two LMoves touch every pair and at most 20 of
+	// every axis is covered by them. The rest goes by the long SMoves and
+	// only the short deltas are tabulated.
+
+	const int max_short = 2 * 2 * max_short_step_len + max_step_len;
+	const int size = max_short + 1;
+
+	static const std::vector<uint8_t> table = [&]() {
+		std::vector<uint8_t> t(size * size * size);
+		for(int x = 0; x < size; ++x)
+		{
+			for(int y = 0; y < size; ++y)
+			{
+				for(int z = 0; z < size; ++z)
+				{
+					const int n[] = { x, y, z };
+					int best = std::numeric_limits<int>::max();
+					for(int l = 0; l < 27; ++l)
+					{
+						// LMoves along xy, xz, yz.
+						const int xy = l % 3;
+						const int xz = (l / 3) % 3;
+						const int yz = l / 9;
+						const int touching[] = { xy + xz, xy + yz, xz + yz };
+
+						int steps = xy + xz + yz;
+						for(int a = 0; a < 3 && steps < best; ++a)
+						{
+							if(n[a] < touching[a])
+							{
+								steps = best;
+								break;
+							}
+							const int rest = std::max(0,
+								n[a] - touching[a] * max_short_step_len);
+							steps += (rest + max_step_len - 1) / max_step_len;
+						}
+						best = std::min(best, steps);
+					}
+					t[(x * size + y) * size + z] = best;
+				}
+			}
+		}
+		return t;
+	}();
+
+	int n[] = { abs(d.x), abs(d.y), abs(d.z) };
+	unsigned steps = 0;
+	for(auto& a : n)
+	{
+		if(a > max_short)
+		{
+			const int long_steps = (a - max_short + max_step_len - 1) / max_step_len;
+			a -= long_steps * max_step_len;
+			steps += long_steps;
+		}
+	}
+
+	return steps + table[(n[0] * size + n[1]) * size + n[2]];
+}
+
+} //
+
+void VolatilityGrid::next_step(unsigned r)
+{
+	const size_t size = size_t(r) * r * r;
+	if(m_stamps.size() != size)
+	{
+		m_stamps.assign(size, 0);
+		m_r = r;
+		m_epoch = 0;
+	}
+
+	++m_epoch;
+	if(m_epoch == std::numeric_limits<uint32_t>::max())
+	{
+		std::fill(m_stamps.begin(), m_stamps.end(), 0);
+		m_epoch = 1;
+	}
+}
+
+bool VolatilityGrid::mark_segment(const Vec& from, const Vec& d)
+{
+	const int len = d.mlen();
+	const Vec unit(d.x / len, d.y / len, d.z / len);
+	Vec p = from;
+	for(int i = 0; i < len; ++i)
+	{
+		p = p + unit;
+		if(!mark(p))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool VolatilityGrid::mark_region(const Region& region)
+{
+	for(int y = region.a.y; y <= region.b.y; ++y)
+	{
+		for(int x = region.a.x; x <= region.b.x; ++x)
+		{
+			for(int z = region.a.z; z <= region.b.z; ++z)
+			{
+				if(!mark(Vec(x, y, z)))
+				{
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+bool PathPlanner::move_to(const Matrix& m, BotPlan& plan, const Vec& tgt,
+	const std::vector<Vec>& blocked)
+{
+	const int r = m.r();
+	const auto index = [r](const Vec& p) {
+		return (uint32_t(p.y) * r + p.x) * r + p.z;
+	};
+
+	next_epoch(size_t(r) * r * r);
+	for(const auto& b : blocked)
+	{
+		m_stamps[index(b)] = m_epoch * 2;
+	}
+
+	if(!search(m, plan.pos(), tgt))
+	{
+		return false;
+	}
+
+	// Back from tgt.
+
+	const auto position = [r](uint32_t i) {
+		return Vec((i / r) % r, i / (uint32_t(r) * r), i % r);
+	};
+
+	m_path.clear();
+	for(uint32_t i = index(tgt); i != index(plan.pos()); )
+	{
+		const uint32_t from = m_from[i] & 0x3fffffff;
+		const int first_axis = int(m_from[i] >> 30) - 1;
+		const Vec d = position(i) - position(from);
+
+		if(first_axis < 0)
+		{
+			m_path.push_back(Command::smove(d));
+		}
+		else
+		{
+			const Vec first(first_axis == 0 ? d.x : 0,
+				first_axis == 1 ? d.y : 0, first_axis == 2 ? d.z : 0);
+			m_path.push_back(Command::lmove(first, d - first));
+		}
+		i = from;
+	}
+
+	for(auto it = m_path.rbegin(); it != m_path.rend(); ++it)
+	{
+		plan.push(*it);
+	}
+	assert(plan.pos() == tgt);
+
+	return true;
+}
+
+void PathPlanner::next_epoch(size_t size)
+{
+	if(m_stamps.size() != size)
+	{
+		m_stamps.assign(size, 0);
+		m_from.resize(size);
+		m_epoch = 0;
+	}
+
+	++m_epoch;
+	if(m_epoch > std::numeric_limits<uint32_t>::max() / 2)
+	{
+		std::fill(m_stamps.begin(), m_stamps.end(), 0);
+		m_epoch = 1;
+	}
+}
+
+bool PathPlanner::search(const Matrix& m, const Vec& src, const Vec& tgt)
+{
+	// A* in steps with the exact steps count in the empty space as the
+	// estimate.
+
+	const int r = m.r();
+	const auto index = [r](const Vec& p) {
+		return (uint32_t(p.y) * r + p.x) * r + p.z;
+	};
+	const auto free = [&](const Vec& p) {
+		return p.valid_coordinate() && p.x < r && p.y < r && p.z < r
+			&& m_stamps[index(p)] != m_epoch * 2 && !m.voxel(p);
+	};
+	const auto estimate = [&](const Vec& p) {
+		return free_space_steps(tgt - p);
+	};
+	const auto later = [](const Node& a, const Node& b) {
+		// Closer to tgt first among the equal ones.
+		return a.f > b.f || (a.f == b.f && a.g < b.g);
+	};
+
+	if(src == tgt)
+	{
+		return true;
+	}
+	if(!free(tgt))
+	{
+		return false;
+	}
+
+	const uint32_t visited = m_epoch * 2 + 1;
+	const uint32_t tgt_index = index(tgt);
+
+	m_heap.clear();
+	m_heap.push_back(Node{ estimate(src), 0, index(src), index(src) });
+
+	const auto push = [&](const Vec& p, uint32_t g, uint32_t from) {
+		if(m_stamps[index(p)] != visited)
+		{
+			m_heap.push_back(Node{ g + estimate(p), g, index(p), from });
+			std::push_heap(m_heap.begin(), m_heap.end(), later);
+		}
+	};
+
+	while(!m_heap.empty())
+	{
+		std::pop_heap(m_heap.begin(), m_heap.end(), later);
+		const Node node = m_heap.back();
+		m_heap.pop_back();
+
+		if(m_stamps[node.index] == visited)
+		{
+			continue;
+		}
+		m_stamps[node.index] = visited;
+		m_from[node.index] = node.from;
+
+		if(node.index == tgt_index)
+		{
+			return true;
+		}
+
+		const Vec p((node.index / r) % r, node.index / (uint32_t(r) * r),
+			node.index % r);
+		const uint32_t g = node.g + 1;
+
+		for(const Vec& d1 : directions)
+		{
+			Vec q = p;
+			for(int l1 = 1; l1 <= max_step_len; ++l1)
+			{
+				q = q + d1;
+				if(!free(q))
+				{
+					break;
+				}
+
+				push(q, g, node.index);
+
+				if(l1 > max_short_step_len)
+				{
+					continue;
+				}
+
+				for(const Vec& d2 : directions)
+				{
+					if(axis_of(d2) == axis_of(d1))
+					{
+						continue;
+					}
+
+					Vec t = q;
+					for(int l2 = 1; l2 <= max_short_step_len; ++l2)
+					{
+						t = t + d2;
+						if(!free(t))
+						{
+							break;
+						}
+						push(t, g, node.index | ((axis_of(d1) + 1u) << 30));
+					}
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+std::vector<Region> decompose_cuboids(
+	const Matrix& m, const Region& within, const Vec& max_size)
+{
+	const Vec size = within.size();
+	std::vector<bool> covered(size_t(size.x) * size.y * size.z);
+
+	const auto index = [&](int x, int y, int z) {
+		return (size_t(y - within.a.y) * size.x + (x - within.a.x)) * size.z
+			+ (z - within.a.z);
+	};
+	const auto free = [&](int x, int y, int z) {
+		return m.voxel(Vec(x, y, z)) && !covered[index(x, y, z)];
+	};
+	const auto free_rect = [&](int x0, int x1, int y, int z0, int z1) {
+		for(int x = x0; x <= x1; ++x)
+		{
+			for(int z = z0; z <= z1; ++z)
+			{
+				if(!free(x, y, z))
+				{
+					return false;
+				}
+			}
+		}
+		return true;
+	};
+
+	std::vector<Region> cuboids;
+	std::vector<Matrix::Span> spans;
+
+	for(int y = within.a.y; y <= within.b.y; ++y)
+	{
+		for(int x = within.a.x; x <= within.b.x; ++x)
+		{
+			m.row_spans(x, y, spans);
+			for(const auto& span : spans)
+			{
+				for(int z = std::max(span.first, within.a.z);
+					z <= std::min(span.second, within.b.z); ++z)
+				{
+					if(!free(x, y, z))
+					{
+						continue;
+					}
+
+					Vec b(x, y, z);
+					while(b.z + 1 <= within.b.z && b.z + 1 - z < max_size.z
+						&& free(x, y, b.z + 1))
+					{
+						++b.z;
+					}
+					while(b.x + 1 <= within.b.x && b.x + 1 - x < max_size.x
+						&& free_rect(b.x + 1, b.x + 1, y, z, b.z))
+					{
+						++b.x;
+					}
+					while(b.y + 1 <= within.b.y && b.y + 1 - y < max_size.y
+						&& free_rect(x, b.x, b.y + 1, z, b.z))
+					{
+						++b.y;
+					}
+
+					for(int cy = y; cy <= b.y; ++cy)
+					{
+						for(int cx = x; cx <= b.x; ++cx)
+						{
+							for(int cz = z; cz <= b.z; ++cz)
+							{
+								covered[index(cx, cy, cz)] = true;
+							}
+						}
+					}
+
+					cuboids.push_back(Region(Vec(x, y, z), b));
+					z = b.z;
+				}
+			}
+		}
+	}
+
+	return cuboids;
+}
+
+void Tracer::run()
+{
+	PhaseTimer timer(m_system.stats(), "run");
+
+	if(m_system.matrix().r() < 2)
+	{
+		throw std::runtime_error("Matrix too small for this algo");
+	}
+
+	assert(m_system.bots().size() == 1);
+
+	const auto region = m_system.matrix().calc_bounding_region(m_min_y);
+	if(!region.first)
+	{
+		throw std::runtime_error("Empty matrix ?");
+	}
+
+	m_bounding_region = region.second;
+
+	assert(m_bounding_region.a.x > 0
+		&& m_bounding_region.a.x < int(m_system.matrix().r()) - 1);
+	assert(m_bounding_region.a.y >= 0
+		&& m_bounding_region.a.y < int(m_system.matrix().r()) - 1);
+	assert(m_bounding_region.a.z > 0
+		&& m_bounding_region.a.z < int(m_system.matrix().r()) - 1);
+
+	assert(m_bounding_region.b.x > 0
+		&& m_bounding_region.b.x < int(m_system.matrix().r()) - 1);
+	assert(m_bounding_region.b.y >= 0
+		&& m_bounding_region.b.y < int(m_system.matrix().r()) - 1);
+	assert(m_bounding_region.b.z > 0
+		&& m_bounding_region.b.z < int(m_system.matrix().r()) - 1);
+
+	split_slabs();
+	
+	// Move to the starting point. 
+
+	const int initial_y = m_dir == Tracer::Direction::Up
+		? (m_bounding_region.a.y + 1) : (m_bounding_region.b.y + 1);
+
+	place_bots(initial_y);
+
+	const Vec initial_pos = m_homes.front();
+	m_system.move_to(initial_pos, System::MovementOrder::YZX);
+	assert(m_system.bot_pos() == initial_pos);
+
+	spawn_bots();
+
+	///////////////////
+
+	check_layers_grounded();
+
+	// Iterate the matrix.
+
+	for(int y = m_bounding_region.a.y; y <= m_bounding_region.b.y; ++y)
+	{
+		scan_xz_plane(m_system.bot_pos().y - 1);
+
+		if(y < m_bounding_region.b.y)
+		{
+			for(size_t i = 0; i < m_system.bots().size(); ++i)
+			{
+				m_system.push(Command::smove_y(
+					(m_dir == Tracer::Direction::Up) ? 1 : -1));
+			}
+			m_system.step();
+		}
+	}
+
+	///////////////////
+
+	assert(m_system.bot_pos().y == m_bounding_region.b.y + 1
+		|| m_system.bot_pos().y == m_bounding_region.a.y + 1);
+
+	///////////////////
+
+	switch_harmonics(Harmonics::Low);
+
+	gather_bots();
+}
+
+namespace {
+
+/// Whether the model layers below y are grounded by themselves, for the
+/// layers up to top.
+std::vector<bool> layers_grounded_below(const Matrix& m, int top)
+{
+	std::vector<bool> result(top + 1, true);
+
+	Matrix below(m.r());
+	Groundedness g;
+
+	for(int y = 1; y <= top; ++y)
+	{
+		for(int x = 0; x < int(m.r()); ++x)
+		{
+			const Matrix::Word* row = m.row(x, y - 1);
+			for(size_t w = 0; w < m.row_words(); ++w)
+			{
+				for(Matrix::Word bits = row[w]; bits != 0; bits &= bits - 1)
+				{
+					const Vec p(x, y - 1, w * Matrix::word_bits + __builtin_ctzll(bits));
+					below.set_voxel(p, true);
+					g.fill(below, p);
+				}
+			}
+		}
+		result[y] = g.grounded(below);
+	}
+
+	return result;
+}
+
+} //
+
+void Tracer::check_layers_grounded()
+{
+	m_grounded_below = layers_grounded_below(
+		m_system.matrix(), m_bounding_region.b.y);
+}
+
+namespace {
+
+/// Groundedness of the partial y layer standing on the full and grounded
+/// y - 1 layer: every component of the layer must have a supported voxel.
+class LayerGroundedness
+{
+public:
+	LayerGroundedness(const Matrix& m, int y)
+	: m_m(m)
+	, m_y(y)
+	, m_parent(m.r() * m.r() + 1)
+	, m_full(m.r() * m.r())
+	{
+		m_parent.back() = support();
+	}
+
+	void fill(int x, int z)
+	{
+		const uint32_t r = m_m.r();
+		const uint32_t i = x * r + z;
+		if(m_full[i])
+		{
+			return;
+		}
+
+		m_full[i] = true;
+		m_parent[i] = i;
+		++m_floating;
+
+		if(m_y == 0 || m_m.voxel(Vec(x, m_y - 1, z)))
+		{
+			unite(i, support());
+		}
+		if(x > 0 && m_full[i - r])
+		{
+			unite(i, i - r);
+		}
+		if(x + 1 < int(r) && m_full[i + r])
+		{
+			unite(i, i + r);
+		}
+		if(z > 0 && m_full[i - 1])
+		{
+			unite(i, i - 1);
+		}
+		if(z + 1 < int(r) && m_full[i + 1])
+		{
+			unite(i, i + 1);
+		}
+	}
+
+	bool grounded() const
+	{
+		return m_floating == 0;
+	}
+
+private:
+	uint32_t support() const
+	{
+		return m_parent.size() - 1;
+	}
+
+	uint32_t find(uint32_t i)
+	{
+		while(m_parent[i] != i)
+		{
+			m_parent[i] = m_parent[m_parent[i]];
+			i = m_parent[i];
+		}
+		return i;
+	}
+
+	void unite(uint32_t a, uint32_t b)
+	{
+		a = find(a);
+		b = find(b);
+		if(a != b)
+		{
+			m_parent[std::min(a, b)] = std::max(a, b);
+			--m_floating;
+		}
+	}
+
+private:
+	const Matrix& m_m;
+	const int m_y;
+	std::vector<uint32_t> m_parent;
+	std::vector<bool> m_full;
+	size_t m_floating = 0;
+};
+
+} //
+
+std::vector<bool> Tracer::plan_layer_harmonics(int y) const
+{
+	// Voxels of the y layer changed by every step of the plans.
+
+	std::vector<Vec> positions;
+	for(const auto& b : m_system.bots())
+	{
+		positions.push_back(b.pos());
+	}
+
+	std::vector<std::vector<std::pair<int, int>>> changes;
+	for(size_t i = 0; ; ++i)
+	{
+		bool any = false;
+		changes.emplace_back();
+		for(size_t k = 0; k < m_plans.size(); ++k)
+		{
+			const auto& commands = m_plans[k].commands();
+			if(i >= commands.size())
+			{
+				continue;
+			}
+			any = true;
+
+			const Command& c = commands[i];
+			Vec& pos = positions[k];
+			switch(c.type())
+			{
+			case Command::SMove:
+				pos = pos + c.arg0();
+				break;
+
+			case Command::LMove:
+				pos = pos + c.arg0() + c.arg1();
+				break;
+
+			case Command::Fill:
+			case Command::Void:
+				changes.back().emplace_back(pos.x + c.arg0().x, pos.z + c.arg0().z);
+				break;
+
+			case Command::GFill:
+			case Command::GVoid:
+				{
+					const Region r(pos + c.arg0(), pos + c.arg0() + c.arg1());
+					for(int x = r.a.x; x <= r.b.x; ++x)
+					{
+						for(int z = r.a.z; z <= r.b.z; ++z)
+						{
+							changes.back().emplace_back(x, z);
+						}
+					}
+					break;
+				}
+
+			default:
+				break;
+			}
+		}
+
+		if(!any)
+		{
+			changes.pop_back();
+			break;
+		}
+	}
+
+	std::vector<bool> high(changes.size(), true);
+	if(!m_grounded_below[y])
+	{
+		return high;
+	}
+
+	// Fills go forward. Voids go backward from the empty layer, and the
+	// layer before the step is the one after the next step.
+
+	LayerGroundedness layer(m_system.matrix(), y);
+	if(m_dir == Direction::Up)
+	{
+		for(size_t i = 0; i < changes.size(); ++i)
+		{
+			for(const auto& c : changes[i])
+			{
+				layer.fill(c.first, c.second);
+			}
+			high[i] = !layer.grounded();
+		}
+	}
+	else
+	{
+		for(size_t i = changes.size(); i-- > 0; )
+		{
+			high[i] = !layer.grounded();
+			for(const auto& c : changes[i])
+			{
+				layer.fill(c.first, c.second);
+			}
+		}
+	}
+
+	return high;
+}
+
+void Tracer::switch_harmonics(Harmonics h)
+{
+	if(m_system.harmonics() != h)
+	{
+		assert(h == Harmonics::High || m_system.grounded());
+		step_first(Command::flip());
+	}
+}
+
+void Tracer::halt()
+{
+	PhaseTimer timer(m_system.stats(), "halt");
+
+	m_system.move_to(Vec());
+	assert(m_system.bot_pos() == Vec());
+
+	m_system.push_and_step(Command::halt());
+}
+
+namespace {
+
+/// Plans a single bot to void the voids voxels, top down, and then to fill
+/// the fills ones, bottom up, standing next to each of them, preferably
+/// above, and to come back to the origin. m is the model before the
+/// changes. high marks the steps after which the model is not grounded.
+/// @return false if a voxel or the origin is out of reach, the model ends
+/// up not grounded or the plan takes more than max_steps.
+bool plan_differences(Matrix m, const Matrix& voids, const Matrix& fills,
+	int min_y, size_t max_steps, BotPlan& plan, std::vector<bool>& high)
+{
+	const int r = m.r();
+
+	std::vector<Vec> deltas;
+	for(int y = 1; y >= -1; --y)
+	{
+		for(int x = -1; x <= 1; ++x)
+		{
+			for(int z = -1; z <= 1; ++z)
+			{
+				if(Vec(x, y, z).nd())
+				{
+					deltas.push_back(Vec(x, y, z));
+				}
+			}
+		}
+	}
+	std::stable_sort(deltas.begin(), deltas.end(),
+		[](const Vec& a, const Vec& b) {
+			return a.y > b.y || (a.y == b.y && a.mlen() < b.mlen());
+		});
+
+	PathPlanner planner;
+	Groundedness groundedness;
+	groundedness.reset();
+	bool grounded = groundedness.grounded(m);
+
+	const auto change = [&](const Vec& p, bool full) {
+		for(const auto& d : deltas)
+		{
+			const Vec s = p + d;
+			if(!s.valid_coordinate() || s.x >= r || s.y >= r || s.z >= r
+				|| m.voxel(s) || !planner.move_to(m, plan, s))
+			{
+				continue;
+			}
+			high.resize(plan.commands().size(), !grounded);
+
+			plan.push(full ? Command::fill(p - s) : Command::voiid(p - s));
+			m.set_voxel(p, full);
+			if(full)
+			{
+				groundedness.fill(m, p);
+			}
+			else
+			{
+				groundedness.voiid(m, p);
+			}
+			grounded = groundedness.grounded(m);
+			high.push_back(!grounded);
+
+			return plan.commands().size() <= max_steps;
+		}
+		return false;
+	};
+
+	// Rows snake along z, so the next voxel is usually a step away.
+	const auto change_layer = [&](const Matrix& diff, int y, bool full) {
+		std::vector<Matrix::Span> spans;
+		for(int x = 0; x < r; ++x)
+		{
+			diff.row_spans(x, y, spans);
+			if(x % 2)
+			{
+				std::reverse(spans.begin(), spans.end());
+			}
+			for(const auto& span : spans)
+			{
+				for(int i = 0; i <= span.second - span.first; ++i)
+				{
+					const int z = (x % 2) ? span.second - i : span.first + i;
+					if(!change(Vec(x, y, z), full))
+					{
+						return false;
+					}
+				}
+			}
+		}
+		return true;
+	};
+
+	for(int y = r - 1; y >= min_y; --y)
+	{
+		if(voids.layer_any(y) && !change_layer(voids, y, false))
+		{
+			return false;
+		}
+	}
+	for(int y = min_y; y < r; ++y)
+	{
+		if(fills.layer_any(y) && !change_layer(fills, y, true))
+		{
+			return false;
+		}
+	}
+
+	if(!grounded || !planner.move_to(m, plan, Vec()))
+	{
+		return false;
+	}
+	high.resize(plan.commands().size(), false);
+
+	return plan.commands().size() <= max_steps;
+}
+
+} //
+
+System reassemble(System& system, const Matrix& tgt, unsigned bots,
+	Tracer::Sweep sweep)
+{
+	const Matrix& src = system.matrix();
+	const int common = src.common_layers(tgt);
+	const uint64_t r = src.r();
+
+	// The rebuild of the layers above the common ones bounds the energy
+	// of the changes of their voxels, a Low step costs at least 3 R^3.
+	CostModel::Plan rebuild;
+	rebuild.bots = bots;
+	rebuild.sweep = sweep;
+	rebuild.min_y = common;
+	uint64_t budget = CostModel(tgt).estimate(rebuild).energy;
+	rebuild.dir = Tracer::Direction::Down;
+	budget += CostModel(src).estimate(rebuild).energy;
+
+	system.set_out_matrix(src);
+	if(system.bots().size() == 1)
+	{
+		Matrix voids = src;
+		voids.subtract(tgt);
+		Matrix fills = tgt;
+		fills.subtract(src);
+
+		BotPlan plan(system.bot_pos());
+		std::vector<bool> high;
+		const bool planned = plan_differences(src, voids, fills, common,
+			budget / (3 * r * r * r + 20), plan, high);
+		if(planned)
+		{
+			System result(system, tgt);
+			{
+				PhaseTimer timer(result.stats(), "differences");
+				result.run_plans({ plan }, high);
+			}
+
+			if(result.energy() - system.energy() < budget)
+			{
+				PhaseTimer timer(result.stats(), "halt");
+				result.push_and_step(Command::halt());
+				return result;
+			}
+		}
+	}
+
+	if(src.calc_bounding_region(common).first)
+	{
+		Disassembler d(system, bots, sweep, common);
+		d.run();
+	}
+
+	System result(system, tgt);
+	if(tgt.calc_bounding_region(common).first)
+	{
+		Assembler a(result, bots, sweep, common);
+		a.run();
+	}
+
+	{
+		PhaseTimer timer(result.stats(), "halt");
+
+		result.move_to(Vec());
+		assert(result.bot_pos() == Vec());
+
+		result.push_and_step(Command::halt());
+	}
+
+	return result;
+}
+
+CostModel::CostModel(const Matrix& m)
+: m_r(m.r())
+, m_layers(m.r())
+, m_counts(size_t(m.r()) * (m.r() + 1))
+, m_fresh_runs(size_t(m.r()) * (m.r() + 1))
+, m_runs(size_t(m.r()) * m.r())
+{
+	const int r = m_r;
+
+	std::vector<Matrix::Span> prev;
+	std::vector<Matrix::Span> spans;
+
+	int top = -1;
+	for(int y = 0; y < r; ++y)
+	{
+		m_layers[y] = m.layer_summary(y);
+		if(m_layers[y].empty())
+		{
+			continue;
+		}
+		top = y;
+
+		const size_t base = size_t(y) * (r + 1);
+		prev.clear();
+		for(int x = 0; x < r; ++x)
+		{
+			m.row_spans(x, y, spans);
+
+			// Both lists are sorted.
+			size_t fresh = 0;
+			auto it = prev.begin();
+			for(const auto& span : spans)
+			{
+				while(it != prev.end() && *it < span)
+				{
+					++it;
+				}
+				if(it == prev.end() || *it != span)
+				{
+					++fresh;
+				}
+			}
+
+			m_counts[base + x + 1] = m_counts[base + x] + m.row_popcount(x, y);
+			m_fresh_runs[base + x + 1] = m_fresh_runs[base + x] + fresh;
+			m_runs[size_t(y) * r + x] = spans.size();
+
+			prev.swap(spans);
+		}
+	}
+
+	if(top < 0)
+	{
+		return;
+	}
+
+	const std::vector<bool> grounded = layers_grounded_below(m, top);
+	for(int y = 0; y <= top; ++y)
+	{
+		if(grounded[y])
+		{
+			continue;
+		}
+
+		if(!m_high_spans.empty() && m_high_spans.back().second == y - 1)
+		{
+			m_high_spans.back().second = y;
+		}
+		else
+		{
+			m_high_spans.push_back(Span(y, y));
+		}
+	}
+}
+
+double CostModel::high_share(Tracer::Direction dir, Tracer::Sweep sweep,
+	unsigned slabs)
+{
+	// Fitted on FA186 for 4..40 bots.
+	const bool up = dir == Tracer::Direction::Up;
+	const double share = (sweep == Tracer::Sweep::Rectangles)
+		? ((up ? 0.065 : 0.12) - 0.0035 * slabs)
+		: ((up ? 0.02 : 0.018) + (up ? 0.0009 : 0.0012) * slabs);
+	return std::max(0.0, share);
+}
+
+CostModel::Estimate CostModel::estimate(const Plan& plan) const
+{
+	const int r = m_r;
+
+	// Same bounding region and slabs as the Tracer.
+
+	bool found = false;
+	Region region;
+	for(int y = std::max(plan.min_y, 0); y < r; ++y)
+	{
+		const Matrix::LayerSummary& l = m_layers[y];
+		if(l.empty())
+		{
+			continue;
+		}
+
+		if(!found)
+		{
+			found = true;
+			region = l.region;
+		}
+		else
+		{
+			region = Region(
+				Vec(std::min(region.a.x, l.region.a.x), region.a.y,
+					std::min(region.a.z, l.region.a.z)),
+				Vec(std::max(region.b.x, l.region.b.x), y,
+					std::max(region.b.z, l.region.b.z)));
+		}
+	}
+
+	Estimate result;
+	if(!found)
+	{
+		return result;
+	}
+
+	const bool rectangles = plan.sweep == Tracer::Sweep::Rectangles;
+	const unsigned team = rectangles ? 4 : 1;
+	const int min_width = rectangles ? 2 : 1;
+
+	const unsigned n = std::max(1u, std::min(plan.bots / team,
+		unsigned(region.size().x / min_width)));
+
+	std::vector<size_t> columns(region.size().x);
+	size_t total = 0;
+	for(int y = region.a.y; y <= region.b.y; ++y)
+	{
+		for(int x = region.a.x; x <= region.b.x; ++x)
+		{
+			columns[x - region.a.x] += rows_sum(m_counts, y, x, x);
+		}
+	}
+	for(size_t c : columns)
+	{
+		total += c;
+	}
+
+	std::vector<int> slabs(1, region.a.x);
+	size_t acc = 0;
+	for(int x = region.a.x + 1; x <= region.b.x && slabs.size() < n; ++x)
+	{
+		acc += columns[x - 1 - region.a.x];
+
+		if(x - slabs.back() < min_width)
+		{
+			continue;
+		}
+
+		const size_t columns_left = region.b.x - x + 1;
+		const size_t slabs_left = n - slabs.size();
+		if(acc * n >= total * slabs.size()
+			|| columns_left <= slabs_left * min_width)
+		{
+			slabs.push_back(x);
+		}
+	}
+	slabs.push_back(region.b.x + 1);
+
+	// Layers are swept in lockstep, the slowest slab sets the pace. A
+	// single bot spends a step to get over every voxel and another to
+	// handle it, or a step to get over every stop of a swath, up to three
+	// voxels. A team gets into formation and issues the group command
+	// in four to five steps per rectangle, the wider the slab the longer
+	// the way between the rectangles. Fitted on the sample models.
+
+	std::vector<bool> high(r);
+	for(const auto& spans : { std::cref(m_high_spans), std::cref(plan.high_spans) })
+	{
+		for(const Span& span : spans.get())
+		{
+			for(int y = std::max(span.first, 0); y <= std::min(span.second, r - 1); ++y)
+			{
+				high[y] = true;
+			}
+		}
+	}
+
+	const double share = high_share(plan.dir, plan.sweep, n);
+
+	double high_steps = 0;
+	for(int y = region.a.y; y <= region.b.y; ++y)
+	{
+		size_t layer_steps = 0;
+		for(size_t t = 0; t + 1 < slabs.size(); ++t)
+		{
+			const int x0 = slabs[t];
+			const int x1 = slabs[t + 1] - 1;
+
+			size_t steps = 0;
+			if(plan.sweep == Tracer::Sweep::Voxels)
+			{
+				const size_t count = rows_sum(m_counts, y, x0, x1);
+				steps = count ? (2 * count + 4) : 0;
+			}
+			else if(plan.sweep == Tracer::Sweep::Swaths)
+			{
+				const size_t count = rows_sum(m_counts, y, x0, x1);
+				const int rows = std::min(x1 - x0 + 1, 3);
+				steps = count ? (count + count / rows + 4) : 0;
+			}
+			else
+			{
+				const size_t rects = m_runs[size_t(y) * r + x0]
+					+ ((x1 > x0) ? rows_sum(m_fresh_runs, y, x0 + 1, x1) : 0);
+				steps = rects
+					? size_t(rects * (4.3 + (x1 - x0 + 1) / 54.0)) + 2 : 0;
+			}
+			layer_steps = std::max(layer_steps, steps);
+		}
+
+		// Getting to the next layer.
+		layer_steps += (y < region.b.y) ? 1 : 0;
+
+		result.steps += layer_steps;
+		high_steps += high[y] ? layer_steps : (layer_steps * share);
+	}
+
+	// Getting to the start, spawning every bot with a fission and a flight,
+	// gathering them back the same way and returning to halt.
+
+	const unsigned bots = n * team;
+	const Vec start(region.a.x, (plan.dir == Tracer::Direction::Up)
+		? (region.a.y + 1) : (region.b.y + 1), region.a.z);
+	const int travel = (start.x + start.y + start.z + max_step_len - 1)
+		/ max_step_len + 3;
+
+	result.steps += 2 * travel + 3 * (bots - 1) + 1;
+	result.high_steps = uint64_t(high_steps + 0.5);
+
+	const uint64_t volume = uint64_t(r) * r * r;
+	result.energy = result.steps * (3 * volume + 20 * bots)
+		+ result.high_steps * 27 * volume;
+
+	// Every filled voxel costs 12, every voided one gives 12 back.
+	if(plan.dir == Tracer::Direction::Up)
+	{
+		result.energy += 12 * total;
+	}
+	else
+	{
+		result.energy -= std::min<uint64_t>(result.energy, 12 * total);
+	}
+
+	return result;
+}
+
+unsigned Tracer::team_size() const
+{
+	return (m_sweep == Sweep::Rectangles) ? 4 : 1;
+}
+
+void Tracer::split_slabs()
+{
+	const Matrix& m = m_system.matrix();
+	const Region& r = m_bounding_region;
+
+	// Team of four needs two columns for its formation. Narrow swaths
+	// are still better than fewer bots.
+	const int min_width = (m_sweep == Sweep::Rectangles) ? 2 : 1;
+
+	const unsigned n = std::max(1u, std::min(m_bots / team_size(),
+		unsigned(r.size().x / min_width)));
+
+	// Columns are balanced by the voxels count.
+
+	std::vector<size_t> counts(r.size().x);
+	size_t total = 0;
+	for(int x = r.a.x; x <= r.b.x; ++x)
+	{
+		for(int y = r.a.y; y <= r.b.y; ++y)
+		{
+			counts[x - r.a.x] += m.row_popcount(x, y);
+		}
+		total += counts[x - r.a.x];
+	}
+
+	m_slabs.assign(1, r.a.x);
+
+	size_t acc = 0;
+	for(int x = r.a.x + 1; x <= r.b.x && m_slabs.size() < n; ++x)
+	{
+		acc += counts[x - 1 - r.a.x];
+
+		if(x - m_slabs.back() < min_width)
+		{
+			continue;
+		}
+
+		const size_t columns_left = r.b.x - x + 1;
+		const size_t slabs_left = n - m_slabs.size();
+		if(acc * n >= total * m_slabs.size()
+			|| columns_left <= slabs_left * min_width)
+		{
+			m_slabs.push_back(x);
+		}
+	}
+
+	assert(m_slabs.size() == n);
+}
+
+std::pair<int, int> Tracer::team_x_range(size_t team) const
+{
+	// Nobody works outside of the bounding region, so the outer teams may
+	// use all of the space up to the matrix sides.
+
+	const int lo = (team == 0) ? 0 : m_slabs[team];
+	const int hi = (team + 1 < m_slabs.size())
+		? (m_slabs[team + 1] - 1) : (m_system.matrix().r() - 1);
+	return std::make_pair(lo, hi);
+}
+
+void Tracer::place_bots(int y)
+{
+	const int z = m_bounding_region.a.z;
+
+	m_homes.clear();
+	for(size_t t = 0; t < m_slabs.size(); ++t)
+	{
+		if(team_size() == 1)
+		{
+			m_homes.push_back(Vec(m_slabs[t], y, z));
+		}
+		else
+		{
+			const auto corners
+				= formation(team_x_range(t), Region(Vec(m_slabs[t], y, z),
+					Vec(m_slabs[t], y, z)));
+			for(const auto& c : corners)
+			{
+				m_homes.push_back(c);
+			}
+		}
+	}
+}
+
+std::array<Vec, 4> Tracer::formation(
+	const std::pair<int, int>& x_range, const Region& rect) const
+{
+	// The degenerate sides of the rectangle are widened.
+
+	int x0 = rect.a.x;
+	int x1 = rect.b.x;
+	if(x0 == x1)
+	{
+		if(x1 + 1 <= x_range.second)
+		{
+			++x1;
+		}
+		else
+		{
+			--x0;
+		}
+	}
+	assert(x0 >= x_range.first && x1 <= x_range.second);
+
+	int z0 = rect.a.z;
+	int z1 = rect.b.z;
+	if(z0 == z1)
+	{
+		if(z1 + 1 < int(m_system.matrix().r()))
+		{
+			++z1;
+		}
+		else
+		{
+			--z0;
+		}
+	}
+
+	const int y = rect.a.y;
+	return {{ Vec(x0, y, z0), Vec(x0, y, z1), Vec(x1, y, z0), Vec(x1, y, z1) }};
+}
+
+namespace {
+
+Vec sign(const Vec& d)
+{
+	return Vec((d.x > 0) - (d.x < 0), (d.y > 0) - (d.y < 0), (d.z > 0) - (d.z < 0));
+}
+
+void pad_plans(BotPlan* plans, size_t count)
+{
+	size_t size = 0;
+	for(size_t i = 0; i < count; ++i)
+	{
+		size = std::max(size, plans[i].commands().size());
+	}
+	for(size_t i = 0; i < count; ++i)
+	{
+		plans[i].pad(size);
+	}
+}
+
+/// Moves the pair of bots along the line, the one moving away from the
+/// other goes first so their paths never cross.
+void plan_pair_move(BotPlan& lo, BotPlan& hi,
+	const Vec& lo_tgt, const Vec& hi_tgt, bool along_x)
+{
+	const bool lo_first = along_x
+		? (lo_tgt.x <= lo.pos().x) : (lo_tgt.z <= lo.pos().z);
+
+	BotPlan& first = lo_first ? lo : hi;
+	BotPlan& second = lo_first ? hi : lo;
+
+	first.move_to(lo_first ? lo_tgt : hi_tgt);
+	second.pad(first.commands().size());
+	second.move_to(lo_first ? hi_tgt : lo_tgt);
+}
+
+/// Moves the team standing at the corners of a rectangle, in the
+/// formation() order, to the given corners: along x by rows, then along z
+/// by columns.
+void plan_formation_move(BotPlan* team, const std::array<Vec, 4>& corners)
+{
+	assert(corners[0].x < corners[2].x && corners[0].z < corners[1].z);
+
+	pad_plans(team, 4);
+
+	plan_pair_move(team[0], team[2],
+		Vec(corners[0].x, team[0].pos().y, team[0].pos().z),
+		Vec(corners[2].x, team[2].pos().y, team[2].pos().z), true);
+	plan_pair_move(team[1], team[3],
+		Vec(corners[1].x, team[1].pos().y, team[1].pos().z),
+		Vec(corners[3].x, team[3].pos().y, team[3].pos().z), true);
+	pad_plans(team, 4);
+
+	plan_pair_move(team[0], team[1], corners[0], corners[1], false);
+	plan_pair_move(team[2], team[3], corners[2], corners[3], false);
+	pad_plans(team, 4);
+}
+
+} //
+
+void Tracer::spawn_bots()
+{
+	// Every new bot is split off the previous one towards its home and
+	// flies the rest of the way.
+
+	const int n = m_homes.size();
+
+	for(int k = 0; k + 1 < n; ++k)
+	{
+		assert(m_system.bots().size() == size_t(k + 1));
+		assert(m_system.bots()[k].pos() == m_homes[k]);
+
+		const Vec d = sign(m_homes[k + 1] - m_homes[k]);
+		assert(d.y == 0);
+
+		for(int i = 0; i <= k; ++i)
+		{
+			m_system.push((i == k)
+				? Command::fission(d, n - 2 - k)
+				: Command::wait());
+		}
+		m_system.step();
+
+		m_plans.assign(k + 2, BotPlan());
+		m_plans[k + 1] = BotPlan(m_system.bots()[k + 1].pos());
+		m_plans[k + 1].move_to(m_homes[k + 1]);
+		m_system.run_plans(m_plans);
+	}
+}
+
+void Tracer::gather_bots()
+{
+	// Every bot gets back home, then the last bot flies to the previous
+	// one and fuses into it, and so on.
+
+	const int n = m_system.bots().size();
+	if(n == 1)
+	{
+		return;
+	}
+
+	const int y = m_system.bot_pos().y;
+
+	m_plans.resize(n);
+	for(int k = 0; k < n; ++k)
+	{
+		m_plans[k] = BotPlan(m_system.bots()[k].pos());
+	}
+
+	if(team_size() == 1)
+	{
+		for(int k = 0; k < n; ++k)
+		{
+			m_plans[k].move_to(m_homes[k].xz(y));
+		}
+	}
+	else
+	{
+		for(int k = 0; k < n; k += 4)
+		{
+			plan_formation_move(&m_plans[k], {{ m_homes[k].xz(y),
+				m_homes[k + 1].xz(y), m_homes[k + 2].xz(y), m_homes[k + 3].xz(y) }});
+		}
+	}
+	m_system.run_plans(m_plans);
+
+	for(int k = n - 1; k > 0; --k)
+	{
+		const Vec d = sign(m_homes[k] - m_homes[k - 1]);
+
+		m_plans.assign(k + 1, BotPlan());
+		m_plans[k] = BotPlan(m_system.bots()[k].pos());
+		m_plans[k].move_to((m_homes[k - 1] + d).xz(y));
+		m_system.run_plans(m_plans);
+
+		for(int i = 0; i <= k; ++i)
+		{
+			if(i == k - 1)
+			{
+				m_system.push(Command::fusion_p(d));
+			}
+			else if(i == k)
+			{
+				m_system.push(Command::fusion_s(d * -1));
+			}
+			else
+			{
+				m_system.push(Command::wait());
+			}
+		}
+		m_system.step();
+	}
+
+	assert(m_system.bots().size() == 1);
+}
+
+void Tracer::step_first(Command command)
+{
+	m_system.push(command);
+	for(size_t i = 1; i < m_system.bots().size(); ++i)
+	{
+		m_system.push(Command::wait());
+	}
+	m_system.step();
+}
+
+void Tracer::scan_xz_plane(int y)
+{
+	assert(y >= 0);
+
+	const auto& bots = m_system.bots();
+	assert(bots.size() == m_slabs.size() * team_size());
+
+	m_plans.resize(bots.size());
+	for(size_t k = 0; k < bots.size(); ++k)
+	{
+		m_plans[k] = BotPlan(bots[k].pos());
+	}
+
+	for(size_t t = 0; t < m_slabs.size(); ++t)
+	{
+		const int x0 = m_slabs[t];
+		const int x1 = (t + 1 < m_slabs.size())
+			? (m_slabs[t + 1] - 1) : m_bounding_region.b.x;
+
+		if(m_sweep == Sweep::Voxels)
+		{
+			plan_xz_plane(m_plans[t], y, x0, x1);
+		}
+		else if(m_sweep == Sweep::Swaths)
+		{
+			plan_swaths(m_plans[t], y, x0, x1);
+		}
+		else
+		{
+			plan_rectangles(&m_plans[t * 4], t, y, x0, x1);
+		}
+	}
+
+	m_system.run_plans(m_plans, plan_layer_harmonics(y));
+}
+
+void Tracer::plan_xz_plane(BotPlan& plan, int y, int x0, int x1) const
+{
+	assert(plan.pos().y == y + 1
+		&& "bot must be one level above");
+
+	const auto curr_region
+		= m_system.matrix().calc_bounding_region_y(y, x0, x1);
+
+	if(curr_region.first)
+	{
+		const std::vector<Vec> vertices = {
+			curr_region.second.a,
+			Vec(curr_region.second.a.x, y, curr_region.second.b.z),
+			curr_region.second.b,
+			Vec(curr_region.second.b.x, y, curr_region.second.a.z)
+		};
+
+		const auto closest_vertex_it = std::min_element(
+			begin(vertices), end(vertices),
+			[&](const auto& a, const auto& b) {
+				return (a - plan.pos()).mlen()
+			    < (b - plan.pos()).mlen();
+		});
+		assert(closest_vertex_it != vertices.end());
+
+		const auto furthest_vertex_it = vertices.begin()
+			+ ((closest_vertex_it - vertices.begin()) + 2) % vertices.size();
+		assert(furthest_vertex_it != vertices.end());
+
+		plan.move_to(closest_vertex_it->xz(plan.pos().y));
+		
+		const int x_sweep_dir
+			= (closest_vertex_it->x < furthest_vertex_it->x) ? 1 : -1;
+		int z_sweep_dir
+			= (closest_vertex_it->z < furthest_vertex_it->z) ? 1 : -1;
+		int src_z = closest_vertex_it->z;
+		int tgt_z = furthest_vertex_it->z;
+
+		std::vector<Matrix::Span> spans;
+		for(int x = closest_vertex_it->x;
+				x != furthest_vertex_it->x + x_sweep_dir;
+				x += x_sweep_dir)
+		{
+			// Only the filled runs of the row, in the sweep direction.
+			m_system.matrix().row_spans(x, y, spans);
+			const int z_min = std::min(src_z, tgt_z);
+			const int z_max = std::max(src_z, tgt_z);
+			for(size_t i = 0; i < spans.size(); ++i)
+			{
+				const auto& span
+					= spans[(z_sweep_dir > 0) ? i : (spans.size() - 1 - i)];
+				const int first = std::max(span.first, z_min);
+				const int last = std::min(span.second, z_max);
+
+				for(int z = (z_sweep_dir > 0) ? first : last;
+						z >= first && z <= last;
+						z += z_sweep_dir)
+				{
+					plan.move_to(Vec(x, plan.pos().y, z));
+					plan.push(voxel_command(Vec(x, y, z) - plan.pos()));
+				}
+			}
+			std::swap(src_z, tgt_z);
+			z_sweep_dir *= -1;
+		}
+	}
+}
+
+void Tracer::plan_swaths(BotPlan& plan, int y, int x0, int x1) const
+{
+	assert(plan.pos().y == y + 1
+		&& "bot must be one level above");
+
+	const Matrix& m = m_system.matrix();
+
+	const auto curr_region = m.calc_bounding_region_y(y, x0, x1);
+	if(!curr_region.first)
+	{
+		return;
+	}
+	const Region& region = curr_region.second;
+
+	// Stripes are swept from the x side closer to the bot, the bot flies
+	// over the middle row and also reaches the side ones (nd of (+-1, -1, 0)).
+
+	const int x_sweep_dir
+		= (std::abs(plan.pos().x - region.a.x) <= std::abs(plan.pos().x - region.b.x))
+		? 1 : -1;
+	int z_sweep_dir
+		= (std::abs(plan.pos().z - region.a.z) <= std::abs(plan.pos().z - region.b.z))
+		? 1 : -1;
+
+	const int first_x = (x_sweep_dir > 0) ? region.a.x : region.b.x;
+	const int last_x = (x_sweep_dir > 0) ? region.b.x : region.a.x;
+
+	std::vector<Matrix::Span> row;
+	std::vector<Matrix::Span> spans;
+	for(int x = first_x; (last_x - x) * x_sweep_dir >= 0; x += 3 * x_sweep_dir)
+	{
+		// Side rows beyond the region are empty, the middle one stays in it.
+		const int side = x + 2 * x_sweep_dir;
+		const int mid = ((last_x - side) * x_sweep_dir >= 0)
+			? (x + x_sweep_dir) : x;
+		const int lo = std::max(std::min(x, side), region.a.x);
+		const int hi = std::min(std::max(x, side), region.b.x);
+
+		spans.clear();
+		for(int sx = lo; sx <= hi; ++sx)
+		{
+			m.row_spans(sx, y, row);
+			spans.insert(spans.end(), row.begin(), row.end());
+		}
+		if(spans.empty())
+		{
+			continue;
+		}
+
+		// Stops are the z of the runs joined over the stripe rows.
+		std::sort(spans.begin(), spans.end());
+		size_t joined = 0;
+		for(size_t i = 1; i < spans.size(); ++i)
+		{
+			if(spans[i].first <= spans[joined].second + 1)
+			{
+				spans[joined].second = std::max(spans[joined].second, spans[i].second);
+			}
+			else
+			{
+				spans[++joined] = spans[i];
+			}
+		}
+		spans.resize(joined + 1);
+
+		for(size_t i = 0; i < spans.size(); ++i)
+		{
+			const auto& span
+				= spans[(z_sweep_dir > 0) ? i : (spans.size() - 1 - i)];
+
+			for(int z = (z_sweep_dir > 0) ? span.first : span.second;
+					z >= span.first && z <= span.second;
+					z += z_sweep_dir)
+			{
+				plan.move_to(Vec(mid, plan.pos().y, z));
+				for(int sx = lo; sx <= hi; ++sx)
+				{
+					if(m.voxel(Vec(sx, y, z)))
+					{
+						plan.push(voxel_command(Vec(sx, y, z) - plan.pos()));
+					}
+				}
+			}
+		}
+		z_sweep_dir *= -1;
+	}
+}
+
+void Tracer::plan_rectangles(
+	BotPlan* team, size_t t, int y, int x0, int x1) const
+{
+	const int r = m_system.matrix().r();
+
+	std::vector<Region> rects = decompose_cuboids(m_system.matrix(),
+		Region(Vec(x0, y, 0), Vec(x1, y, r - 1)),
+		Vec(max_group_size, 1, max_group_size));
+
+	// Nearest rectangle goes next.
+
+	Vec pos = team[0].pos();
+	for(auto it = rects.begin(); it != rects.end(); ++it)
+	{
+		const auto closest_it = std::min_element(it, rects.end(),
+			[&](const Region& a, const Region& b) {
+				return (a.a.xz(pos.y) - pos).mlen() < (b.a.xz(pos.y) - pos).mlen();
+			});
+		std::iter_swap(it, closest_it);
+
+		const Region& rect = *it;
+		const auto corners = formation(team_x_range(t),
+			Region(rect.a.xz(y + 1), rect.b.xz(y + 1)));
+
+		plan_formation_move(team, corners);
+
+		for(size_t i = 0; i < corners.size(); ++i)
+		{
+			const Vec& c = corners[i];
+			const bool working
+				= (c.x == rect.a.x || c.x == rect.b.x)
+				&& (c.z == rect.a.z || c.z == rect.b.z);
+
+			if(!working)
+			{
+				team[i].push(Command::wait());
+			}
+			else if(rect.a == rect.b)
+			{
+				team[i].push(voxel_command(Vec(0, -1, 0)));
+			}
+			else
+			{
+				const Vec corner(c.x, y, c.z);
+				const Vec opposite(
+					rect.a.x + rect.b.x - c.x, y, rect.a.z + rect.b.z - c.z);
+				team[i].push(region_command(corner - c, opposite - corner));
+			}
+		}
+
+		pos = team[0].pos();
+	}
+}
+
+Command Assembler::voxel_command(const Vec& d) const
+{
+	return Command::fill(d);
+}
+
+Command Assembler::region_command(const Vec& nd, const Vec& fd) const
+{
+	return Command::gfill(nd, fd);
+}
+
+Command Disassembler::voxel_command(const Vec& d) const
+{
+	return Command::voiid(d);
+}
+
+Command Disassembler::region_command(const Vec& nd, const Vec& fd) const
+{
+	return Command::gvoid(nd, fd);
+}
+
+namespace {
+
+unsigned lowest_seed(uint64_t seeds)
+{
+	assert(seeds);
+	return __builtin_ctzll(seeds);
+}
+
+} //
+
+Interpreter::Interpreter(const Matrix& src)
+: m_matrix(src)
+, m_r(src.r())
+{
+	// The source model is checked with the first Low step changing it.
+	m_groundedness.reset();
+
+	uint64_t seeds = 0;
+	for(unsigned bid = 2; bid <= max_bots; ++bid)
+	{
+		seeds |= uint64_t(1) << bid;
+	}
+	m_bots.push_back(BotState{ 1, Vec(), seeds });
+}
+
+void Interpreter::run(const Trace& trace)
+{
+	try
+	{
+		auto it = trace.begin();
+		const auto end = trace.end();
+		while(it != end)
+		{
+			if(m_halted)
+			{
+				fail("commands after Halt");
+			}
+
+			m_commands.clear();
+			for(size_t i = 0; i < m_bots.size(); ++i)
+			{
+				if(it == end)
+				{
+					fail("trace ends in the middle of the step");
+				}
+				m_commands.push_back(*it);
+				++it;
+			}
+
+			step();
+		}
+	}
+	catch(const std::runtime_error& e)
+	{
+		const std::string what = e.what();
+		if(what.compare(0, 5, "Step ") == 0)
+		{
+			throw;
+		}
+		fail(what);
+	}
+}
+
+void Interpreter::step()
+{
+	const int64_t rrr = int64_t(m_r) * m_r * m_r;
+	const Harmonics initial_harmonics = m_harmonics;
+
+	m_energy += (m_harmonics == Harmonics::High ? 30 : 3) * rrr;
+	m_energy += 20 * m_bots.size();
+
+	m_volatile.clear();
+	m_changed = false;
+	m_fusions.clear();
+	m_groups.clear();
+	m_born.clear();
+
+	for(size_t i = 0; i < m_bots.size(); ++i)
+	{
+		BotState& bot = m_bots[i];
+		const Command& command = m_commands[i];
+		const Vec c = bot.pos;
+
+		switch(command.type())
+		{
+		case Command::Halt:
+			if(m_bots.size() != 1 || c != Vec()
+				|| m_harmonics != Harmonics::Low)
+			{
+				fail("Halt requires the single bot at the origin "
+					"and Low harmonics");
+			}
+			m_halted = true;
+			mark_volatile(c);
+			break;
+
+		case Command::Wait:
+			mark_volatile(c);
+			break;
+
+		case Command::Flip:
+			m_harmonics = (m_harmonics == Harmonics::Low)
+				? Harmonics::High : Harmonics::Low;
+			mark_volatile(c);
+			break;
+
+		case Command::SMove:
+			mark_volatile(c);
+			move(bot, command.arg0());
+			m_energy += 2 * command.arg0().mlen();
+			break;
+
+		case Command::LMove:
+			mark_volatile(c);
+			move(bot, command.arg0());
+			move(bot, command.arg1());
+			m_energy += 2 * (command.arg0().mlen() + 2 + command.arg1().mlen());
+			break;
+
+		case Command::Fission:
+			{
+				const Vec tgt = c + command.arg0();
+				check_bounds(tgt);
+				if(m_matrix.voxel(tgt))
+				{
+					fail("Fission into the full voxel");
+				}
+
+				const unsigned seeds = __builtin_popcountll(bot.seeds);
+				if(seeds == 0 || command.m() + 1 > seeds)
+				{
+					fail("not enough seeds for Fission");
+				}
+
+				BotState child{ lowest_seed(bot.seeds), tgt, 0 };
+				bot.seeds &= ~(uint64_t(1) << child.bid);
+				for(unsigned j = 0; j < command.m(); ++j)
+				{
+					const uint64_t seed = uint64_t(1) << lowest_seed(bot.seeds);
+					bot.seeds &= ~seed;
+					child.seeds |= seed;
+				}
+				m_born.push_back(child);
+
+				mark_volatile(c);
+				mark_volatile(tgt);
+				m_energy += 24;
+				break;
+			}
+
+		case Command::Fill:
+			{
+				const Vec tgt = c + command.arg0();
+				check_bounds(tgt);
+				mark_volatile(c);
+				mark_volatile(tgt);
+				if(m_matrix.voxel(tgt))
+				{
+					m_energy += 6;
+				}
+				else
+				{
+					set_voxel(tgt, true);
+					m_energy += 12;
+				}
+				break;
+			}
+
+		case Command::Void:
+			{
+				const Vec tgt = c + command.arg0();
+				check_bounds(tgt);
+				mark_volatile(c);
+				mark_volatile(tgt);
+				if(m_matrix.voxel(tgt))
+				{
+					set_voxel(tgt, false);
+					m_energy -= 12;
+				}
+				else
+				{
+					m_energy += 3;
+				}
+				break;
+			}
+
+		case Command::FusionP:
+		case Command::FusionS:
+			{
+				const Vec tgt = c + command.arg0();
+				check_bounds(tgt);
+				mark_volatile(c);
+				m_fusions.push_back(Pending{ i, command.type(), tgt, Region() });
+				break;
+			}
+
+		case Command::GFill:
+		case Command::GVoid:
+			{
+				const Vec a = c + command.arg0();
+				const Vec b = a + command.arg1();
+				check_bounds(a);
+				check_bounds(b);
+				mark_volatile(c);
+				m_groups.push_back(Pending{ i, command.type(), a, Region(a, b) });
+				break;
+			}
+
+		default:
+			fail("undefined command");
+		}
+	}
+
+	// Fusions, each primary must meet its secondary.
+
+	for(const auto& p : m_fusions)
+	{
+		if(p.type != Command::FusionP)
+		{
+			continue;
+		}
+
+		const auto s_it = std::find_if(m_fusions.begin(), m_fusions.end(),
+			[&](const Pending& s) {
+				return s.type == Command::FusionS
+					&& m_bots[s.bot].pos == p.tgt
+					&& s.tgt == m_bots[p.bot].pos;
+			});
+		if(s_it == m_fusions.end())
+		{
+			fail("FusionP without FusionS");
+		}
+
+		BotState& primary = m_bots[p.bot];
+		BotState& secondary = m_bots[s_it->bot];
+		primary.seeds |= secondary.seeds | (uint64_t(1) << secondary.bid);
+		secondary.bid = 0;
+		m_energy -= 24;
+	}
+
+	const size_t fused = std::count_if(m_bots.begin(), m_bots.end(),
+		[](const BotState& b) { return b.bid == 0; });
+	if(fused * 2 != m_fusions.size())
+	{
+		fail("FusionS without FusionP");
+	}
+
+	// Groups, bots of a group are at the distinct corners of its region.
+
+	std::sort(m_groups.begin(), m_groups.end(),
+		[](const Pending& a, const Pending& b) {
+			return std::tie(a.type, a.region.a.x, a.region.a.y, a.region.a.z,
+					a.region.b.x, a.region.b.y, a.region.b.z, a.tgt.x, a.tgt.y, a.tgt.z)
+				< std::tie(b.type, b.region.a.x, b.region.a.y, b.region.a.z,
+					b.region.b.x, b.region.b.y, b.region.b.z, b.tgt.x, b.tgt.y, b.tgt.z);
+		});
+
+	for(size_t first = 0; first < m_groups.size(); )
+	{
+		const Pending& g = m_groups[first];
+		size_t last = first + 1;
+		while(last < m_groups.size()
+			&& m_groups[last].type == g.type
+			&& m_groups[last].region.a == g.region.a
+			&& m_groups[last].region.b == g.region.b)
+		{
+			if(m_groups[last].tgt == m_groups[last - 1].tgt)
+			{
+				fail("group bots at the same corner");
+			}
+			++last;
+		}
+
+		const Vec size = g.region.size();
+		const unsigned dim = (size.x > 1) + (size.y > 1) + (size.z > 1);
+		if(last - first != (1u << dim))
+		{
+			fail("wrong number of bots in the group");
+		}
+
+		for(int x = g.region.a.x; x <= g.region.b.x; ++x)
+		{
+			for(int y = g.region.a.y; y <= g.region.b.y; ++y)
+			{
+				for(int z = g.region.a.z; z <= g.region.b.z; ++z)
+				{
+					const Vec p(x, y, z);
+					mark_volatile(p);
+					const bool full = m_matrix.voxel(p);
+					if(g.type == Command::GFill)
+					{
+						if(full)
+						{
+							m_energy += 6;
+						}
+						else
+						{
+							set_voxel(p, true);
+							m_energy += 12;
+						}
+					}
+					else
+					{
+						if(full)
+						{
+							set_voxel(p, false);
+							m_energy -= 12;
+						}
+						else
+						{
+							m_energy += 3;
+						}
+					}
+				}
+			}
+		}
+
+		first = last;
+	}
+
+	// Interference.
+
+	if(m_bots.size() > 1 || !m_groups.empty())
+	{
+		std::sort(m_volatile.begin(), m_volatile.end());
+		const auto it = std::adjacent_find(m_volatile.begin(), m_volatile.end());
+		if(it != m_volatile.end())
+		{
+			std::ostringstream os;
+			os << "interference at " << coord(*it);
+			fail(os.str());
+		}
+	}
+
+	// Bots set.
+
+	if(fused || !m_born.empty())
+	{
+		m_bots.erase(std::remove_if(m_bots.begin(), m_bots.end(),
+			[](const BotState& b) { return b.bid == 0; }), m_bots.end());
+		m_bots.insert(m_bots.end(), m_born.begin(), m_born.end());
+		std::sort(m_bots.begin(), m_bots.end(),
+			[](const BotState& a, const BotState& b) { return a.bid < b.bid; });
+	}
+
+	// Groundedness, kept incrementally: O(1) after fills, the neighbours of
+	// the voids are searched, a full flood only after many voids in High.
+
+	if(m_harmonics == Harmonics::Low
+		&& (m_changed || initial_harmonics == Harmonics::High)
+		&& !m_groundedness.grounded(m_matrix))
+	{
+		fail("ungrounded voxels in Low harmonics");
+	}
+
+	++m_steps;
+}
+
+void Interpreter::move(BotState& bot, const Vec& d)
+{
+	const Vec tgt = bot.pos + d;
+	check_bounds(tgt);
+
+	const Vec unit(
+		(d.x > 0) - (d.x < 0), (d.y > 0) - (d.y < 0), (d.z > 0) - (d.z < 0));
+	for(Vec p = bot.pos; p != tgt; )
+	{
+		p = p + unit;
+		if(m_matrix.voxel(p))
+		{
+			std::ostringstream os;
+			os << "move through the full voxel " << p;
+			fail(os.str());
+		}
+		mark_volatile(p);
+	}
+
+	bot.pos = tgt;
+}
+
+void Interpreter::mark_volatile(const Vec& c)
+{
+	m_volatile.push_back(index(c));
+}
+
+void Interpreter::check_bounds(const Vec& c) const
+{
+	if(!c.valid_coordinate() || c.x >= m_r || c.y >= m_r || c.z >= m_r)
+	{
+		std::ostringstream os;
+		os << "out of bounds " << c;
+		fail(os.str());
+	}
+}
+
+void Interpreter::set_voxel(const Vec& c, bool full)
+{
+	m_matrix.set_voxel(c, full);
+	if(full)
+	{
+		m_groundedness.fill(m_matrix, c);
+	}
+	else
+	{
+		m_groundedness.voiid(m_matrix, c);
+	}
+	m_changed = true;
+}
+
+void Interpreter::fail(const std::string& what) const
+{
+	std::ostringstream os;
+	os << "Step " << m_steps << ": " << what;
+	throw std::runtime_error(os.str());
+}
 
-			if(m_arg0.second.x != 0)
+Trace read_trace_file(const std::string& path)
+{
+	const MappedFile f(path);
+	Trace result;
+	result.append(f.data(), f.size());
+	return result;
+}
+
+namespace {
+
+bool is_move(const Command& c)
+{
+	return c.type() == Command::Wait || c.type() == Command::SMove
+		|| c.type() == Command::LMove;
+}
+
+bool changes_matrix(const Command& c)
+{
+	return c.type() == Command::Fill || c.type() == Command::Void
+		|| c.type() == Command::GFill || c.type() == Command::GVoid;
+}
+
+/// Both are linear coordinate differences.
+bool collinear(const Vec& a, const Vec& b)
+{
+	return (a.x != 0) == (b.x != 0) && (a.y != 0) == (b.y != 0);
+}
+
+/// Keeps no neighbouring legs collinear and no zero legs.
+void push_leg(std::vector<Vec>& legs, const Vec& d)
+{
+	if(!legs.empty() && collinear(legs.back(), d))
+	{
+		const Vec sum = legs.back() + d;
+		legs.pop_back();
+		if(sum != Vec())
+		{
+			legs.push_back(sum);
+		}
+	}
+	else
+	{
+		legs.push_back(d);
+	}
+}
+
+void push_legs(std::vector<Vec>& legs, const Command& c)
+{
+	if(c.type() == Command::SMove)
+	{
+		push_leg(legs, c.arg0());
+	}
+	else if(c.type() == Command::LMove)
+	{
+		push_leg(legs, c.arg0());
+		push_leg(legs, c.arg1());
+	}
+}
+
+/// Positions, ids and seeds of the bots, no rules are checked.
+class BotTracker
+{
+public:
+	BotTracker()
+	{
+		std::vector<unsigned> seeds;
+		for(unsigned id = 2; id <= max_bots; ++id)
+		{
+			seeds.push_back(id);
+		}
+		m_bots.push_back(Bot(1, 0, Vec(), seeds));
+	}
+
+	size_t size() const
+	{
+		return m_bots.size();
+	}
+
+	void positions(std::vector<Vec>& pos) const
+	{
+		pos.clear();
+		for(const auto& bot : m_bots)
+		{
+			pos.push_back(bot.pos());
+		}
+	}
+
+	/// @throw std::runtime_error
+	void step(const Command* commands)
+	{
+		std::vector<Bot> born;
+		bool fusions = false;
+		for(size_t i = 0; i < m_bots.size(); ++i)
+		{
+			Bot& bot = m_bots[i];
+			const Command& c = commands[i];
+			switch(c.type())
+			{
+			case Command::SMove:
+				bot.pos() = bot.pos() + c.arg0();
+				break;
+
+			case Command::LMove:
+				bot.pos() = bot.pos() + c.arg0() + c.arg1();
+				break;
+
+			case Command::Fission:
+				{
+					auto& seeds = bot.seeds();
+					if(seeds.size() < c.m() + 1)
+					{
+						throw std::runtime_error("Not enough seeds for fission");
+					}
+					born.push_back(Bot(seeds[0], bot.id(), bot.pos() + c.arg0(),
+						std::vector<unsigned>(
+							seeds.begin() + 1, seeds.begin() + 1 + c.m())));
+					seeds.erase(seeds.begin(), seeds.begin() + 1 + c.m());
+					break;
+				}
+
+			case Command::FusionP:
+			case Command::FusionS:
+				fusions = true;
+				break;
+
+			default:
+				break;
+			}
+		}
+
+		if(fusions)
+		{
+			std::vector<Bot> bots;
+			for(size_t i = 0; i < m_bots.size(); ++i)
+			{
+				if(commands[i].type() == Command::FusionS)
+				{
+					continue;
+				}
+				if(commands[i].type() == Command::FusionP)
+				{
+					const Vec tgt = m_bots[i].pos() + commands[i].arg0();
+					size_t j = 0;
+					while(j < m_bots.size()
+						&& !(commands[j].type() == Command::FusionS
+							&& m_bots[j].pos() == tgt))
+					{
+						++j;
+					}
+					if(j == m_bots.size())
+					{
+						throw std::runtime_error("FusionP without FusionS");
+					}
+
+					auto& seeds = m_bots[i].seeds();
+					seeds.push_back(m_bots[j].id());
+					seeds.insert(seeds.end(), m_bots[j].seeds().begin(),
+						m_bots[j].seeds().end());
+					std::sort(seeds.begin(), seeds.end());
+				}
+				bots.push_back(m_bots[i]);
+			}
+			m_bots.swap(bots);
+		}
+
+		if(!born.empty())
+		{
+			m_bots.insert(m_bots.end(), born.begin(), born.end());
+			std::sort(m_bots.begin(), m_bots.end(),
+				[](const Bot& a, const Bot& b) { return a.id() < b.id(); });
+		}
+	}
+
+private:
+	std::vector<Bot> m_bots;
+};
+
+} //
+
+Trace TraceOptimizer::run(const Trace& trace)
+{
+	// Steps are split by the bots count alone.
+	Steps steps;
+	steps.starts.push_back(0);
+	size_t bots = 1;
+	size_t born = 0;
+	for(const auto& c : trace)
+	{
+		steps.commands.push_back(c);
+		if(c.type() == Command::Fission)
+		{
+			++born;
+		}
+		else if(c.type() == Command::FusionS)
+		{
+			--born;
+		}
+
+		if(steps.commands.size() - steps.starts.back() == bots)
+		{
+			steps.starts.push_back(steps.commands.size());
+			bots += born;
+			born = 0;
+		}
+	}
+	if(steps.starts.back() != steps.commands.size())
+	{
+		throw std::runtime_error("Trace ends in the middle of a step");
+	}
+
+	const auto total = [](const Stats& stats) {
+		return std::accumulate(stats.energy.begin(), stats.energy.end(),
+			int64_t(0));
+	};
+
+	m_input = count(steps);
+	drop_flips(steps);
+	const Steps merged = merge_moves(steps);
+	m_output = count(merged);
+	assert(total(m_output) <= total(m_input));
+	m_saved = total(m_input) - total(m_output);
+
+	Trace result;
+	for(const auto& c : merged.commands)
+	{
+		result.push_back(c);
+	}
+	return result;
+}
+
+Stats TraceOptimizer::stats(const Stats& input) const
+{
+	if(!Stats::enabled)
+	{
+		return input;
+	}
+
+	// Unsigned counts may go below the input ones in between.
+	Stats result = input;
+	result.low_steps += m_output.low_steps - m_input.low_steps;
+	result.high_steps += m_output.high_steps - m_input.high_steps;
+	for(size_t i = 0; i < result.commands.size(); ++i)
+	{
+		result.commands[i] += m_output.commands[i] - m_input.commands[i];
+	}
+	for(size_t i = 0; i < result.energy.size(); ++i)
+	{
+		result.energy[i] += m_output.energy[i] - m_input.energy[i];
+	}
+	return result;
+}
+
+Stats TraceOptimizer::count(const Steps& steps) const
+{
+	const int64_t rrr = int64_t(m_r) * m_r * m_r;
+
+	bool high = false;
+	Stats result;
+	for(size_t i = 0; i < steps.size(); ++i)
+	{
+		if(high)
+		{
+			++result.high_steps;
+			result.energy[Stats::FieldHigh] += 30 * rrr;
+		}
+		else
+		{
+			++result.low_steps;
+			result.energy[Stats::FieldLow] += 3 * rrr;
+		}
+		result.energy[Stats::Upkeep] +=
+			20 * (steps.starts[i + 1] - steps.starts[i]);
+
+		for(size_t j = steps.starts[i]; j < steps.starts[i + 1]; ++j)
+		{
+			const Command& c = steps.commands[j];
+			++result.commands[c.type()];
+			switch(c.type())
+			{
+			case Command::Flip:
+				high = !high;
+				break;
+
+			case Command::SMove:
+				result.energy[Stats::Moves] += 2 * c.arg0().mlen();
+				break;
+
+			case Command::LMove:
+				result.energy[Stats::Moves] +=
+					2 * (c.arg0().mlen() + 2 + c.arg1().mlen());
+				break;
+
+			case Command::Fission:
+				result.energy[Stats::Fissions] += 24;
+				break;
+
+			case Command::FusionP:
+				result.energy[Stats::Fissions] -= 24;
+				break;
+
+			default:
+				break;
+			}
+		}
+	}
+	return result;
+}
+
+void TraceOptimizer::drop_flips(Steps& steps) const
+{
+	// The single Flip to High and the single Flip back with no fills or
+	// voids in all the steps from one to another: the matrix was grounded
+	// before, so it stays grounded in Low.
+
+	const auto flips = [&](size_t i, bool& changes) {
+		size_t result = 0;
+		changes = false;
+		for(size_t j = steps.starts[i]; j < steps.starts[i + 1]; ++j)
+		{
+			result += (steps.commands[j].type() == Command::Flip);
+			changes = changes || changes_matrix(steps.commands[j]);
+		}
+		return result;
+	};
+
+	const auto wait_flip = [&](size_t i) {
+		for(size_t j = steps.starts[i]; j < steps.starts[i + 1]; ++j)
+		{
+			if(steps.commands[j].type() == Command::Flip)
+			{
+				steps.commands[j] = Command::wait();
+			}
+		}
+	};
+
+	bool high = false;
+	size_t i = 0;
+	while(i < steps.size())
+	{
+		bool changes = false;
+		const size_t n = flips(i, changes);
+		if(high || n != 1 || changes)
+		{
+			high = (high != (n % 2 == 1));
+			++i;
+			continue;
+		}
+
+		size_t j = i + 1;
+		size_t m = 0;
+		while(j < steps.size() && (m = flips(j, changes)) == 0 && !changes)
+		{
+			++j;
+		}
+
+		if(j < steps.size() && m == 1 && !changes)
+		{
+			wait_flip(i);
+			wait_flip(j);
+			i = j + 1;
+		}
+		else
+		{
+			// The steps up to j have no flips.
+			high = true;
+			i = j;
+		}
+	}
+}
+
+TraceOptimizer::Steps TraceOptimizer::merge_moves(const Steps& steps) const
+{
+	Steps result;
+	result.starts.push_back(0);
+
+	// The moves step waiting for its merges and the positions before it.
+	std::vector<Command> pending;
+	std::vector<Vec> pending_pos;
+	std::vector<Command> merged;
+
+	const auto flush = [&]() {
+		if(std::any_of(pending.begin(), pending.end(),
+			[](const Command& c) { return c.type() != Command::Wait; }))
+		{
+			result.commands.insert(
+				result.commands.end(), pending.begin(), pending.end());
+			result.starts.push_back(result.commands.size());
+		}
+		pending.clear();
+	};
+
+	BotTracker bots;
+	for(size_t i = 0; i < steps.size(); ++i)
+	{
+		const Command* begin = steps.commands.data() + steps.starts[i];
+		const Command* end = steps.commands.data() + steps.starts[i + 1];
+
+		if(std::all_of(begin, end, is_move))
+		{
+			if(!pending.empty()
+				&& merge_step(pending.data(), begin, pending_pos, merged))
+			{
+				pending.swap(merged);
+			}
+			else
+			{
+				flush();
+				pending.assign(begin, end);
+				bots.positions(pending_pos);
+			}
+		}
+		else
+		{
+			flush();
+			result.commands.insert(result.commands.end(), begin, end);
+			result.starts.push_back(result.commands.size());
+		}
+
+		bots.step(begin);
+	}
+	flush();
+
+	return result;
+}
+
+bool TraceOptimizer::merge_step(const Command* a, const Command* b,
+	const std::vector<Vec>& pos, std::vector<Command>& merged) const
+{
+	merged.clear();
+	m_volatile.clear();
+	for(size_t i = 0; i < pos.size(); ++i)
+	{
+		m_legs.clear();
+		push_legs(m_legs, a[i]);
+		push_legs(m_legs, b[i]);
+
+		if(m_legs.empty())
+		{
+			merged.push_back(Command::wait());
+		}
+		else if(m_legs.size() == 1 && m_legs[0].lld())
+		{
+			merged.push_back(Command::smove(m_legs[0]));
+		}
+		else if(m_legs.size() == 2 && m_legs[0].sld() && m_legs[1].sld())
+		{
+			merged.push_back(Command::lmove(m_legs[0], m_legs[1]));
+		}
+		else
+		{
+			return false;
+		}
+
+		if(pos.size() > 1)
+		{
+			Vec p = pos[i];
+			m_volatile.push_back((p.y * m_r + p.x) * m_r + p.z);
+			for(const Vec& d : m_legs)
+			{
+				const Vec unit(
+					d.x / d.mlen(), d.y / d.mlen(), d.z / d.mlen());
+				for(int k = 0; k < d.mlen(); ++k)
+				{
+					p = p + unit;
+					m_volatile.push_back((p.y * m_r + p.x) * m_r + p.z);
+				}
+			}
+		}
+	}
+
+	std::sort(m_volatile.begin(), m_volatile.end());
+	return std::adjacent_find(m_volatile.begin(), m_volatile.end())
+		== m_volatile.end();
+}
+
+namespace {
+
+const char index_magic[8] = { 'N', 'B', 'T', 'I', 'D', 'X', '2', '\0' };
+
+/// FNV-1a of the words, tells the source models apart.
+uint64_t matrix_hash(const Matrix& m)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for(int y = 0; y < int(m.r()); ++y)
+	{
+		const Matrix::Word* words = m.layer(y);
+		for(size_t i = 0; i < m.layer_words(); ++i)
+		{
+			hash = (hash ^ words[i]) * 1099511628211ull;
+		}
+	}
+	return hash;
+}
+
+/// Little endian, whatever the host is.
+template<typename T>
+void put(std::ostream& s, T v)
+{
+	uint8_t bytes[sizeof(T)];
+	for(size_t i = 0; i < sizeof(T); ++i)
+	{
+		bytes[i] = uint8_t(uint64_t(v) >> (8 * i));
+	}
+	s.write(reinterpret_cast<const char*>(bytes), sizeof(T));
+}
+
+template<typename T>
+T get(std::istream& s)
+{
+	uint8_t bytes[sizeof(T)];
+	if(!s.read(reinterpret_cast<char*>(bytes), sizeof(T)))
+	{
+		throw std::runtime_error("Truncated trace index");
+	}
+	uint64_t v = 0;
+	for(size_t i = 0; i < sizeof(T); ++i)
+	{
+		v |= uint64_t(bytes[i]) << (8 * i);
+	}
+	return T(v);
+}
+
+class NullTraceSink : public TraceSink
+{
+public:
+	void write(const uint8_t*, size_t) override
+	{
+	}
+};
+
+/// Runs up to steps whole steps from p.
+/// @throw std::runtime_error
+void replay(System& s, const uint8_t*& p, const uint8_t* end, uint64_t steps)
+{
+	for(uint64_t i = 0; i < steps && p != end; ++i)
+	{
+		for(size_t b = s.bots().size(); b > 0; --b)
+		{
+			if(p == end)
+			{
+				throw std::runtime_error("Trace ends in the middle of a step");
+			}
+			Command c;
+			p += Command::decode(p, end - p, c);
+			s.push(c);
+		}
+		s.step();
+	}
+}
+
+} //
+
+void TraceIndex::write(const std::string& trace_path, const Matrix& src,
+	const std::string& path, unsigned interval, unsigned snapshot_every)
+{
+	assert(interval > 0 && snapshot_every > 0);
+
+	const MappedFile trace(trace_path);
+	const unsigned r = src.r();
+
+	std::ofstream f(path, std::ios::binary);
+	if(!f)
+	{
+		throw std::runtime_error("Can't open " + path);
+	}
+	f.write(index_magic, sizeof(index_magic));
+	put<uint8_t>(f, r);
+	put<uint32_t>(f, interval);
+	put<uint32_t>(f, snapshot_every);
+	put<uint64_t>(f, matrix_hash(src));
+
+	NullTraceSink sink;
+	System s(Matrix(r), &sink);
+	s.set_out_matrix(src);
+
+	std::vector<Entry> entries;
+	Matrix previous = src;
+	const uint8_t* p = trace.data();
+	const uint8_t* end = trace.data() + trace.size();
+	for(;;)
+	{
+		entries.push_back({ s.steps(), uint64_t(p - trace.data()),
+			uint64_t(f.tellp()) });
+
+		put<uint64_t>(f, s.energy());
+		put<uint8_t>(f, s.harmonics() == Harmonics::High);
+		put<uint32_t>(f, s.bots().size());
+		for(const auto& bot : s.bots())
+		{
+			put<uint32_t>(f, bot.id());
+			put<uint32_t>(f, bot.parent_id());
+			put<uint8_t>(f, bot.pos().x);
+			put<uint8_t>(f, bot.pos().y);
+			put<uint8_t>(f, bot.pos().z);
+			put<uint32_t>(f, bot.seeds().size());
+			for(unsigned seed : bot.seeds())
 			{
-				a = 0x14;
-				b = (0x1f & (m_arg0.second.x + 15));
+				put<uint32_t>(f, seed);
 			}
-			else if(m_arg0.second.y != 0)
+		}
+
+		const Matrix& m = s.out_matrix();
+		if((entries.size() - 1) % snapshot_every == 0)
+		{
+			for(int y = 0; y < int(r); ++y)
 			{
-				a = 0x24;
-				b = (0x1f & (m_arg0.second.y + 15));
+				for(size_t i = 0; i < m.layer_words(); ++i)
+				{
+					put<uint64_t>(f, m.layer(y)[i]);
+				}
 			}
-			else if(m_arg0.second.z != 0)
+		}
+		else
+		{
+			const Matrix changed = previous ^ m;
+			put<uint64_t>(f, changed.popcount());
+			for(int y = changed.next_layer(0); y < int(r);
+				y = changed.next_layer(y + 1))
 			{
-				a = 0x34;
-				b = (0x1f & (m_arg0.second.z + 15));
+				for(int x = changed.next_row(0, y); x < int(r);
+					x = changed.next_row(x + 1, y))
+				{
+					const Matrix::Word* row = changed.row(x, y);
+					for(size_t w = 0; w < changed.row_words(); ++w)
+					{
+						for(Matrix::Word bits = row[w]; bits != 0;
+							bits &= bits - 1)
+						{
+							const int z = w * Matrix::word_bits + lowest_bit(bits);
+							put<uint32_t>(f, (uint32_t(y) * r + x) * r + z);
+						}
+					}
+				}
 			}
-
-			s.write(reinterpret_cast<char*>(&a), 1);
-			s.write(reinterpret_cast<char*>(&b), 1);
-
-			break;
 		}
+		previous = m;
 
-	case Fill:
+		if(p == end)
 		{
-			assert(m_arg0.first);
-			assert(m_arg0.second.nd());
-
-			unsigned a
-				= 9 * (m_arg0.second.x + 1)
-				+ 3 * (m_arg0.second.y + 1)
-				+ 1 * (m_arg0.second.z + 1);
-
-			a = (a << 3) | 0x3;
-
-			s.write(reinterpret_cast<char*>(&a), 1);
-
 			break;
 		}
+		replay(s, p, end, interval);
+	}
 
-	case Void:
-		{
-			assert(m_arg0.first);
-			assert(m_arg0.second.nd());
+	const uint64_t table = f.tellp();
+	for(const auto& e : entries)
+	{
+		put<uint64_t>(f, e.step);
+		put<uint64_t>(f, e.offset);
+		put<uint64_t>(f, e.position);
+	}
+	put<uint64_t>(f, table);
+	put<uint64_t>(f, entries.size());
 
-			unsigned a
-				= 9 * (m_arg0.second.x + 1)
-				+ 3 * (m_arg0.second.y + 1)
-				+ 1 * (m_arg0.second.z + 1);
+	if(!f)
+	{
+		throw std::runtime_error("Can't write " + path);
+	}
+}
 
-			a = (a << 3) | 0x2;
+TraceIndex::TraceIndex(const std::string& path)
+: m_f(path, std::ios::binary)
+{
+	if(!m_f)
+	{
+		throw std::runtime_error("Can't open " + path);
+	}
 
-			s.write(reinterpret_cast<char*>(&a), 1);
+	char magic[sizeof(index_magic)];
+	if(!m_f.read(magic, sizeof(magic))
+		|| !std::equal(magic, magic + sizeof(magic), index_magic))
+	{
+		throw std::runtime_error("Not a trace index " + path);
+	}
+	m_r = get<uint8_t>(m_f);
+	m_interval = get<uint32_t>(m_f);
+	m_snapshot_every = get<uint32_t>(m_f);
+	m_source_hash = get<uint64_t>(m_f);
+	if(m_r == 0 || m_r > 250 || m_interval == 0 || m_snapshot_every == 0)
+	{
+		throw std::runtime_error("Wrong trace index header in " + path);
+	}
 
-			break;
-		}
+	m_f.seekg(-16, std::ios::end);
+	const uint64_t table = get<uint64_t>(m_f);
+	const uint64_t count = get<uint64_t>(m_f);
 
-	default:
-		assert(false);
+	m_f.seekg(table);
+	for(uint64_t i = 0; i < count; ++i)
+	{
+		Entry e;
+		e.step = get<uint64_t>(m_f);
+		e.offset = get<uint64_t>(m_f);
+		e.position = get<uint64_t>(m_f);
+		m_entries.push_back(e);
+	}
+	if(m_entries.empty())
+	{
+		throw std::runtime_error("No checkpoints in " + path);
 	}
 }
 
-System::System(const Matrix& matrix)
-: m_matrix(matrix)
-, m_out_matrix(matrix.r())
+size_t TraceIndex::find(uint64_t step) const
 {
-	m_trace.reserve(5 * 1000 * 1000);
+	const auto it = std::upper_bound(m_entries.begin(), m_entries.end(), step,
+		[](uint64_t s, const Entry& e) { return s < e.step; });
+	return (it == m_entries.begin()) ? 0 : (it - m_entries.begin() - 1);
 }
 
-System::System(const System& src, const Matrix& matrix)
-: System(matrix)
+System TraceIndex::resume(size_t i, const Matrix& src,
+	const Matrix& matrix) const
 {
-	assert(!src.m_out_matrix.calc_bounding_region().first);
-	m_harmonics = src.m_harmonics;
-	m_energy = src.m_energy;
-	m_pos = src.m_pos;
-	assert(!src.m_curr_command.first);
-	m_trace = src.m_trace;
-}
+	assert(i < m_entries.size());
+	if(src.r() != m_r || matrix.r() != m_r)
+	{
+		throw std::runtime_error("Model and trace index resolutions differ");
+	}
+	if(matrix_hash(src) != m_source_hash)
+	{
+		throw std::runtime_error(
+			"Trace index was written for another source model");
+	}
 
-void System::serialize_trace(std::ostream& s)
-{
-	for(const auto& c : m_trace)
+	// The matrix first, the reads are left at the state of i.
+	const Matrix out = read_matrix(i);
+
+	m_f.seekg(m_entries[i].position);
+	const uint64_t energy = get<uint64_t>(m_f);
+	const Harmonics harmonics =
+		get<uint8_t>(m_f) ? Harmonics::High : Harmonics::Low;
+	std::vector<Bot> bots(get<uint32_t>(m_f), Bot(0, 0));
+	for(auto& bot : bots)
 	{
-		c.serialize(s);
+		const unsigned id = get<uint32_t>(m_f);
+		const unsigned parent_id = get<uint32_t>(m_f);
+		const int x = get<uint8_t>(m_f);
+		const int y = get<uint8_t>(m_f);
+		const int z = get<uint8_t>(m_f);
+		std::vector<unsigned> seeds(get<uint32_t>(m_f));
+		for(auto& seed : seeds)
+		{
+			seed = get<uint32_t>(m_f);
+		}
+		bot = Bot(id, parent_id, Vec(x, y, z), std::move(seeds));
 	}
-}
 
-void System::push(Command command)
-{
-	// Only one command per step is supported.
-	assert(!m_curr_command.first);
-	m_curr_command.first = true;
-	m_curr_command.second = command;
+	System s(matrix);
+	s.set_out_matrix(out);
+	s.restore(m_entries[i].step, energy, harmonics, bots);
+	return s;
 }
 
-void System::step()
+System TraceIndex::seek(const std::string& trace_path, const Matrix& src,
+	const Matrix& matrix, uint64_t step) const
 {
-	assert(m_curr_command.first);
-
-	const Command& command = m_curr_command.second;
-
-	// Global field energy.
-	if(m_harmonics == Harmonics::Low)
+	const MappedFile trace(trace_path);
+	const size_t i = find(step);
+	if(m_entries[i].offset > trace.size())
 	{
-		m_energy += (3 * m_matrix.r() * m_matrix.r() * m_matrix.r());
+		throw std::runtime_error("Trace index does not match " + trace_path);
 	}
-	else
+
+	System s = resume(i, src, matrix);
+	const uint8_t* p = trace.data() + m_entries[i].offset;
+	replay(s, p, trace.data() + trace.size(), step - m_entries[i].step);
+	if(s.steps() != step)
 	{
-		m_energy += (30 * m_matrix.r() * m_matrix.r() * m_matrix.r());
+		throw std::runtime_error("Step past the end of " + trace_path);
 	}
+	return s;
+}
 
-	// Bots energy.
-	m_energy += 20 * 1;
+Matrix TraceIndex::read_matrix(size_t i) const
+{
+	// Skips the state in front of the matrix.
+	const auto skip_state = [&](size_t k) {
+		m_f.seekg(m_entries[k].position + 8 + 1);
+		const uint32_t bots = get<uint32_t>(m_f);
+		for(uint32_t b = 0; b < bots; ++b)
+		{
+			m_f.seekg(4 + 4 + 3, std::ios::cur);
+			m_f.seekg(4 * std::streamoff(get<uint32_t>(m_f)), std::ios::cur);
+		}
+	};
 
-	// Commands.
-	switch(command.type())
+	const size_t snapshot = i - i % m_snapshot_every;
+	Matrix m(m_r);
+	skip_state(snapshot);
+	std::vector<Matrix::Word> words(m.layer_words());
+	for(int y = 0; y < int(m_r); ++y)
 	{
-	case Command::Halt:
-		break;
-
-	case Command::Flip:
-		if(m_harmonics == Harmonics::Low)
+		Matrix::Word any = 0;
+		for(auto& w : words)
 		{
-			m_harmonics = Harmonics::High;
+			w = get<uint64_t>(m_f);
+			any |= w;
 		}
-		else
+		if(any)
 		{
-			m_harmonics = Harmonics::Low;
+			std::copy(words.begin(), words.end(), m.row(0, y));
 		}
-		break;
-
-	case Command::SMove:
-		assert(command.arg0().first);
-		assert(command.arg0().second.lld());
-
-		m_pos = m_pos + command.arg0().second;
-		m_energy += 2 * command.arg0().second.mlen();
+	}
+	m.summarize_all();
 
-		if(m_pos.x < 0
-			|| m_pos.y < 0
-			|| m_pos.z < 0)
+	for(size_t k = snapshot + 1; k <= i; ++k)
+	{
+		skip_state(k);
+		for(uint64_t n = get<uint64_t>(m_f); n > 0; --n)
 		{
-			std::ostringstream os;
-			os << "Wrong position mat.R = " << m_matrix.r()
-				<< ", pos = " << m_pos;
-			throw std::runtime_error(os.str());
+			const uint32_t v = get<uint32_t>(m_f);
+			const Vec p(v / m_r % m_r, v / m_r / m_r, v % m_r);
+			m.set_voxel(p, !m.voxel(p));
 		}
+	}
+	return m;
+}
 
-		if(m_pos.x >= m_matrix.r()
-			|| m_pos.y >= m_matrix.r()
-			|| m_pos.z >= m_matrix.r())
-		{
-			std::ostringstream os;
-			os << "Wrong position mat.R = " << m_matrix.r()
-				<< ", pos = " << m_pos;
-			throw std::runtime_error(os.str());
-		}
+namespace {
 
-		break;
+/// Index of the worker in its pool, -1 outside of the workers.
+thread_local int current_worker = -1;
+thread_local const ThreadPool* current_pool = nullptr;
 
-	case Command::Fill:
-		{
-			assert(command.arg0().first);
-			assert(command.arg0().second.nd());
+} //
 
-			const Vec tgt = m_pos + command.arg0().second;
+ThreadPool::ThreadPool(unsigned threads)
+{
+	if(threads == 0)
+	{
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
 
-			if(m_out_matrix.voxel(tgt))
-			{
-				m_energy += 6;
-			}
-			else
-			{
-				m_out_matrix.set_voxel(tgt, true);
-				m_energy += 12;
-			}
+	for(unsigned i = 0; i < threads; ++i)
+	{
+		m_queues.emplace_back(new Queue);
+	}
+	for(unsigned i = 0; i < threads; ++i)
+	{
+		m_threads.emplace_back([this, i]() { work(i); });
+	}
+}
 
-			break;
-		}
+ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_idle.wait(lock, [this]() { return m_pending == 0; });
+		m_stop = true;
+	}
+	m_wake.notify_all();
 
-	case Command::Void:
-		{
-			assert(command.arg0().first);
-			assert(command.arg0().second.nd());
+	for(auto& t : m_threads)
+	{
+		t.join();
+	}
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+	unsigned worker;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		worker = (current_pool == this)
+			? current_worker : (m_next++ % m_queues.size());
+		++m_queued;
+		++m_pending;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_queues[worker]->mutex);
+		m_queues[worker]->tasks.push_back(std::move(task));
+	}
+
+	m_wake.notify_one();
+}
+
+void ThreadPool::wait()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_idle.wait(lock, [this]() { return m_pending == 0; });
 
-			const Vec tgt = m_pos + command.arg0().second;
+	if(m_error)
+	{
+		std::exception_ptr error;
+		std::swap(error, m_error);
+		std::rethrow_exception(error);
+	}
+}
+
+bool ThreadPool::take(unsigned worker, std::function<void()>& task)
+{
+	// Own newest first, then the oldest of the others.
 
-			if(m_out_matrix.voxel(tgt))
+	for(size_t i = 0; i < m_queues.size(); ++i)
+	{
+		Queue& q = *m_queues[(worker + i) % m_queues.size()];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if(!q.tasks.empty())
+		{
+			if(i == 0)
 			{
-				m_out_matrix.set_voxel(tgt, false);
-				assert(m_energy >= 12);
-				m_energy -= 12;
+				task = std::move(q.tasks.back());
+				q.tasks.pop_back();
 			}
 			else
 			{
-				m_energy += 3;
+				task = std::move(q.tasks.front());
+				q.tasks.pop_front();
 			}
-
-			break;
+			return true;
 		}
-
-	default:
-		assert(false);
 	}
 
-	m_trace.push_back(m_curr_command.second);
-	m_curr_command.first = false;
-	m_curr_command.second = Command();
-}
-
-void System::push_and_step(Command command)
-{
-	push(command);
-	step();
+	return false;
 }
 
-namespace {
-const int max_step_len = 15;
-} //
-
-void System::move_to_x(int x)
+void ThreadPool::wait_until(const std::function<bool()>& done)
 {
-	const int dx = x - m_pos.x;
+	const unsigned worker = (current_pool == this) ? current_worker : 0;
 
-	if(dx != 0)
+	for(;;)
 	{
-		const int sign = (dx > 0) ? 1 : -1;
-		for(int i = 0; i < abs(dx / max_step_len); ++i)
 		{
-			push_and_step(Command::smove_x(max_step_len * sign));
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_idle.wait(lock, [&]() { return done() || m_queued > 0; });
+			if(done())
+			{
+				return;
+			}
+			--m_queued;
 		}
 
-		const int rem = dx % max_step_len;
-		if(rem != 0)
-		{
-			push_and_step(Command::smove_x(rem));
-		}
+		execute(worker);
 	}
 }
 
-void System::move_to_y(int y)
+void ThreadPool::work(unsigned worker)
 {
-	const int dy = y - m_pos.y;
+	current_worker = worker;
+	current_pool = this;
 
-	if(dy != 0)
+	for(;;)
 	{
-		const int sign = (dy > 0) ? 1 : -1;
-		for(int i = 0; i < abs(dy / max_step_len); ++i)
 		{
-			push_and_step(Command::smove_y(max_step_len * sign));
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [this]() { return m_stop || m_queued > 0; });
+			if(m_stop)
+			{
+				return;
+			}
+			// The task is reserved, some deque has it.
+			--m_queued;
 		}
 
-		const int rem = dy % max_step_len;
-		if(rem != 0)
-		{
-			push_and_step(Command::smove_y(rem));
-		}
+		execute(worker);
 	}
 }
 
-void System::move_to_z(int z)
+void ThreadPool::execute(unsigned worker)
 {
-	const int dz = z - m_pos.z;
-
-	if(dz != 0)
+	std::function<void()> task;
+	while(!take(worker, task))
 	{
-		const int sign = (dz > 0) ? 1 : -1;
-		for(int i = 0; i < abs(dz / max_step_len); ++i)
-		{
-			push_and_step(Command::smove_z(max_step_len * sign));
-		}
+		// It is being pushed right now.
+		std::this_thread::yield();
+	}
 
-		const int rem = dz % max_step_len;
-		if(rem != 0)
+	try
+	{
+		task();
+	}
+	catch(...)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if(!m_error)
 		{
-			push_and_step(Command::smove_z(rem));
+			m_error = std::current_exception();
 		}
 	}
+	task = nullptr;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	--m_pending;
+	m_idle.notify_all();
 }
 
-void System::move_to(const Vec& tgt, MovementOrder order)
+std::vector<Portfolio::Config> Portfolio::default_configs()
 {
-	// No volatile points in the volume assumed.
-
-	if(order == MovementOrder::XZY)
+	std::vector<Config> result;
+	for(unsigned bots : { 4u, 8u, 12u, 20u, max_bots })
 	{
-		move_to_x(tgt.x);
-		move_to_z(tgt.z);
-		move_to_y(tgt.y);
+		result.push_back(Config{ bots, Tracer::Sweep::Rectangles });
 	}
-	else if(order == MovementOrder::YZX)
+	for(unsigned bots : { 1u, 8u, max_bots })
 	{
-		move_to_y(tgt.y);
-		move_to_z(tgt.z);
-		move_to_x(tgt.x);
+		result.push_back(Config{ bots, Tracer::Sweep::Voxels });
+		result.push_back(Config{ bots, Tracer::Sweep::Swaths });
 	}
+	return result;
 }
 
-void Tracer::run()
+void Portfolio::prune(const Estimator& estimate, double margin)
 {
-	if(m_system.matrix().r() < 2)
+	if(m_configs.empty())
 	{
-		throw std::runtime_error("Matrix too small for this algo");
+		return;
 	}
 
-	const auto region = m_system.matrix().calc_bounding_region();
-	if(!region.first)
+	std::vector<uint64_t> estimates;
+	for(const Config& c : m_configs)
 	{
-		throw std::runtime_error("Empty matrix ?");
+		estimates.push_back(estimate(c));
 	}
+	const uint64_t limit = *std::min_element(
+		estimates.begin(), estimates.end()) * margin;
 
-	m_bounding_region = region.second;
-
-	assert(m_bounding_region.a.x > 0
-		&& m_bounding_region.a.x < m_system.matrix().r() - 1);
-	assert(m_bounding_region.a.y >= 0
-		&& m_bounding_region.a.y < m_system.matrix().r() - 1);
-	assert(m_bounding_region.a.z > 0
-		&& m_bounding_region.a.z < m_system.matrix().r() - 1);
-
-	assert(m_bounding_region.b.x > 0
-		&& m_bounding_region.b.x < m_system.matrix().r() - 1);
-	assert(m_bounding_region.b.y >= 0
-		&& m_bounding_region.b.y < m_system.matrix().r() - 1);
-	assert(m_bounding_region.b.z > 0
-		&& m_bounding_region.b.z < m_system.matrix().r() - 1);
-	
-	// Move to the starting point. 
-
-	const int initial_y = m_dir == Tracer::Direction::Up
-		? 1 : (m_bounding_region.b.y + 1);
-
-	Vec initial_pos(m_bounding_region.a.x, initial_y, m_bounding_region.a.z);
-	m_system.move_to(initial_pos, System::MovementOrder::YZX);
-	assert(m_system.bot_pos() == initial_pos);
-
-	///////////////////
-
-	m_system.push_and_step(Command::flip());
-
-	// Iterate the matrix.
-
-	for(int y = 1; y < m_bounding_region.b.y + 2; ++y)
+	size_t kept = 0;
+	for(size_t i = 0; i < m_configs.size(); ++i)
 	{
-		scan_xz_plane(m_system.bot_pos().y - 1);
-
-		if(y < m_bounding_region.b.y + 1)
+		if(estimates[i] <= limit)
 		{
-			m_system.push_and_step(Command::smove_y(
-				(m_dir == Tracer::Direction::Up) ? 1 : -1));
+			m_configs[kept++] = m_configs[i];
 		}
 	}
-
-	///////////////////
-
-	assert(m_system.bot_pos().y == m_bounding_region.b.y + 1
-		|| m_system.bot_pos().y == 1);
-
-	///////////////////
-
-	m_system.push_and_step(Command::flip());
-}
-
-void Tracer::halt()
-{
-	m_system.move_to(Vec());
-	assert(m_system.bot_pos() == Vec());
-
-	m_system.push_and_step(Command::halt());
+	m_configs.resize(kept);
 }
 
-void Tracer::scan_xz_plane(int y)
+System Portfolio::run(const Solver& solve)
 {
-	assert(y >= 0);
-	assert(m_system.bot_pos().y == y + 1
-		&& "bot must be one level above");
-
-	const auto curr_region
-		= m_system.matrix().calc_bounding_region_y(y);
-
-	if(curr_region.first)
+	if(m_configs.empty())
 	{
-		const std::vector<Vec> vertices = {
-			curr_region.second.a,
-			Vec(curr_region.second.a.x, y, curr_region.second.b.z),
-			curr_region.second.b,
-			Vec(curr_region.second.b.x, y, curr_region.second.a.z)
-		};
+		throw std::runtime_error("No configs to run");
+	}
 
-		const auto closest_vertex_it = std::min_element(
-			begin(vertices), end(vertices),
-			[&](const auto& a, const auto& b) {
-				return (a - m_system.bot_pos()).mlen()
-			    < (b - m_system.bot_pos()).mlen();
-		});
-		assert(closest_vertex_it != vertices.end());
+	std::mutex mutex;
+	std::unique_ptr<System> best;
+	size_t best_index = 0;
+	std::exception_ptr error;
 
-		const auto furthest_vertex_it = vertices.begin()
-			+ ((closest_vertex_it - vertices.begin()) + 2) % vertices.size();
-		assert(furthest_vertex_it != vertices.end());
+	// Other tasks of the pool, e.g. the caller, are not waited for.
+	std::atomic<size_t> left(m_configs.size());
 
-		m_system.move_to(
-			closest_vertex_it->xz(m_system.bot_pos().y));
-		
-		const int x_sweep_dir
-			= (closest_vertex_it->x < furthest_vertex_it->x) ? 1 : -1;
-		int z_sweep_dir
-			= (closest_vertex_it->z < furthest_vertex_it->z) ? 1 : -1;
-		int src_z = closest_vertex_it->z;
-		int tgt_z = furthest_vertex_it->z;
+	for(size_t i = 0; i < m_configs.size(); ++i)
+	{
+		m_pool.submit([&, i]() {
+			try
+			{
+				std::unique_ptr<System> s(new System(solve(m_configs[i])));
 
-		for(int x = closest_vertex_it->x;
-				x != furthest_vertex_it->x + x_sweep_dir;
-				x += x_sweep_dir)
-		{
-			for(int z = src_z;
-					z != tgt_z + z_sweep_dir;
-					z += z_sweep_dir)
+				// Ties go to the earlier config, whatever finishes first.
+				std::lock_guard<std::mutex> lock(mutex);
+				if(!best || s->energy() < best->energy()
+					|| (s->energy() == best->energy() && i < best_index))
+				{
+					best = std::move(s);
+					best_index = i;
+				}
+			}
+			catch(...)
 			{
-				if(m_system.matrix().voxel(Vec(x, y, z)))
+				std::lock_guard<std::mutex> lock(mutex);
+				if(!error)
 				{
-					m_system.move_to(Vec(x, m_system.bot_pos().y, z));
-					handle_voxel(Vec(x, y, z));
+					error = std::current_exception();
 				}
 			}
-			std::swap(src_z, tgt_z);
-			z_sweep_dir *= -1;
-		}
+			--left;
+		});
 	}
-}
-
-void Assembler::handle_voxel(const Vec& p)
-{
-	m_system.push_and_step(Command::fill_below());
-}
+	m_pool.wait_until([&]() { return left == 0; });
 
-void Disassembler::handle_voxel(const Vec& p)
-{
-	m_system.push_and_step(Command::voiid_below());
+	if(error)
+	{
+		std::rethrow_exception(error);
+	}
+	assert(best);
+	m_best = m_configs[best_index];
+	return std::move(*best);
 }
 
 } //
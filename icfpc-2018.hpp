@@ -12,6 +12,15 @@
 #include <fstream>
 #include <iostream>
 #include <cstdint>
+#include <array>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <chrono>
 
 namespace icfpc2018 {
 
@@ -55,6 +64,11 @@ struct Vec
 		return clen() == 1 && mlen() > 0 && mlen() < 3;
 	}
 
+	bool fd() const
+	{
+		return clen() > 0 && clen() < 31;
+	}
+
 	bool valid_coordinate() const
 	{
 		return x >= 0 && y >= 0 && z >= 0;
@@ -86,6 +100,11 @@ inline Vec operator-(const Vec& a, const Vec& b)
 	return Vec(a.x - b.x, a.y - b.y, a.z - b.z);
 }
 
+inline Vec operator*(const Vec& a, int k)
+{
+	return Vec(a.x * k, a.y * k, a.z * k);
+}
+
 inline bool operator==(const Vec& a, const Vec& b)
 {
 	return std::tie(a.x, a.y, a.z) == std::tie(b.x, b.y, b.z);
@@ -122,14 +141,56 @@ struct Region
 	Vec a, b;
 };
 
+/// Voxels are stored one bit per voxel. Layers (fixed y) are contiguous,
+/// inside of a layer rows (fixed x) follow each other and every row packs
+/// its z coordinates into row_words() words: bit z % 64 of word z / 64.
+/// Bits past R in the last word of a row are always zero.
+///
+/// Every layer is a page shared by the copies until one of them writes
+/// into it, so a copy costs R page pointers. Copies may be written from
+/// different threads, a single matrix may not. Empty layers share the zero
+/// page and the layer summaries mark the non-empty rows, so the sparse
+/// models take the memory and the scans of their full rows only. The const
+/// accessors never write, so a matrix may be read from many threads.
 class Matrix
 {
 public:
+	typedef uint64_t Word;
+
+	static const unsigned word_bits = 64;
+
+	/// Row words of the largest R.
+	static const unsigned max_row_words = (250 + word_bits - 1) / word_bits;
+
+	static const unsigned max_layer_words = 250 * max_row_words;
+
+	/// Voxels count, the xz bounding box and the non-empty rows of the
+	/// layer.
+	struct LayerSummary
+	{
+		size_t count = 0;
+
+		/// Meaningless for the empty layer.
+		Region region;
+
+		/// Bit x is set for the non-empty (x, y) row.
+		std::array<Word, max_row_words> rows{};
+
+		bool empty() const
+		{
+			return count == 0;
+		}
+	};
+
+	/// All the layers share the zero page.
 	explicit Matrix(unsigned R)
 	: m_r(R)
+	, m_row_words((R + word_bits - 1) / word_bits)
+	, m_pages(R, zero_page())
+	, m_layers(R)
+	, m_dirty(R, false)
 	{
 		assert(R > 0 && R < 251);
-		m_bits.resize(R*R*R);
 	}
 
 	unsigned r() const
@@ -140,52 +201,313 @@ public:
 	bool voxel(const Vec& c) const
 	{
 		assert(c.valid_coordinate());
-		return m_bits[c.x * m_r * m_r + c.y * m_r + c.z];
+		return (row(c.x, c.y)[c.z / word_bits] >> (c.z % word_bits)) & 1;
 	}
 
 	void set_voxel(const Vec& c, bool full)
 	{
-		assert(c.valid_coordinate());
-		m_bits[c.x * m_r * m_r + c.y * m_r + c.z] = full;
+		if(voxel(c) != full)
+		{
+			writable_layer(c.y)[c.x * m_row_words + c.z / word_bits] ^=
+				Word(1) << (c.z % word_bits);
+			update_summary(c, full);
+		}
+	}
+
+	/// Number of words in the (x, y) row.
+	unsigned row_words() const
+	{
+		return m_row_words;
+	}
+
+	/// Number of words in the y layer.
+	unsigned layer_words() const
+	{
+		return m_r * m_row_words;
+	}
+
+	const Word* row(int x, int y) const
+	{
+		assert(x >= 0 && x < int(m_r) && y >= 0 && y < int(m_r));
+		return m_pages[y].get() + x * m_row_words;
+	}
+
+	/// Caller must keep the bits past R zeroed and call summarize_all()
+	/// after the writes, before the summaries are accessed. The page of the
+	/// layer is unshared, the pointer is valid within the layer only.
+	Word* row(int x, int y)
+	{
+		assert(x >= 0 && x < int(m_r) && y >= 0 && y < int(m_r));
+		m_dirty[y] = true;
+		return writable_layer(y) + x * m_row_words;
+	}
+
+	const Word* layer(int y) const
+	{
+		return row(0, y);
 	}
 
-	std::pair<bool, Region> calc_bounding_region() const;
+	bool row_any(int x, int y) const;
+
+	size_t row_popcount(int x, int y) const;
+
+	/// Lowest and highest full z of the row, row must not be empty.
+	std::pair<int, int> row_z_range(int x, int y) const;
+
+	/// Inclusive [z0, z1] run of the full voxels.
+	typedef std::pair<int, int> Span;
+
+	/// Replaces spans with the runs of the row in the ascending order.
+	void row_spans(int x, int y, std::vector<Span>& spans) const;
+
+	/// Kept by set_voxel() and the set operations. The box is recomputed,
+	/// in a single pass over the layer words, after the voids on its sides.
+	const LayerSummary& layer_summary(int y) const
+	{
+		assert(!m_dirty[y] && "summarize_all() after the row() writes");
+		return m_layers[y];
+	}
+
+	/// Summarizes the layers written through row().
+	void summarize_all();
+
+	bool layer_any(int y) const
+	{
+		return !layer_summary(y).empty();
+	}
+
+	/// Lowest x from x up of the non-empty (x, y) row, R if there is none.
+	int next_row(int x, int y) const
+	{
+		if(x >= int(m_r))
+		{
+			return m_r;
+		}
+
+		const LayerSummary& l = layer_summary(y);
+		unsigned i = x / word_bits;
+		Word w = l.rows[i] & (~Word(0) << (x % word_bits));
+		while(!w && ++i < m_row_words)
+		{
+			w = l.rows[i];
+		}
+		return w ? int(i * word_bits + __builtin_ctzll(w)) : int(m_r);
+	}
+
+	/// Lowest y from y up of the non-empty layer, R if there is none.
+	int next_layer(int y) const
+	{
+		while(y < int(m_r) && !layer_any(y))
+		{
+			++y;
+		}
+		return y;
+	}
+
+	size_t layer_popcount(int y) const
+	{
+		return layer_summary(y).count;
+	}
+
+	bool any() const;
+
+	bool none() const
+	{
+		return !any();
+	}
+
+	size_t popcount() const;
+
+	/// Limited to the layers from min_y up.
+	std::pair<bool, Region> calc_bounding_region(int min_y = 0) const;
 
 	std::pair<bool, Region> calc_bounding_region_y(int y) const;
 
+	/// Limited to the [x0, x1] rows.
+	std::pair<bool, Region> calc_bounding_region_y(int y, int x0, int x1) const;
+
+	/// Number of the bottom layers equal in both matrices of the same size.
+	int common_layers(const Matrix& other) const;
+
+	bool operator==(const Matrix& other) const;
+
+	bool operator!=(const Matrix& other) const
+	{
+		return !(*this == other);
+	}
+
+	enum class SetOp { And, Or, Xor, AndNot };
+
+	/// this = this op other for the matrices of the same size, a word of
+	/// voxels at a time. Shared and zero pages are never scanned.
+	void apply(SetOp op, const Matrix& other);
+
+	void apply_layer(SetOp op, const Matrix& other, int y);
+
+	Matrix& operator&=(const Matrix& other)
+	{
+		apply(SetOp::And, other);
+		return *this;
+	}
+
+	Matrix& operator|=(const Matrix& other)
+	{
+		apply(SetOp::Or, other);
+		return *this;
+	}
+
+	Matrix& operator^=(const Matrix& other)
+	{
+		apply(SetOp::Xor, other);
+		return *this;
+	}
+
+	/// Voids the voxels full in other.
+	Matrix& subtract(const Matrix& other)
+	{
+		apply(SetOp::AndNot, other);
+		return *this;
+	}
+
+	/// Number of voxels full in one of the matrices only.
+	size_t count_differences(const Matrix& other) const;
+
+	size_t count_layer_differences(const Matrix& other, int y) const;
+
+	/// Lowest by y, then by x, then by z voxel full in one of the matrices
+	/// only.
+	std::pair<bool, Vec> first_difference(const Matrix& other) const;
+
 	void print(std::ostream& s) const;
 	
 private:
-	std::vector<uint8_t> m_bits;
+	void update_summary(const Vec& c, bool full)
+	{
+		LayerSummary& l = m_layers[c.y];
+		if(m_dirty[c.y])
+		{
+			return;
+		}
+
+		const Word row_bit = Word(1) << (c.x % word_bits);
+		if(full)
+		{
+			l.rows[c.x / word_bits] |= row_bit;
+		}
+		else
+		{
+			const Word* w = m_pages[c.y].get() + c.x * m_row_words;
+			Word any = 0;
+			for(unsigned i = 0; i < m_row_words; ++i)
+			{
+				any |= w[i];
+			}
+			if(!any)
+			{
+				l.rows[c.x / word_bits] &= ~row_bit;
+			}
+		}
+
+		Region& r = l.region;
+		if(full)
+		{
+			if(l.count++ == 0)
+			{
+				r = Region(c, c);
+			}
+			else
+			{
+				r.a.x = std::min(r.a.x, c.x);
+				r.a.z = std::min(r.a.z, c.z);
+				r.b.x = std::max(r.b.x, c.x);
+				r.b.z = std::max(r.b.z, c.z);
+			}
+		}
+		else if(--l.count != 0
+			&& (c.x == r.a.x || c.x == r.b.x || c.z == r.a.z || c.z == r.b.z))
+		{
+			shrink_region(c);
+		}
+	}
+
+	/// After the void of c on a side of the layer box. The x range comes
+	/// from the rows, the z one is rescanned only when the c.z column is
+	/// left empty.
+	void shrink_region(const Vec& c);
+
+	void summarize(int y);
+
+	typedef std::shared_ptr<Word> Page;
+
+	static const Page& zero_page();
+
+	/// Copies the page shared with another matrix.
+	void unshare(int y);
+
+	Word* writable_layer(int y)
+	{
+		if(m_pages[y].use_count() > 1)
+		{
+			unshare(y);
+		}
+		return m_pages[y].get();
+	}
+
+private:
 	unsigned m_r;
+	unsigned m_row_words;
+
+	/// By y, layer_words() each.
+	std::vector<Page> m_pages;
+
+	std::vector<LayerSummary> m_layers;
+
+	/// Layers written through row() since the last summarize_all().
+	std::vector<bool> m_dirty;
 };
 
+inline Matrix operator&(Matrix a, const Matrix& b)
+{
+	return a &= b;
+}
+
+inline Matrix operator|(Matrix a, const Matrix& b)
+{
+	return a |= b;
+}
+
+inline Matrix operator^(Matrix a, const Matrix& b)
+{
+	return a ^= b;
+}
+
 /// @throw std::runtime_error
 Matrix read_model_file(const std::string& path);
 
 /// @throw std::runtime_error
 void write_model_file(const Matrix& m, const std::string& path);
 
+/// Packed: the type and the arguments take 8 bytes.
 class Command
 {
 public:
-	enum Type {
+	enum Type : uint8_t {
 		Undefined,
 		Halt,
-		// Wait,
+		Wait,
 		Flip,
 		SMove,
-		// LMove,
-		// Fission,
+		LMove,
+		Fission,
 		Fill,
 
 		Void,
 
-		// FussionP,
-		// FussionS,
+		FusionP,
+		FusionS,
 
-		// GFill,
-		// GVoid,
+		GFill,
+		GVoid,
 	};
 
 	Command()
@@ -203,13 +525,27 @@ public:
 		return m_type;
 	}
 
-	const std::pair<bool, Vec>&	arg0() const
+	Vec arg0() const
+	{
+		return Vec(m_arg0[0], m_arg0[1], m_arg0[2]);
+	}
+
+	/// Second sld of LMove, fd of GFill and GVoid.
+	Vec arg1() const
+	{
+		return Vec(m_arg1[0], m_arg1[1], m_arg1[2]);
+	}
+
+	/// Seeds passed by Fission.
+	unsigned m() const
 	{
-		return m_arg0;
+		return m_m;
 	}
 
 	static Command halt();
 
+	static Command wait();
+
 	static Command flip();
 
 	static Command smove(const Vec& arg);
@@ -220,6 +556,10 @@ public:
 
 	static Command smove_z(int z);
 
+	static Command lmove(const Vec& sld1, const Vec& sld2);
+
+	static Command fission(const Vec& nd, unsigned m);
+
 	static Command fill(const Vec& arg);
 
 	static Command fill_below();
@@ -228,19 +568,255 @@ public:
 
 	static Command voiid_below();
 
+	static Command fusion_p(const Vec& nd);
+
+	static Command fusion_s(const Vec& nd);
+
+	static Command gfill(const Vec& nd, const Vec& fd);
+
+	static Command gvoid(const Vec& nd, const Vec& fd);
+
+	/// Longest .nbt encoding of a command.
+	static const size_t max_encoded_size = 4;
+
+	/// Writes the .nbt encoding, returns its size.
+	size_t encode(uint8_t* out) const;
+
+	/// Reads one command from the .nbt encoding, returns its size.
+	/// @throw std::runtime_error
+	static size_t decode(const uint8_t* data, size_t size, Command& out);
+
 	void serialize(std::ostream& s) const;
 
 private:
+	static void pack(int8_t* dst, const Vec& v)
+	{
+		dst[0] = v.x;
+		dst[1] = v.y;
+		dst[2] = v.z;
+	}
+
 	Type m_type;
-	std::pair<bool, Vec> m_arg0;
+	int8_t m_arg0[3] = { 0, 0, 0 };
+	int8_t m_arg1[3] = { 0, 0, 0 };
+	uint8_t m_m = 0;
+};
+
+inline bool operator==(const Command& a, const Command& b)
+{
+	return a.type() == b.type()
+		&& a.arg0() == b.arg0()
+		&& a.arg1() == b.arg1()
+		&& a.m() == b.m();
+}
+
+inline bool operator!=(const Command& a, const Command& b)
+{
+	return !(a == b);
+}
+
+/// Commands kept in their .nbt encoding. The bytes go to the tail, full
+/// tails are sealed into the chunks shared by the copies, so a copy costs
+/// the chunk pointers and at most a chunk of bytes.
+class Trace
+{
+public:
+	/// Decodes the commands on the fly.
+	class const_iterator
+	{
+	public:
+		/// Starts at the first command of the block or past the end.
+		const_iterator(const Trace& trace, size_t block)
+		: m_trace(&trace), m_block(block)
+		{
+			enter();
+		}
+
+		const Command& operator*() const
+		{
+			return m_command;
+		}
+
+		const Command* operator->() const
+		{
+			return &m_command;
+		}
+
+		const_iterator& operator++()
+		{
+			m_p += m_size;
+			if(m_p == m_end)
+			{
+				++m_block;
+				enter();
+			}
+			else
+			{
+				decode();
+			}
+			return *this;
+		}
+
+		bool operator==(const const_iterator& other) const
+		{
+			return m_block == other.m_block && m_p == other.m_p;
+		}
+
+		bool operator!=(const const_iterator& other) const
+		{
+			return !(*this == other);
+		}
+
+	private:
+		/// Skips the empty blocks.
+		void enter()
+		{
+			for(; m_block < m_trace->blocks(); ++m_block)
+			{
+				const Chunk& b = m_trace->block(m_block);
+				if(!b.empty())
+				{
+					m_p = b.data();
+					m_end = b.data() + b.size();
+					decode();
+					return;
+				}
+			}
+			m_p = m_end = nullptr;
+			m_size = 0;
+		}
+
+		void decode()
+		{
+			m_size = Command::decode(m_p, m_end - m_p, m_command);
+		}
+
+		const Trace* m_trace;
+		size_t m_block;
+		const uint8_t* m_p = nullptr;
+		const uint8_t* m_end = nullptr;
+		Command m_command;
+		size_t m_size = 0;
+	};
+
+	static const size_t chunk_size = 64 * 1024;
+
+	void push_back(const Command& command)
+	{
+		const size_t size = m_tail.size();
+		m_tail.resize(size + Command::max_encoded_size);
+		m_tail.resize(size + command.encode(m_tail.data() + size));
+		if(m_tail.size() >= chunk_size)
+		{
+			seal();
+		}
+	}
+
+	const_iterator begin() const
+	{
+		return const_iterator(*this, 0);
+	}
+
+	const_iterator end() const
+	{
+		return const_iterator(*this, blocks());
+	}
+
+	/// In bytes.
+	size_t size() const
+	{
+		return m_sealed_size + m_tail.size();
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+	void clear()
+	{
+		m_chunks.clear();
+		m_sealed_size = 0;
+		m_tail.clear();
+	}
+
+	/// For the tail.
+	void reserve(size_t bytes)
+	{
+		m_tail.reserve(bytes);
+	}
+
+	/// Appends already encoded whole commands.
+	void append(const uint8_t* data, size_t size)
+	{
+		m_tail.insert(m_tail.end(), data, data + size);
+		if(m_tail.size() >= chunk_size)
+		{
+			seal();
+		}
+	}
+
+	/// Calls f(data, size) for the blocks of the bytes in order.
+	template<typename F>
+	void for_each_block(F f) const
+	{
+		for(size_t i = 0; i < blocks(); ++i)
+		{
+			const Chunk& b = block(i);
+			if(!b.empty())
+			{
+				f(b.data(), b.size());
+			}
+		}
+	}
+
+	void serialize(std::ostream& s) const
+	{
+		for_each_block([&](const uint8_t* data, size_t size) {
+			s.write(reinterpret_cast<const char*>(data), size);
+		});
+	}
+
+private:
+	typedef std::vector<uint8_t> Chunk;
+
+	/// The chunks and the tail.
+	size_t blocks() const
+	{
+		return m_chunks.size() + 1;
+	}
+
+	const Chunk& block(size_t i) const
+	{
+		return (i < m_chunks.size()) ? *m_chunks[i] : m_tail;
+	}
+
+	void seal()
+	{
+		m_sealed_size += m_tail.size();
+		m_chunks.push_back(std::make_shared<const Chunk>(std::move(m_tail)));
+		m_tail = Chunk();
+		m_tail.reserve(chunk_size + Command::max_encoded_size);
+	}
+
+private:
+	std::vector<std::shared_ptr<const Chunk>> m_chunks;
+	size_t m_sealed_size = 0;
+	Chunk m_tail;
 };
 
+/// Bids of the full round are 1..40.
+const unsigned max_bots = 40;
+
 class Bot
 {
 public:
-	Bot(unsigned id, unsigned parent_id)
+	Bot(unsigned id, unsigned parent_id, const Vec& pos = Vec(),
+		std::vector<unsigned> seeds = std::vector<unsigned>())
 	: m_id(id)
 	, m_parent_id(parent_id)
+	, m_pos(pos)
+	, m_seeds(std::move(seeds))
 	{
 	}
 
@@ -254,11 +830,27 @@ public:
 		return m_parent_id;
 	}
 
+	const Vec& pos() const
+	{
+		return m_pos;
+	}
+
 	Vec& pos()
 	{
 		return m_pos;
 	}
 
+	/// Sorted.
+	const std::vector<unsigned>& seeds() const
+	{
+		return m_seeds;
+	}
+
+	std::vector<unsigned>& seeds()
+	{
+		return m_seeds;
+	}
+
 private:
 	unsigned m_id;
 	unsigned m_parent_id;
@@ -268,122 +860,1184 @@ private:
 
 enum class Harmonics { Low, High };
 
-class System
+/// Tells whether all the full voxels of the matrix are connected to the
+/// ground. Fills are merged into the union-find, so the answer is O(1).
+/// Voids are checked lazily by the searches from their neighbours or,
+/// when there are too many of them, by the flood from the ground.
+class Groundedness
 {
 public:
-	explicit System(const Matrix& matrix);
-
-	/// Allows to continue the src execution.
-	System(const System& src, const Matrix& matrix);
-
-	void serialize_trace(std::ostream& s);
-
-	uint64_t energy() const
+	/// The matrix is empty.
+	Groundedness()
 	{
-		return m_energy;
 	}
 
-	const Vec& bot_pos() const
-	{
-		return m_pos;
-	}
+	/// Only the known answer and the suspects are copied, the union-find
+	/// is left behind and rebuilt if the copy needs it.
+	Groundedness(const Groundedness& other);
 
-	const Matrix& matrix() const
-	{
-		return m_matrix;
-	}
+	Groundedness& operator=(const Groundedness& other);
 
-	Matrix& out_matrix()
-	{
-		return m_out_matrix;
-	}
+	Groundedness(Groundedness&&) = default;
+	Groundedness& operator=(Groundedness&&) = default;
 
-public:
-	void push(Command command);
+	/// The matrix has been changed without the notifications.
+	void reset();
 
-	void step();
+	/// The p voxel has been filled in m.
+	void fill(const Matrix& m, const Vec& p);
 
-	void push_and_step(Command command);
+	/// The p voxel has been voided in m.
+	void voiid(const Matrix& m, const Vec& p);
+
+	bool grounded(const Matrix& m);
 
 private:
-	void move_to_x(int x);
-	void move_to_y(int y);
-	void move_to_z(int z);
+	enum class State { Tracked, Voided, Unknown };
 
-public:
-	enum class MovementOrder { XZY, YZX };
+	uint32_t find(uint32_t i);
 
-	void move_to(const Vec& tgt,
-		MovementOrder order = MovementOrder::XZY);
+	void unite(uint32_t a, uint32_t b);
+
+	void add(const Matrix& m, const Vec& p, bool all_neighbours);
+
+	void rebuild(const Matrix& m);
+
+	bool reaches_ground(const Matrix& m, const Vec& p);
+
+	bool flood(const Matrix& m);
 
 private:
-	Matrix m_matrix;
-	Matrix m_out_matrix;
+	/// Tracked: the union-find matches the matrix. Voided: there were
+	/// voids after m_all_grounded was known, m_suspects are to be checked.
+	State m_state = State::Tracked;
 
-	Harmonics m_harmonics = Harmonics::Low;
-	uint64_t m_energy = 0;
+	/// By the voxel index (y * R + x) * R + z, the ground node is R^3.
+	/// Allocated with the first fill.
+	std::vector<uint32_t> m_parent;
 
-	Vec m_pos;
+	/// Union-find components not connected to the ground.
+	size_t m_floating = 0;
+
+	bool m_all_grounded = true;
+
+	/// Bounds the memory, the check floods the matrix past it. Checking the
+	/// suspects is never slower than the flood, the search stops at the
+	/// voxels already found grounded.
+	static const size_t max_suspects = 1 << 20;
 
-	std::pair<bool, Command> m_curr_command;
-	std::vector<Command> m_trace;
+	std::vector<Vec> m_suspects;
+
+	/// Search scratch.
+	std::vector<uint8_t> m_marks;
+	std::vector<Vec> m_stack;
+	std::vector<Vec> m_marked;
 };
 
-class Tracer
+/// Voxels touched by the bots in the current step. They are stamped with
+/// the step epoch, so nothing is cleared between the steps and a step costs
+/// the voxels it marks. The stamps are allocated with the first step.
+class VolatilityGrid
 {
 public:
-	enum class Direction { Up, Down };
+	VolatilityGrid()
+	{
+	}
 
-	Tracer(System& system, Direction dir)
-	: m_system(system), m_dir(dir)
+	/// The stamps are not copied.
+	VolatilityGrid(const VolatilityGrid&)
 	{
 	}
 
-	virtual ~Tracer() { }
+	VolatilityGrid& operator=(const VolatilityGrid&)
+	{
+		return *this;
+	}
 
-	void run();
+	VolatilityGrid(VolatilityGrid&&) = default;
+	VolatilityGrid& operator=(VolatilityGrid&&) = default;
 
-	void halt();
+	/// Forgets the marks of the previous steps.
+	void next_step(unsigned r);
 
-protected:
-	System& m_system;
+	/// @return false if p has been marked in this step, it is clash() then.
+	bool mark(const Vec& p)
+	{
+		uint32_t& stamp = m_stamps[(p.y * m_r + p.x) * m_r + p.z];
+		if(stamp == m_epoch)
+		{
+			m_clash = p;
+			return false;
+		}
+		stamp = m_epoch;
+		return true;
+	}
 
-	Direction m_dir;
+	/// Marks the points past from, up to from + d. d is a linear
+	/// coordinate difference.
+	bool mark_segment(const Vec& from, const Vec& d);
 
-private:
-	virtual void handle_voxel(const Vec& p) = 0;
+	bool mark_region(const Region& region);
 
-private:
-	void scan_xz_plane(int y);
+	/// The point marked twice.
+	const Vec& clash() const
+	{
+		return m_clash;
+	}
 
 private:
-	Region m_bounding_region;
-
+	std::vector<uint32_t> m_stamps;
+	uint32_t m_epoch = 0;
+	unsigned m_r = 0;
+	Vec m_clash;
 };
 
-class Assembler : public Tracer
+class BotPlan;
+
+/// Finds the fewest steps SMove/LMove paths around the full voxels and
+/// the blocked positions. The search scratch is kept between the calls.
+class PathPlanner
 {
 public:
-	explicit Assembler(System& system)
-	: Tracer(system, Direction::Up)
+	/// Appends the path from plan.pos() to tgt to the plan. Blocked are
+	/// the positions to avoid besides the full voxels, e.g. other bots.
+	/// @return false if tgt is unreachable, the plan is not changed then.
+	bool move_to(const Matrix& m, BotPlan& plan, const Vec& tgt,
+		const std::vector<Vec>& blocked = std::vector<Vec>());
+
+	PathPlanner()
+	{
+	}
+
+	/// The scratch is not copied.
+	PathPlanner(const PathPlanner&)
+	{
+	}
+
+	PathPlanner& operator=(const PathPlanner&)
+	{
+		return *this;
+	}
+
+	PathPlanner(PathPlanner&&) = default;
+	PathPlanner& operator=(PathPlanner&&) = default;
+
+private:
+	struct Node
+	{
+		uint32_t f;
+		uint32_t g;
+		uint32_t index;
+		/// Index of the previous position and the first leg axis, see
+		/// m_from.
+		uint32_t from;
+	};
+
+	bool search(const Matrix& m, const Vec& src, const Vec& tgt);
+
+	/// Stamps m_stamps for the new search.
+	void next_epoch(size_t size);
+
+private:
+	/// Per voxel: m_epoch * 2 if blocked, m_epoch * 2 + 1 if visited.
+	std::vector<uint32_t> m_stamps;
+	uint32_t m_epoch = 0;
+
+	/// Per visited voxel: the previous position index in the low 30 bits
+	/// and the first leg axis + 1 of the LMove (0 for SMove) in the high.
+	std::vector<uint32_t> m_from;
+
+	/// A* frontier.
+	std::vector<Node> m_heap;
+
+	std::vector<Command> m_path;
+};
+
+/// Receives the encoded trace in about Trace::chunk_size blocks. The
+/// frontends keep their traces in memory for the TraceOptimizer, so the
+/// streaming mode is for the library callers only.
+class TraceSink
+{
+public:
+	virtual ~TraceSink() { }
+
+	/// @throw std::runtime_error
+	virtual void write(const uint8_t* data, size_t size) = 0;
+};
+
+class StreamTraceSink : public TraceSink
+{
+public:
+	explicit StreamTraceSink(std::ostream& s)
+	: m_s(s)
+	{
+	}
+
+	void write(const uint8_t* data, size_t size) override;
+
+private:
+	std::ostream& m_s;
+};
+
+/// Counters of a run. They are kept only when built with ICFPC_STATS,
+/// otherwise everything stays zero and the timers cost nothing.
+struct Stats
+{
+#ifdef ICFPC_STATS
+	static constexpr bool enabled = true;
+#else
+	static constexpr bool enabled = false;
+#endif
+
+	enum Energy
+	{
+		FieldLow,
+		FieldHigh,
+		Upkeep,
+		Moves,
+		Fissions,
+		Fills,
+		Voids,
+		energy_kinds
+	};
+
+	uint64_t low_steps = 0;
+	uint64_t high_steps = 0;
+
+	/// By Command::Type.
+	std::array<uint64_t, Command::GVoid + 1> commands{};
+
+	/// Sums up to the System energy. Voids and fusions give some back, so
+	/// their kinds may go negative.
+	std::array<int64_t, energy_kinds> energy{};
+
+	/// Most trace bytes held at once. Without the sink it is the whole
+	/// trace.
+	size_t peak_trace_bytes = 0;
+
+	/// Wall seconds in the order the phases ended.
+	std::vector<std::pair<std::string, double>> phases;
+
+	/// Counters are summed, the peak is maxed and the phases appended.
+	void merge(const Stats& other);
+
+	void write_json(std::ostream& s) const;
+};
+
+/// Adds the wall time of its scope to the stats as the named phase.
+class PhaseTimer
+{
+public:
+#ifdef ICFPC_STATS
+	PhaseTimer(Stats& stats, const char* name)
+	: m_stats(stats)
+	, m_name(name)
+	, m_start(std::chrono::steady_clock::now())
+	{
+	}
+
+	~PhaseTimer()
+	{
+		m_stats.phases.emplace_back(m_name, std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - m_start).count());
+	}
+#else
+	PhaseTimer(Stats&, const char*)
+	{
+	}
+#endif
+
+	PhaseTimer(const PhaseTimer&) = delete;
+	PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+#ifdef ICFPC_STATS
+private:
+	Stats& m_stats;
+	const char* m_name;
+	std::chrono::steady_clock::time_point m_start;
+#endif
+};
+
+/// Runs f as the named phase, returns what it returns.
+template<typename F>
+auto timed(Stats& stats, const char* name, F f) -> decltype(f())
+{
+	PhaseTimer timer(stats, name);
+	return f();
+}
+
+/// Copies fork the run: the matrices and the trace share their pages and
+/// chunks, so a fork costs about O(R) plus what it changes afterwards.
+/// Forks are not available in the streaming mode.
+class System
+{
+public:
+	/// Trace is kept in memory unless the sink is given. With the sink
+	/// the commands are encoded in step() and flushed a Trace chunk at a time.
+	explicit System(const Matrix& matrix, TraceSink* sink = nullptr);
+
+	/// Allows to continue the src execution from its out_matrix. In the
+	/// streaming mode the pending trace bytes are taken over and src must
+	/// not be flushed.
+	System(const System& src, const Matrix& matrix);
+
+	/// Not available in the streaming mode.
+	void serialize_trace(std::ostream& s);
+
+	/// Not available in the streaming mode.
+	const Trace& trace() const
+	{
+		assert(!m_sink && "streamed trace is not kept");
+		return m_trace;
+	}
+
+	/// Passes the pending trace bytes to the sink.
+	/// @throw std::runtime_error
+	void flush_trace();
+
+	uint64_t energy() const
+	{
+		return m_energy;
+	}
+
+	uint64_t steps() const
+	{
+		return m_steps;
+	}
+
+	const Stats& stats() const
+	{
+		return m_stats;
+	}
+
+	/// Callers add their phases.
+	Stats& stats()
+	{
+		return m_stats;
+	}
+
+	/// Position of the first bot.
+	const Vec& bot_pos() const
+	{
+		return m_bots.front().pos();
+	}
+
+	/// Active bots sorted by id.
+	const std::vector<Bot>& bots() const
+	{
+		return m_bots;
+	}
+
+	const Matrix& matrix() const
+	{
+		return m_matrix;
+	}
+
+	const Matrix& out_matrix() const
+	{
+		return m_out_matrix;
+	}
+
+	/// Replaces the current state, e.g. with the model to disassemble.
+	void set_out_matrix(const Matrix& matrix)
+	{
+		assert(matrix.r() == m_out_matrix.r());
+		m_grounded.reset();
+		m_out_matrix = matrix;
+	}
+
+	Harmonics harmonics() const
+	{
+		return m_harmonics;
+	}
+
+	/// Jumps to the state of another run, e.g. a TraceIndex checkpoint.
+	/// The out_matrix is set separately.
+	void restore(uint64_t steps, uint64_t energy, Harmonics harmonics,
+		const std::vector<Bot>& bots)
+	{
+		assert(m_commands.empty() && !bots.empty());
+		m_steps = steps;
+		m_energy = energy;
+		m_harmonics = harmonics;
+		m_bots = bots;
+	}
+
+	/// Whether all the full voxels of out_matrix are grounded. The first
+	/// call floods the matrix, the later ones check the neighbours of the
+	/// changes since.
+	bool grounded()
+	{
+		if(!m_track_grounded)
+		{
+			m_track_grounded = true;
+			m_grounded.reset();
+		}
+		return m_grounded.grounded(m_out_matrix);
+	}
+
+public:
+	/// Sets the command of the next bot, in the bots order, for the step.
+	void push(Command command);
+
+	/// Executes the commands of all the bots.
+	/// @throw std::runtime_error on interference or a wrong position and,
+	/// in the strict mode, on any broken rule.
+	void step();
+
+	/// Strict steps also check the bounds of every touched voxel, the moves
+	/// and the Fissions into the full voxels and the Halt conditions.
+	/// Interference is checked with the VolatilityGrid, so a step costs the
+	/// voxels it touches. Groundedness is not, its searches cost more, the
+	/// Interpreter checks it. On by default when built with ICFPC_STRICT.
+	void set_strict(bool strict)
+	{
+		m_strict = strict;
+	}
+
+	bool strict() const
+	{
+		return m_strict;
+	}
+
+	/// Single bot only.
+	void push_and_step(Command command);
+
+public:
+	enum class MovementOrder { XZY, YZX };
+
+	/// Single bot only.
+	void move_to(const Vec& tgt,
+		MovementOrder order = MovementOrder::XZY);
+
+	/// Plans the fewest steps path around the full voxels of out_matrix and
+	/// the other bots, which are assumed to stand still.
+	/// @throw std::runtime_error if tgt is unreachable.
+	void plan_path(BotPlan& plan, const Vec& tgt);
+
+	/// Executes the plans of all the bots in lockstep, the bots whose plans
+	/// are over wait. Plans go in the bots order.
+	void run_plans(const std::vector<BotPlan>& plans);
+
+	/// The same, but the harmonics are High after the steps marked in high
+	/// and Low after the rest, except the single Low steps between the
+	/// High ones. Flips take the place of Waits when possible.
+	void run_plans(const std::vector<BotPlan>& plans,
+		const std::vector<bool>& high);
+
+private:
+	void step_groups();
+
+	void check_position(const Vec& p) const;
+
+	void mark_volatile(const Vec& p);
+
+	/// Of out_matrix.
+	void set_voxel(const Vec& p, bool full);
+
+	/// Only in the strict mode.
+	/// @throw std::runtime_error
+	void check_empty(const Vec& p) const;
+
+	/// Voids and fusions pass negative e.
+	void charge(Stats::Energy kind, int64_t e)
+	{
+		m_energy += e;
+#ifdef ICFPC_STATS
+		m_stats.energy[kind] += e;
+#else
+		(void)kind;
+#endif
+	}
+
+private:
+	Matrix m_matrix;
+	Matrix m_out_matrix;
+	/// Only asked by the asserts, so the changes are not tracked until the
+	/// first grounded() and the runs keep no per-voxel groundedness state.
+	Groundedness m_grounded;
+	bool m_track_grounded = false;
+
+	Harmonics m_harmonics = Harmonics::Low;
+	uint64_t m_energy = 0;
+	uint64_t m_steps = 0;
+	Stats m_stats;
+
+	std::vector<Bot> m_bots;
+
+	/// Commands pushed for the current step.
+	std::vector<Command> m_commands;
+
+	/// Interference of the bots, without the strict mode.
+	std::vector<uint32_t> m_volatile;
+
+#ifdef ICFPC_STRICT
+	bool m_strict = true;
+#else
+	bool m_strict = false;
+#endif
+	VolatilityGrid m_grid;
+
+	PathPlanner m_planner;
+
+	/// Whole trace or, in the streaming mode, its pending chunk.
+	Trace m_trace;
+	TraceSink* m_sink = nullptr;
+};
+
+/// Commands of a single bot planned ahead of the execution.
+class BotPlan
+{
+public:
+	explicit BotPlan(const Vec& pos = Vec())
+	: m_pos(pos)
+	{
+	}
+
+	/// Position after the planned commands.
+	const Vec& pos() const
+	{
+		return m_pos;
+	}
+
+	const std::vector<Command>& commands() const
+	{
+		return m_commands;
+	}
+
+	void push(Command command);
+
+	/// Minimal number of SMoves and LMoves going axis by axis in the order,
+	/// the path stays within the box of the current and tgt positions.
+	void move_to(const Vec& tgt,
+		System::MovementOrder order = System::MovementOrder::XZY);
+
+	/// Keeps the position.
+	void clear()
+	{
+		m_commands.clear();
+	}
+
+	/// Waits until the plan has the size commands.
+	void pad(size_t size)
+	{
+		while(m_commands.size() < size)
+		{
+			m_commands.push_back(Command::wait());
+		}
+	}
+
+private:
+	Vec m_pos;
+	std::vector<Command> m_commands;
+};
+
+/// Splits the filled voxels of the within region into disjoint cuboids
+/// of at most max_size, greedily growing along z, then x, then y.
+std::vector<Region> decompose_cuboids(
+	const Matrix& m, const Region& within, const Vec& max_size);
+
+class Tracer
+{
+public:
+	enum class Direction { Up, Down };
+
+	/// Voxels are handled one by one by every bot, or as layer rectangles
+	/// by teams of four bots standing at the corners (GFill/GVoid), or by
+	/// every bot flying over 3 wide stripes and handling the voxels below
+	/// and to both sides at every stop.
+	enum class Sweep { Voxels, Rectangles, Swaths };
+
+	/// Up to the bots number of bots is used, every bot or team sweeps its
+	/// own x slab of the bounding region. Bots are spawned in run() and
+	/// fused back before it returns. Only the model layers from min_y up
+	/// are handled, the ones below are kept as they are in out_matrix.
+	Tracer(System& system, Direction dir, unsigned bots = 1,
+		Sweep sweep = Sweep::Voxels, int min_y = 0)
+	: m_system(system), m_dir(dir), m_bots(bots), m_sweep(sweep)
+	, m_min_y(min_y)
+	{
+		assert(bots > 0 && bots <= max_bots);
+		assert(sweep != Sweep::Rectangles || bots >= 4);
+	}
+
+	virtual ~Tracer() { }
+
+	void run();
+
+	void halt();
+
+protected:
+	System& m_system;
+
+	Direction m_dir;
+
+private:
+	/// Command handling the voxel at the d offset from the bot.
+	virtual Command voxel_command(const Vec& d) const = 0;
+
+	/// Group command of the bot at the nd offset from the region corner,
+	/// fd leads to the opposite corner.
+	virtual Command region_command(const Vec& nd, const Vec& fd) const = 0;
+
+private:
+	/// Longest side of the group command region.
+	static const int max_group_size = 31;
+
+	unsigned team_size() const;
+
+	void split_slabs();
+
+	/// Space the team may occupy without getting into the neighbours way.
+	std::pair<int, int> team_x_range(size_t team) const;
+
+	/// Fills m_homes at the y level.
+	void place_bots(int y);
+
+	/// Team positions for the rect layer rectangle: (x0, z0), (x0, z1),
+	/// (x1, z0), (x1, z1). Degenerate sides are widened by one.
+	std::array<Vec, 4> formation(
+		const std::pair<int, int>& x_range, const Region& rect) const;
+
+	/// Fills m_grounded_below.
+	void check_layers_grounded();
+
+	/// Whether the harmonics must be High after every step of m_plans
+	/// handling the y layer.
+	std::vector<bool> plan_layer_harmonics(int y) const;
+
+	/// Flips if needed.
+	void switch_harmonics(Harmonics h);
+
+	void spawn_bots();
+
+	void gather_bots();
+
+	/// The first bot executes the command, the rest wait.
+	void step_first(Command command);
+
+	void scan_xz_plane(int y);
+
+	void plan_xz_plane(BotPlan& plan, int y, int x0, int x1) const;
+
+	void plan_swaths(BotPlan& plan, int y, int x0, int x1) const;
+
+	void plan_rectangles(BotPlan* team, size_t t, int y, int x0, int x1) const;
+
+private:
+	Region m_bounding_region;
+
+	unsigned m_bots;
+
+	Sweep m_sweep;
+
+	int m_min_y;
+
+	/// Smallest x of every bot or team slab, slabs are adjacent.
+	std::vector<int> m_slabs;
+
+	/// Whether the model layers below y are grounded by themselves, by y.
+	std::vector<bool> m_grounded_below;
+
+	/// Where every bot is spawned and fused back, in the bots order.
+	std::vector<Vec> m_homes;
+
+	std::vector<BotPlan> m_plans;
+};
+
+class Assembler : public Tracer
+{
+public:
+	explicit Assembler(System& system, unsigned bots = 1,
+		Sweep sweep = Sweep::Voxels, int min_y = 0)
+	: Tracer(system, Direction::Up, bots, sweep, min_y)
 	{
 	}
 
 private:
-	void handle_voxel(const Vec& p) override;
+	Command voxel_command(const Vec& d) const override;
+
+	Command region_command(const Vec& nd, const Vec& fd) const override;
 };
 
 class Disassembler : public Tracer
 {
 public:
-	explicit Disassembler(System& system)
-	: Tracer(system, Direction::Down)
+	explicit Disassembler(System& system, unsigned bots = 1,
+		Sweep sweep = Sweep::Voxels, int min_y = 0)
+	: Tracer(system, Direction::Down, bots, sweep, min_y)
+	{
+		system.set_out_matrix(system.matrix());
+	}
+
+private:
+	Command voxel_command(const Vec& d) const override;
+
+	Command region_command(const Vec& nd, const Vec& fd) const override;
+};
+
+/// Turns the src model of the system into tgt and halts. A single bot voids
+/// the voxels of src AndNot tgt, top down, and fills the ones of tgt AndNot
+/// src, bottom up, going High while the model is not grounded. When some
+/// voxel is out of reach or that costs more than the rebuild estimate, the
+/// src layers above the common bottom ones are disassembled and the tgt
+/// ones assembled with the bots and the sweep instead.
+/// @return the continuation of the system, holding tgt.
+System reassemble(System& system, const Matrix& tgt, unsigned bots = 1,
+	Tracer::Sweep sweep = Tracer::Sweep::Voxels);
+
+/// Closed-form estimate of a Tracer run over the model, nothing is planned
+/// or simulated. The model statistics are gathered once, every estimate()
+/// only combines per-layer sums over the bot slabs, O(R * layers).
+class CostModel
+{
+public:
+	/// Inclusive range of layers.
+	typedef std::pair<int, int> Span;
+
+	/// Candidate traversal, as the Tracer arguments.
+	struct Plan
+	{
+		Tracer::Direction dir = Tracer::Direction::Up;
+
+		unsigned bots = 1;
+
+		Tracer::Sweep sweep = Tracer::Sweep::Voxels;
+
+		int min_y = 0;
+
+		/// Layers swept in High harmonics as a whole. The ones not
+		/// grounded by the layers below always are, see high_spans().
+		std::vector<Span> high_spans;
+	};
+
+	struct Estimate
+	{
+		uint64_t energy = 0;
+
+		uint64_t steps = 0;
+
+		/// Steps in High harmonics.
+		uint64_t high_steps = 0;
+	};
+
+	/// Share of the steps flipped to High in the grounded layers, while
+	/// the parts not yet connected to the structure are filled. Every
+	/// single bot may start such a part, the more slabs the more often.
+	/// Teams fill connected rectangles, the narrower their slabs the
+	/// fewer gaps. Voiding cuts the layers apart more often.
+	static double high_share(Tracer::Direction dir, Tracer::Sweep sweep,
+		unsigned slabs);
+
+	explicit CostModel(const Matrix& m);
+
+	Estimate estimate(const Plan& plan) const;
+
+	/// Layers not grounded by the ones below, the Tracer always sweeps
+	/// them in High harmonics.
+	const std::vector<Span>& high_spans() const
+	{
+		return m_high_spans;
+	}
+
+private:
+	/// Sum of the per-row values over the [x0, x1] rows of the y layer.
+	size_t rows_sum(const std::vector<uint32_t>& prefix,
+		int y, int x0, int x1) const
+	{
+		const size_t base = size_t(y) * (m_r + 1);
+		return prefix[base + x1 + 1] - prefix[base + x0];
+	}
+
+private:
+	unsigned m_r;
+
+	std::vector<Matrix::LayerSummary> m_layers;
+
+	/// Per-layer prefix sums over x of the row voxel counts.
+	std::vector<uint32_t> m_counts;
+
+	/// Per-layer prefix sums over x of the row runs not repeating a run of
+	/// the previous row, every such run starts a new group rectangle.
+	std::vector<uint32_t> m_fresh_runs;
+
+	/// Runs of every row, by y * R + x.
+	std::vector<uint32_t> m_runs;
+
+	std::vector<Span> m_high_spans;
+};
+
+/// Replays traces checking every rule: bounds, volatility, groundedness
+/// in Low harmonics, Fission seeds, Fusion pairs, group commands and Halt.
+class Interpreter
+{
+public:
+	/// Starts with the src model, the single bot is at the origin.
+	explicit Interpreter(const Matrix& src);
+
+	/// May be called several times to continue the execution.
+	/// @throw std::runtime_error with the step number on violation.
+	void run(const Trace& trace);
+
+	bool halted() const
+	{
+		return m_halted;
+	}
+
+	int64_t energy() const
+	{
+		return m_energy;
+	}
+
+	uint64_t steps() const
+	{
+		return m_steps;
+	}
+
+	Harmonics harmonics() const
+	{
+		return m_harmonics;
+	}
+
+	const Matrix& matrix() const
+	{
+		return m_matrix;
+	}
+
+private:
+	struct BotState
+	{
+		unsigned bid;
+		Vec pos;
+		/// Bit i is the bid i.
+		uint64_t seeds;
+	};
+
+	struct Pending
+	{
+		size_t bot;
+		Command::Type type;
+		Vec tgt;
+		Region region;
+	};
+
+	void step();
+
+	void move(BotState& bot, const Vec& d);
+
+	void mark_volatile(const Vec& c);
+
+	void check_bounds(const Vec& c) const;
+
+	/// Keeps the groundedness up to date.
+	void set_voxel(const Vec& c, bool full);
+
+	[[noreturn]] void fail(const std::string& what) const;
+
+	uint32_t index(const Vec& c) const
+	{
+		return (c.y * m_r + c.x) * m_r + c.z;
+	}
+
+	Vec coord(uint32_t i) const
+	{
+		return Vec(i / m_r % m_r, i / m_r / m_r, i % m_r);
+	}
+
+private:
+	Matrix m_matrix;
+	const int m_r;
+
+	Harmonics m_harmonics = Harmonics::Low;
+	int64_t m_energy = 0;
+	uint64_t m_steps = 0;
+	bool m_halted = false;
+
+	/// Sorted by bid.
+	std::vector<BotState> m_bots;
+
+	Groundedness m_groundedness;
+
+	// Per step scratch buffers.
+	std::vector<Command> m_commands;
+	std::vector<uint32_t> m_volatile;
+	bool m_changed = false;
+	std::vector<Pending> m_fusions;
+	std::vector<Pending> m_groups;
+	std::vector<BotState> m_born;
+};
+
+/// @throw std::runtime_error
+Trace read_trace_file(const std::string& path);
+
+/// Peephole pass rewriting a finished trace into a cheaper one building
+/// the same model. Consecutive steps of moves and waits are merged while
+/// every bot fits both its moves into a single SMove or LMove and the
+/// paths of the bots stay apart, the steps of waits only are dropped, and
+/// so are the Flip pairs around the steps leaving the matrix unchanged.
+/// Every removed step saves its field energy, which outweighs the longer
+/// LMoves, so the energy never grows. Linear in the trace length.
+class TraceOptimizer
+{
+public:
+	explicit TraceOptimizer(unsigned r)
+	: m_r(r)
+	{
+	}
+
+	/// @throw std::runtime_error if the trace ends in the middle of a step
+	/// or has the Fusion without its pair.
+	Trace run(const Trace& trace);
+
+	/// Energy of the last input minus the energy of its output.
+	uint64_t saved() const
+	{
+		return m_saved;
+	}
+
+	/// Stats of the last output given the ones counting its input, e.g. of
+	/// the System making it. Without ICFPC_STATS they are not counted and
+	/// stay as they are. The phases are kept.
+	Stats stats(const Stats& input) const;
+
+private:
+	/// Commands of all the steps, the step i is [starts[i], starts[i + 1]).
+	struct Steps
+	{
+		std::vector<Command> commands;
+		std::vector<size_t> starts;
+
+		size_t size() const
+		{
+			return starts.size() - 1;
+		}
+	};
+
+	/// Steps, commands and the energy not depending on the matrix: field,
+	/// bots, moves, Fissions and Fusions. Fills and voids are never
+	/// changed.
+	Stats count(const Steps& steps) const;
+
+	void drop_flips(Steps& steps) const;
+
+	/// Both commands of every bot in one, the Wait steps are dropped.
+	Steps merge_moves(const Steps& steps) const;
+
+	/// False if some bot can't make a and b in one command or the paths
+	/// from pos cross.
+	bool merge_step(const Command* a, const Command* b,
+		const std::vector<Vec>& pos, std::vector<Command>& merged) const;
+
+private:
+	const unsigned m_r;
+
+	uint64_t m_saved = 0;
+
+	/// Counts of the last input and output.
+	Stats m_input;
+	Stats m_output;
+
+	/// Scratch.
+	mutable std::vector<Vec> m_legs;
+	mutable std::vector<uint32_t> m_volatile;
+};
+
+/// Sidecar of a .nbt file with the checkpoints of its execution every
+/// interval steps: the trace byte offset, the bots, the energy and the
+/// harmonics. Every snapshot_every-th checkpoint keeps the whole matrix,
+/// the others the voxels changed since the previous one. A step is reached
+/// from the closest checkpoint, with at most snapshot_every deltas and
+/// interval steps to replay, no matter how long the trace is.
+///
+/// The file is the header, the checkpoints and their table, which is
+/// read at once, the checkpoints are read on demand.
+class TraceIndex
+{
+public:
+	struct Entry
+	{
+		uint64_t step;
+
+		/// Trace bytes before the step.
+		uint64_t offset;
+
+		/// Of the checkpoint in the index file.
+		uint64_t position;
+	};
+
+	/// Replays the trace from src, an empty matrix for assembly traces, and
+	/// writes its index.
+	/// @throw std::runtime_error
+	static void write(const std::string& trace_path, const Matrix& src,
+		const std::string& path, unsigned interval = 4096,
+		unsigned snapshot_every = 16);
+
+	/// Reads the table.
+	/// @throw std::runtime_error
+	explicit TraceIndex(const std::string& path);
+
+	unsigned r() const
+	{
+		return m_r;
+	}
+
+	const std::vector<Entry>& entries() const
+	{
+		return m_entries;
+	}
+
+	/// Of the last checkpoint at or before the step.
+	size_t find(uint64_t step) const;
+
+	/// System of the matrix model in the state of the i-th checkpoint. Its
+	/// trace starts there. The src model must be the one the index was
+	/// written for, empty for assembly traces.
+	/// @throw std::runtime_error
+	System resume(size_t i, const Matrix& src, const Matrix& matrix) const;
+
+	/// Resumes at the closest checkpoint and replays the trace up to the
+	/// step, which must be in the trace.
+	/// @throw std::runtime_error
+	System seek(const std::string& trace_path, const Matrix& src,
+		const Matrix& matrix, uint64_t step) const;
+
+private:
+	Matrix read_matrix(size_t i) const;
+
+private:
+	unsigned m_r = 0;
+	unsigned m_interval = 0;
+	unsigned m_snapshot_every = 0;
+	uint64_t m_source_hash = 0;
+	std::vector<Entry> m_entries;
+
+	mutable std::ifstream m_f;
+};
+
+/// Runs the tasks on the worker threads. Every worker has its own deque:
+/// it takes the newest own tasks and steals the oldest ones of the others.
+class ThreadPool
+{
+public:
+	/// Zero is the hardware concurrency.
+	explicit ThreadPool(unsigned threads = 0);
+
+	/// Waits for the tasks.
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned size() const
+	{
+		return m_threads.size();
+	}
+
+	/// Tasks submitted by the workers go to their own deques, the rest
+	/// are dealt round-robin.
+	void submit(std::function<void()> task);
+
+	/// Until all the tasks, including the ones they submit, are done.
+	/// Rethrows the first exception thrown by a task. Not for the tasks,
+	/// they are pending themselves.
+	void wait();
+
+	/// Runs the queued tasks on the calling thread until done(), which the
+	/// tasks of this pool make true. A task may wait so for the tasks it
+	/// has submitted, the worker keeps working meanwhile.
+	void wait_until(const std::function<bool()>& done);
+
+private:
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	void work(unsigned worker);
+
+	/// Runs the task reserved by decrementing m_queued.
+	void execute(unsigned worker);
+
+	bool take(unsigned worker, std::function<void()>& task);
+
+private:
+	std::vector<std::unique_ptr<Queue>> m_queues;
+	std::vector<std::thread> m_threads;
+
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	/// Notified with every finished task.
+	std::condition_variable m_idle;
+
+	/// Submitted and not taken yet.
+	size_t m_queued = 0;
+	/// Submitted and not finished yet.
+	size_t m_pending = 0;
+	unsigned m_next = 0;
+	bool m_stop = false;
+
+	std::exception_ptr m_error;
+};
+
+/// Runs Tracer configurations concurrently, every one in its own System
+/// keeping the trace in memory, and keeps the lowest energy result.
+class Portfolio
+{
+public:
+	struct Config
+	{
+		unsigned bots;
+
+		Tracer::Sweep sweep;
+	};
+
+	/// Solves the problem with the config, the returned System is halted.
+	typedef std::function<System(const Config&)> Solver;
+
+	typedef std::function<uint64_t(const Config&)> Estimator;
+
+	/// Bots counts and sweeps worth trying.
+	static std::vector<Config> default_configs();
+
+	explicit Portfolio(ThreadPool& pool,
+		std::vector<Config> configs = default_configs())
+	: m_pool(pool), m_configs(std::move(configs))
 	{
-		system.out_matrix() = system.matrix();
+	}
+
+	const std::vector<Config>& configs() const
+	{
+		return m_configs;
+	}
+
+	/// Drops the configs estimated over margin times the best estimate.
+	void prune(const Estimator& estimate, double margin = 1.5);
+
+	/// Only the best System so far is kept, the rest are dropped as soon
+	/// as they are beaten. May be called from a task of the pool, which
+	/// runs the configs meanwhile.
+	/// @throw std::runtime_error when the solver throws for some config.
+	System run(const Solver& solve);
+
+	/// Config of the System returned by the last run().
+	const Config& best() const
+	{
+		return m_best;
 	}
 
 private:
-	void handle_voxel(const Vec& p) override;
+	ThreadPool& m_pool;
+
+	std::vector<Config> m_configs;
+
+	Config m_best = Config{ 1, Tracer::Sweep::Voxels };
 };
 
+inline std::ostream& operator<<(std::ostream& s, const Portfolio::Config& c)
+{
+	static const char* const sweeps[] = { "voxels", "rectangles", "swaths" };
+	return s << c.bots << " bots, " << sweeps[int(c.sweep)];
+}
+
 } //
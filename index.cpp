@@ -0,0 +1,73 @@
+/// ICFPC2018 solution code chunks.
+/// Copyright (C) 2018 cybevnm
+
+#include <iostream>
+#include <fstream>
+
+#include "icfpc-2018.hpp"
+
+using namespace icfpc2018;
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		if(argc != 4 && argc != 5)
+		{
+			throw std::runtime_error("Wrong argv");
+		}
+
+		const std::string trace_path = argv[1];
+		const std::string src_path = argv[2];
+		const std::string tgt_path = argv[3];
+		const std::string index_path = trace_path + ".idx";
+		if(src_path == "-" && tgt_path == "-")
+		{
+			throw std::runtime_error("No models given");
+		}
+
+		// Assembly traces start from the empty matrix of the target size.
+		const Matrix tgt = (tgt_path != "-")
+			? read_model_file(tgt_path) : Matrix(read_model_file(src_path).r());
+		const Matrix src = (src_path != "-")
+			? read_model_file(src_path) : Matrix(tgt.r());
+		if(src.r() != tgt.r())
+		{
+			throw std::runtime_error("Models resolutions differ");
+		}
+
+		if(argc == 4)
+		{
+			std::cerr << "Indexing trace " << trace_path << std::endl;
+			TraceIndex::write(trace_path, src, index_path);
+			std::cerr
+				<< "Checkpoints: " << TraceIndex(index_path).entries().size()
+				<< std::endl;
+			return 0;
+		}
+
+		// The model of the System is the target, the source of disassemblies.
+		const TraceIndex index(index_path);
+		System s = index.seek(trace_path, src,
+			(tgt_path != "-") ? tgt : src, std::stoull(argv[4]));
+		std::cout << "Steps: " << s.steps() << std::endl;
+		std::cout << "Energy: " << s.energy() << std::endl;
+		std::cout << "Harmonics: "
+			<< ((s.harmonics() == Harmonics::High) ? "High" : "Low")
+			<< std::endl;
+		for(const auto& bot : s.bots())
+		{
+			std::cout << "Bot " << bot.id() << ": " << bot.pos() << std::endl;
+		}
+	}
+	catch(const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		std::cout
+			<< "Usage: index trace source_model|- target_model|- [step]"
+			<< std::endl;
+		return 1;
+	}
+
+	return 0;
+}
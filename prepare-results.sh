@@ -19,64 +19,31 @@ mkdir models/
 
 #############
 
-pushd problemsF
-
-echo "-----------------------"
-echo "Assembling..."
-files=(FA*_tgt.mdl)
-for f in "${files[@]}"
-do
-	assemble $f "../results/${f%_tgt.mdl}.nbt" "../models/$f"
-done
-
-popd
-
-#############
-
-pushd problemsF
-
 echo "-----------------------"
-echo "Disassembling..."
-files=(FD*_src.mdl)
-for f in "${files[@]}"
-do
-	disassemble $f "../results/${f%_src.mdl}.nbt"
-done
+echo "Solving..."
+batch problemsF results models \
+	|| echo "Some problems are not solved"
 
-popd
-
-#############
+##############
 
 pushd problemsF
 
 echo "-----------------------"
-echo "Reassembling..."
-files=(FR*_src.mdl)
-for f in "${files[@]}"
+echo "Validating traces..."
+for f in FA*_tgt.mdl
 do
-		reassemble $f "${f%_src.mdl}_tgt.mdl" "../results/${f%_src.mdl}.nbt" \
-		  "../models/${f%_src.mdl}_tgt.mdl"
+	validate "../results/${f%_tgt.mdl}.nbt" - $f \
+		|| echo "Wrong trace: ../results/${f%_tgt.mdl}.nbt"
 done
-
-popd
-
-##############
-
-pushd problemsF
-
-echo "-----------------------"
-echo "Testing assembled..."
-files=(FA*_tgt.mdl)
-for f in "${files[@]}"
+for f in FD*_src.mdl
 do
-	diff $f "../models/$f" || echo "Wrong model: ../models/$f"
+	validate "../results/${f%_src.mdl}.nbt" $f - \
+		|| echo "Wrong trace: ../results/${f%_src.mdl}.nbt"
 done
-
-echo "Testing reassembled..."
-files=(FR*_tgt.mdl)
-for f in "${files[@]}"
+for f in FR*_src.mdl
 do
-	diff $f "../models/$f" || echo "Wrong model: ../models/$f"
+	validate "../results/${f%_src.mdl}.nbt" $f "${f%_src.mdl}_tgt.mdl" \
+		|| echo "Wrong trace: ../results/${f%_src.mdl}.nbt"
 done
 
 popd
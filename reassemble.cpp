@@ -24,32 +24,64 @@ int main(int argc, char* argv[])
 			<< " Resulting model is in " << argv[4] << "."
 			<< std::endl;
 
-		const Matrix m1 = read_model_file(argv[1]);
+		Stats report;
+
+		const Matrix m1 = timed(report, "load",
+			[&]() { return read_model_file(argv[1]); });
 		std::cerr << "R1: " << m1.r() << std::endl;
 
-		System ds(m1);
-		Disassembler d(ds);
-		d.run();
+		std::ofstream f(argv[3], std::ios::binary);
+		if(!f)
+		{
+			throw std::runtime_error("Can't open " + std::string(argv[3]));
+		}
 
-		const Matrix m2 = read_model_file(argv[2]);
+		const Matrix m2 = timed(report, "load",
+			[&]() { return read_model_file(argv[2]); });
 		std::cerr << "R2: " << m2.r() << std::endl;
 
-		System as(ds, m2);
-		Assembler a(as);
-		a.run();
-		a.halt();
+		ThreadPool pool;
+		Portfolio portfolio(pool);
 
-		std::cerr << "Energy: " << as.energy() << std::endl;
-
-		std::ofstream f(argv[3], std::ios::binary);
-		if(!f)
 		{
-			throw std::runtime_error("Can't open " + std::string(argv[3]));
+			PhaseTimer timer(report, "analysis");
+
+			// Only the layers above the common ones are rebuilt.
+			const int common = m1.common_layers(m2);
+			const CostModel model1(m1);
+			const CostModel model2(m2);
+			portfolio.prune([&](const Portfolio::Config& c) {
+				CostModel::Plan plan;
+				plan.bots = c.bots;
+				plan.sweep = c.sweep;
+				plan.min_y = common;
+				const uint64_t up = model2.estimate(plan).energy;
+				plan.dir = Tracer::Direction::Down;
+				return model1.estimate(plan).energy + up;
+			});
 		}
 
-		as.serialize_trace(f);
+		System as = portfolio.run([&](const Portfolio::Config& c) {
+			System ds(m1);
+			return reassemble(ds, m2, c.bots, c.sweep);
+		});
+		report.merge(as.stats());
+		TraceOptimizer optimizer(m2.r());
+		const Trace trace = timed(report, "optimization",
+			[&]() { return optimizer.run(as.trace()); });
+		report = optimizer.stats(report);
+		timed(report, "serialization", [&]() { trace.serialize(f); });
+
+		std::cerr << "Config: " << portfolio.best() << std::endl;
+		std::cerr << "Energy: " << as.energy() - optimizer.saved() << std::endl;
 
-		write_model_file(as.out_matrix(), argv[4]);
+		timed(report, "write",
+			[&]() { write_model_file(as.out_matrix(), argv[4]); });
+
+		if(Stats::enabled)
+		{
+			report.write_json(std::cerr);
+		}
 	}
 	catch(const std::runtime_error& e)
 	{
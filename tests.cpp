@@ -6,7 +6,10 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <stdexcept>
+#include <atomic>
+#include <numeric>
 
 #include <boost/test/unit_test.hpp>
 #include <boost/filesystem.hpp>
@@ -68,3 +71,1292 @@ BOOST_AUTO_TEST_CASE(System_move_to_test)
 	s.move_to(Vec(0,0,0));
 	BOOST_CHECK_EQUAL(Vec(), s.bot_pos());
 }
+
+BOOST_AUTO_TEST_CASE(BotPlan_move_to_test)
+{
+	BotPlan p;
+	p.move_to(Vec(5, 5, 5));
+	BOOST_CHECK_EQUAL(Vec(5, 5, 5), p.pos());
+	BOOST_REQUIRE_EQUAL(2, p.commands().size());
+	BOOST_CHECK(p.commands()[0] == Command::lmove(Vec(5, 0, 0), Vec(0, 0, 5)));
+	BOOST_CHECK(p.commands()[1] == Command::smove(Vec(0, 5, 0)));
+
+	p = BotPlan();
+	p.move_to(Vec(20, 5, 0));
+	BOOST_CHECK_EQUAL(Vec(20, 5, 0), p.pos());
+	BOOST_CHECK_EQUAL(2, p.commands().size());
+
+	p = BotPlan();
+	p.move_to(Vec(21, 50, 0), System::MovementOrder::YZX);
+	BOOST_CHECK_EQUAL(Vec(21, 50, 0), p.pos());
+	BOOST_CHECK_EQUAL(6, p.commands().size());
+
+	System s((Matrix(60)));
+	s.move_to(Vec(23, 40, 7));
+	s.move_to(Vec(1, 2, 3), System::MovementOrder::YZX);
+	s.move_to(Vec());
+	BOOST_CHECK_EQUAL(Vec(), s.bot_pos());
+	s.push_and_step(Command::halt());
+
+	Interpreter i((Matrix(60)));
+	i.run(s.trace());
+	BOOST_CHECK(i.halted());
+	BOOST_CHECK_EQUAL(s.energy(), i.energy());
+}
+
+BOOST_AUTO_TEST_CASE(Matrix_bits_test)
+{
+	Matrix m(130);
+
+	BOOST_CHECK(m.none());
+	BOOST_CHECK_EQUAL(3, m.row_words());
+
+	m.set_voxel(Vec(3, 7, 0), true);
+	m.set_voxel(Vec(3, 7, 64), true);
+	m.set_voxel(Vec(5, 7, 129), true);
+	m.set_voxel(Vec(4, 9, 70), true);
+
+	BOOST_CHECK(m.any());
+	BOOST_CHECK_EQUAL(4, m.popcount());
+	BOOST_CHECK_EQUAL(3, m.layer_popcount(7));
+	BOOST_CHECK(!m.layer_any(8));
+	BOOST_CHECK(m.row_any(3, 7));
+	BOOST_CHECK(!m.row_any(4, 7));
+	BOOST_CHECK(m.row_z_range(3, 7) == std::make_pair(0, 64));
+
+	const auto region = m.calc_bounding_region();
+	BOOST_CHECK(region.first);
+	BOOST_CHECK_EQUAL(Vec(3, 7, 0), region.second.a);
+	BOOST_CHECK_EQUAL(Vec(5, 9, 129), region.second.b);
+
+	const auto region_y = m.calc_bounding_region_y(7);
+	BOOST_CHECK(region_y.first);
+	BOOST_CHECK_EQUAL(Vec(3, 7, 0), region_y.second.a);
+	BOOST_CHECK_EQUAL(Vec(5, 7, 129), region_y.second.b);
+
+	m.set_voxel(Vec(3, 7, 64), false);
+	BOOST_CHECK(!m.voxel(Vec(3, 7, 64)));
+	BOOST_CHECK(m.voxel(Vec(3, 7, 0)));
+	BOOST_CHECK_EQUAL(3, m.popcount());
+}
+
+BOOST_AUTO_TEST_CASE(Model_io_odd_size_test)
+{
+	for(const unsigned r : { 1u, 13u, 64u, 65u, 250u })
+	{
+		Matrix m(r);
+		unsigned seed = r;
+		for(int x = 0; x < int(r); ++x)
+		{
+			for(int y = 0; y < int(r); ++y)
+			{
+				for(int z = 0; z < int(r); ++z)
+				{
+					seed = seed * 1103515245 + 12345;
+					m.set_voxel(Vec(x, y, z), (seed >> 16) & 1);
+				}
+			}
+		}
+
+		write_model_file(m, "/tmp/test_odd.mdl");
+		const Matrix n = read_model_file("/tmp/test_odd.mdl");
+
+		BOOST_REQUIRE_EQUAL(r, n.r());
+		BOOST_CHECK_EQUAL(m.popcount(), n.popcount());
+		bool same = true;
+		for(int x = 0; x < int(r); ++x)
+		{
+			for(int y = 0; y < int(r); ++y)
+			{
+				for(int z = 0; z < int(r); ++z)
+				{
+					same = same && m.voxel(Vec(x, y, z)) == n.voxel(Vec(x, y, z));
+				}
+			}
+		}
+		BOOST_CHECK(same);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(System_streaming_trace_test)
+{
+	const Matrix m = read_model_file(path("tests/FA001_tgt.mdl"));
+
+	std::ostringstream kept;
+	{
+		System s(m);
+		Assembler a(s);
+		a.run();
+		a.halt();
+		s.serialize_trace(kept);
+	}
+
+	std::ostringstream streamed;
+	{
+		StreamTraceSink sink(streamed);
+		System s(m, &sink);
+		Assembler a(s);
+		a.run();
+		a.halt();
+		s.flush_trace();
+	}
+
+	BOOST_CHECK(!kept.str().empty());
+	BOOST_CHECK(kept.str() == streamed.str());
+}
+
+BOOST_TEST_DONT_PRINT_LOG_VALUE(Command);
+
+BOOST_AUTO_TEST_CASE(Trace_test)
+{
+	BOOST_CHECK_EQUAL(8, sizeof(Command));
+
+	const std::vector<Command> commands = {
+		Command::flip(),
+		Command::smove_x(-15),
+		Command::smove_y(7),
+		Command::smove_z(15),
+		Command::fill(Vec(1, -1, 0)),
+		Command::fill_below(),
+		Command::voiid(Vec(0, 1, -1)),
+		Command::wait(),
+		Command::lmove(Vec(0, 0, -5), Vec(3, 0, 0)),
+		Command::fission(Vec(1, 1, 0), 17),
+		Command::fusion_p(Vec(-1, 0, 0)),
+		Command::fusion_s(Vec(0, 0, 1)),
+		Command::gfill(Vec(0, -1, 0), Vec(30, 0, -30)),
+		Command::gvoid(Vec(1, 0, 1), Vec(-1, 2, 3)),
+		Command::halt()
+	};
+
+	Trace t;
+	for(const auto& c : commands)
+	{
+		t.push_back(c);
+	}
+	BOOST_CHECK_EQUAL(26, t.size());
+
+	std::ostringstream s;
+	for(const auto& c : commands)
+	{
+		c.serialize(s);
+	}
+	std::ostringstream serialized;
+	t.serialize(serialized);
+	BOOST_CHECK(serialized.str() == s.str());
+
+	size_t i = 0;
+	for(const auto& c : t)
+	{
+		BOOST_REQUIRE(i < commands.size());
+		BOOST_CHECK_EQUAL(commands[i], c);
+		++i;
+	}
+	BOOST_CHECK_EQUAL(commands.size(), i);
+
+	Command c;
+	const uint8_t truncated[] = { 0x14 };
+	BOOST_CHECK_THROW(Command::decode(truncated, 1, c), std::runtime_error);
+}
+
+namespace {
+
+Trace make_trace(const std::vector<Command>& commands)
+{
+	Trace t;
+	for(const auto& c : commands)
+	{
+		t.push_back(c);
+	}
+	return t;
+}
+
+} //
+
+BOOST_AUTO_TEST_CASE(Interpreter_replay_test)
+{
+	const Matrix m = read_model_file(path("tests/FA001_tgt.mdl"));
+
+	System s(m);
+	Assembler a(s);
+	a.run();
+	a.halt();
+
+	Interpreter i(Matrix(m.r()));
+	i.run(s.trace());
+	BOOST_CHECK(i.halted());
+	BOOST_CHECK_EQUAL(s.energy(), i.energy());
+	BOOST_CHECK(i.matrix() == m);
+}
+
+BOOST_AUTO_TEST_CASE(Interpreter_multi_bot_test)
+{
+	Interpreter i((Matrix(5)));
+	i.run(make_trace({
+		Command::fission(Vec(1, 1, 0), 0),
+		Command::wait(), Command::smove_x(2),
+		Command::gfill(Vec(1, 0, 1), Vec(2, 0, 0)),
+			Command::gfill(Vec(0, -1, 1), Vec(-2, 0, 0)),
+		Command::wait(), Command::smove_x(-2),
+		Command::fusion_p(Vec(1, 1, 0)), Command::fusion_s(Vec(-1, -1, 0)),
+		Command::halt()
+	}));
+
+	BOOST_CHECK(i.halted());
+	BOOST_CHECK_EQUAL(6, i.steps());
+	BOOST_CHECK_EQUAL(2494, i.energy());
+	BOOST_CHECK_EQUAL(3, i.matrix().popcount());
+	BOOST_CHECK(i.matrix().voxel(Vec(2, 0, 1)));
+}
+
+BOOST_AUTO_TEST_CASE(Interpreter_violations_test)
+{
+	// Floating voxel in Low harmonics.
+	BOOST_CHECK_THROW(Interpreter(Matrix(5)).run(make_trace({
+			Command::smove_y(2), Command::fill(Vec(0, 1, 0)) })),
+		std::runtime_error);
+
+	// Same, but in High harmonics.
+	BOOST_CHECK_NO_THROW(Interpreter(Matrix(5)).run(make_trace({
+			Command::flip(), Command::smove_y(2), Command::fill(Vec(0, 1, 0)) })));
+
+	// Back to Low with the floating voxel.
+	BOOST_CHECK_THROW(Interpreter(Matrix(5)).run(make_trace({
+			Command::flip(), Command::smove_y(2), Command::fill(Vec(0, 1, 0)),
+			Command::flip() })),
+		std::runtime_error);
+
+	// Voiding the support in Low harmonics.
+	BOOST_CHECK_THROW(Interpreter(Matrix(5)).run(make_trace({
+			Command::smove_x(1), Command::fill(Vec(0, 0, 1)),
+			Command::smove_y(1), Command::fill(Vec(0, 0, 1)),
+			Command::smove_y(-1), Command::voiid(Vec(0, 0, 1)) })),
+		std::runtime_error);
+
+	// Both bots move into the same voxel.
+	BOOST_CHECK_THROW(Interpreter(Matrix(5)).run(make_trace({
+			Command::fission(Vec(0, 0, 1), 0),
+			Command::smove_x(1), Command::lmove(Vec(0, 0, -1), Vec(1, 0, 0)) })),
+		std::runtime_error);
+
+	// Out of bounds.
+	BOOST_CHECK_THROW(Interpreter(Matrix(5)).run(make_trace({
+			Command::smove_x(5) })),
+		std::runtime_error);
+
+	// Halt away from the origin.
+	BOOST_CHECK_THROW(Interpreter(Matrix(5)).run(make_trace({
+			Command::smove_x(1), Command::halt() })),
+		std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(Tracer_multi_bot_test)
+{
+	const Matrix m = read_model_file(path("tests/FA001_tgt.mdl"));
+
+	System single(m);
+	Assembler(single).run();
+
+	System s(m);
+	Assembler a(s, max_bots);
+	a.run();
+	BOOST_CHECK_EQUAL(1, s.bots().size());
+	a.halt();
+
+	BOOST_CHECK(s.out_matrix() == m);
+	BOOST_CHECK(s.energy() < single.energy());
+
+	Interpreter i(Matrix(m.r()));
+	i.run(s.trace());
+	BOOST_CHECK(i.halted());
+	BOOST_CHECK_EQUAL(s.energy(), i.energy());
+	BOOST_CHECK(i.matrix() == m);
+
+	System d(m);
+	Disassembler(d, max_bots).run();
+	BOOST_CHECK(d.out_matrix().none());
+}
+
+BOOST_AUTO_TEST_CASE(System_fission_test)
+{
+	System s((Matrix(10)));
+
+	s.push_and_step(Command::fission(Vec(1, 0, 0), 5));
+	BOOST_REQUIRE_EQUAL(2, s.bots().size());
+	BOOST_CHECK_EQUAL(2, s.bots()[1].id());
+	BOOST_CHECK_EQUAL(Vec(1, 0, 0), s.bots()[1].pos());
+	BOOST_CHECK_EQUAL(5, s.bots()[1].seeds().size());
+	BOOST_CHECK_EQUAL(max_bots - 7, s.bots()[0].seeds().size());
+
+	// Both bots move into the same voxel.
+	s.push(Command::smove_z(1));
+	s.push(Command::smove_x(-1));
+	BOOST_CHECK_THROW(s.step(), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(System_fusion_test)
+{
+	System s((Matrix(10)));
+
+	s.push_and_step(Command::fission(Vec(0, 1, 1), 3));
+	s.push(Command::wait());
+	s.push(Command::smove_x(2));
+	s.step();
+	s.push(Command::wait());
+	s.push(Command::smove_x(-2));
+	s.step();
+	s.push(Command::fusion_p(Vec(0, 1, 1)));
+	s.push(Command::fusion_s(Vec(0, -1, -1)));
+	s.step();
+
+	BOOST_REQUIRE_EQUAL(1, s.bots().size());
+	BOOST_CHECK_EQUAL(max_bots - 1, s.bots()[0].seeds().size());
+	s.push_and_step(Command::halt());
+
+	Interpreter i((Matrix(10)));
+	i.run(s.trace());
+	BOOST_CHECK(i.halted());
+	BOOST_CHECK_EQUAL(s.energy(), i.energy());
+}
+
+BOOST_AUTO_TEST_CASE(Decompose_cuboids_test)
+{
+	Matrix m(10);
+	for(int x = 2; x <= 5; ++x)
+	{
+		for(int z = 1; z <= 8; ++z)
+		{
+			m.set_voxel(Vec(x, 0, z), true);
+			m.set_voxel(Vec(x, 1, z), true);
+		}
+	}
+	m.set_voxel(Vec(7, 0, 7), true);
+
+	const Region all(Vec(0, 0, 0), Vec(9, 9, 9));
+
+	const auto cuboids = decompose_cuboids(m, all, Vec(31, 31, 31));
+	BOOST_REQUIRE_EQUAL(2, cuboids.size());
+	BOOST_CHECK_EQUAL(Vec(2, 0, 1), cuboids[0].a);
+	BOOST_CHECK_EQUAL(Vec(5, 1, 8), cuboids[0].b);
+	BOOST_CHECK_EQUAL(Vec(7, 0, 7), cuboids[1].a);
+
+	const auto layers = decompose_cuboids(m, all, Vec(3, 1, 31));
+	BOOST_CHECK_EQUAL(5, layers.size());
+}
+
+BOOST_AUTO_TEST_CASE(Tracer_rectangles_test)
+{
+	const Matrix m = read_model_file(path("tests/FA001_tgt.mdl"));
+
+	System voxels(m);
+	Assembler(voxels, max_bots).run();
+
+	System s(m);
+	Assembler a(s, max_bots, Tracer::Sweep::Rectangles);
+	a.run();
+	BOOST_CHECK_EQUAL(1, s.bots().size());
+	a.halt();
+
+	BOOST_CHECK(s.out_matrix() == m);
+	BOOST_CHECK(s.energy() < voxels.energy());
+
+	Interpreter i(Matrix(m.r()));
+	i.run(s.trace());
+	BOOST_CHECK(i.halted());
+	BOOST_CHECK_EQUAL(s.energy(), i.energy());
+	BOOST_CHECK(i.matrix() == m);
+
+	System d(m);
+	Disassembler dis(d, 4, Tracer::Sweep::Rectangles);
+	dis.run();
+	dis.halt();
+	BOOST_CHECK(d.out_matrix().none());
+
+	Interpreter di(m);
+	di.run(d.trace());
+	BOOST_CHECK(di.halted());
+	BOOST_CHECK_EQUAL(d.energy(), di.energy());
+	BOOST_CHECK(di.matrix().none());
+}
+
+BOOST_AUTO_TEST_CASE(Tracer_swaths_test)
+{
+	const Matrix m = read_model_file(path("tests/FA001_tgt.mdl"));
+
+	for(unsigned bots : { 1u, 8u })
+	{
+		System voxels(m);
+		Assembler(voxels, bots).run();
+
+		System s(m);
+		Assembler a(s, bots, Tracer::Sweep::Swaths);
+		a.run();
+		a.halt();
+		BOOST_CHECK(s.out_matrix() == m);
+
+		Interpreter i(Matrix(m.r()));
+		i.run(s.trace());
+		BOOST_CHECK(i.halted());
+		BOOST_CHECK_EQUAL(s.energy(), i.energy());
+		BOOST_CHECK(i.matrix() == m);
+
+		Interpreter vi(Matrix(m.r()));
+		vi.run(voxels.trace());
+		BOOST_CHECK(i.steps() < vi.steps());
+
+		System d(m);
+		Disassembler dis(d, bots, Tracer::Sweep::Swaths);
+		dis.run();
+		dis.halt();
+		BOOST_CHECK(d.out_matrix().none());
+
+		Interpreter di(m);
+		di.run(d.trace());
+		BOOST_CHECK(di.halted());
+		BOOST_CHECK_EQUAL(d.energy(), di.energy());
+		BOOST_CHECK(di.matrix().none());
+	}
+}
+
+BOOST_AUTO_TEST_CASE(Groundedness_test)
+{
+	Matrix m(10);
+	Groundedness g;
+
+	const auto fill = [&](const Vec& p) {
+		m.set_voxel(p, true);
+		g.fill(m, p);
+	};
+	const auto voiid = [&](const Vec& p) {
+		m.set_voxel(p, false);
+		g.voiid(m, p);
+	};
+
+	BOOST_CHECK(g.grounded(m));
+
+	// An arch: two columns and the bridge.
+	fill(Vec(2, 0, 2));
+	fill(Vec(2, 1, 2));
+	fill(Vec(3, 2, 2));
+	BOOST_CHECK(!g.grounded(m));
+	fill(Vec(4, 2, 2));
+	fill(Vec(4, 1, 2));
+	BOOST_CHECK(!g.grounded(m));
+	fill(Vec(2, 2, 2));
+	BOOST_CHECK(g.grounded(m));
+	fill(Vec(4, 0, 2));
+
+	voiid(Vec(2, 1, 2));
+	BOOST_CHECK(g.grounded(m));
+	voiid(Vec(4, 1, 2));
+	BOOST_CHECK(!g.grounded(m));
+	fill(Vec(4, 1, 2));
+	BOOST_CHECK(g.grounded(m));
+
+	// Repeated queries keep the answer until the matrix changes.
+	voiid(Vec(4, 1, 2));
+	for(int i = 0; i < 3; ++i)
+	{
+		BOOST_CHECK(!g.grounded(m));
+	}
+	fill(Vec(7, 5, 7));
+	BOOST_CHECK(!g.grounded(m));
+	BOOST_CHECK(!g.grounded(m));
+	voiid(Vec(7, 5, 7));
+	fill(Vec(4, 1, 2));
+	for(int i = 0; i < 3; ++i)
+	{
+		BOOST_CHECK(g.grounded(m));
+	}
+
+	// Fills after the voids are checked lazily as well.
+	voiid(Vec(4, 2, 2));
+	fill(Vec(5, 2, 2));
+	BOOST_CHECK(!g.grounded(m));
+	BOOST_CHECK(!g.grounded(m));
+	fill(Vec(4, 2, 2));
+	BOOST_CHECK(g.grounded(m));
+	voiid(Vec(5, 2, 2));
+	fill(Vec(5, 1, 2));
+	BOOST_CHECK(g.grounded(m));
+
+	System s((Matrix(10)));
+	s.move_to(Vec(2, 3, 2));
+	s.push_and_step(Command::fill(Vec(0, -1, 0)));
+	BOOST_CHECK(!s.grounded());
+	s.move_to(Vec(3, 2, 2));
+	s.push_and_step(Command::fill(Vec(-1, -1, 0)));
+	BOOST_CHECK(!s.grounded());
+	s.move_to(Vec(3, 1, 2));
+	s.push_and_step(Command::fill(Vec(-1, -1, 0)));
+	BOOST_CHECK(s.grounded());
+	s.push_and_step(Command::voiid(Vec(-1, -1, 0)));
+	BOOST_CHECK(!s.grounded());
+}
+
+BOOST_AUTO_TEST_CASE(PathPlanner_test)
+{
+	// The wall to fly over.
+	Matrix m(10);
+	for(int y = 0; y < 9; ++y)
+	{
+		for(int z = 0; z < 10; ++z)
+		{
+			m.set_voxel(Vec(5, y, z), true);
+		}
+	}
+
+	PathPlanner planner;
+
+	BotPlan p;
+	BOOST_REQUIRE(planner.move_to(m, p, Vec(9, 0, 0)));
+	BOOST_CHECK_EQUAL(Vec(9, 0, 0), p.pos());
+	BOOST_CHECK_EQUAL(3, p.commands().size());
+
+	// Short hops are joined into LMoves.
+	BOOST_REQUIRE(planner.move_to(m, p, Vec(7, 3, 4)));
+	BOOST_CHECK_EQUAL(5, p.commands().size());
+
+	BOOST_CHECK(!planner.move_to(m, p, Vec(5, 0, 0)));
+	BOOST_CHECK(!planner.move_to(m, p, Vec(8, 3, 4), { Vec(8, 3, 4) }));
+	BOOST_CHECK_EQUAL(5, p.commands().size());
+
+	// Another bot in the way.
+	BOOST_CHECK(planner.move_to(m, p, Vec(0, 0, 0), { Vec(5, 9, 0) }));
+	BOOST_CHECK_EQUAL(Vec(0, 0, 0), p.pos());
+
+	Interpreter i(m);
+	Trace t;
+	for(const auto& c : p.commands())
+	{
+		t.push_back(c);
+	}
+	i.run(t);
+	BOOST_CHECK_EQUAL(0, i.steps() - p.commands().size());
+}
+
+BOOST_AUTO_TEST_CASE(ThreadPool_test)
+{
+	ThreadPool pool(4);
+	BOOST_CHECK_EQUAL(4, pool.size());
+
+	std::atomic<int> sum(0);
+	for(int i = 0; i < 100; ++i)
+	{
+		pool.submit([&pool, &sum, i]() {
+			// Nested tasks go to the worker's own deque and get stolen.
+			for(int j = 0; j < 10; ++j)
+			{
+				pool.submit([&sum, i]() { sum += i; });
+			}
+		});
+	}
+	pool.wait();
+	BOOST_CHECK_EQUAL(10 * 99 * 100 / 2, sum.load());
+
+	pool.submit([]() { throw std::runtime_error("task"); });
+	BOOST_CHECK_THROW(pool.wait(), std::runtime_error);
+
+	pool.submit([&sum]() { sum = 0; });
+	pool.wait();
+	BOOST_CHECK_EQUAL(0, sum.load());
+}
+
+BOOST_AUTO_TEST_CASE(Matrix_layer_summary_test)
+{
+	Matrix m(70);
+
+	BOOST_CHECK(m.layer_summary(3).empty());
+
+	m.set_voxel(Vec(10, 3, 65), true);
+	m.set_voxel(Vec(4, 3, 7), true);
+	m.set_voxel(Vec(20, 3, 30), true);
+	m.set_voxel(Vec(20, 3, 30), true);
+	BOOST_CHECK_EQUAL(3, m.layer_summary(3).count);
+	BOOST_CHECK_EQUAL(Vec(4, 3, 7), m.layer_summary(3).region.a);
+	BOOST_CHECK_EQUAL(Vec(20, 3, 65), m.layer_summary(3).region.b);
+
+	// The box shrinks after the voids on its sides.
+	m.set_voxel(Vec(4, 3, 7), false);
+	m.set_voxel(Vec(4, 3, 7), false);
+	BOOST_CHECK_EQUAL(2, m.layer_summary(3).count);
+	BOOST_CHECK_EQUAL(Vec(10, 3, 30), m.layer_summary(3).region.a);
+	BOOST_CHECK_EQUAL(Vec(10, 3, 65), m.calc_bounding_region_y(3, 0, 10).second.a);
+	BOOST_CHECK_EQUAL(Vec(10, 3, 65), m.calc_bounding_region_y(3, 0, 10).second.b);
+	BOOST_CHECK(!m.calc_bounding_region_y(3, 11, 19).first);
+
+	// Direct row writes.
+	m.row(30, 5)[1] = 1;
+	m.summarize_all();
+	BOOST_CHECK_EQUAL(1, m.layer_popcount(5));
+	BOOST_CHECK_EQUAL(Vec(30, 5, 64), m.layer_summary(5).region.a);
+
+	const auto all = m.calc_bounding_region();
+	BOOST_CHECK(all.first);
+	BOOST_CHECK_EQUAL(Vec(10, 3, 30), all.second.a);
+	BOOST_CHECK_EQUAL(Vec(30, 5, 65), all.second.b);
+	BOOST_CHECK_EQUAL(3, m.popcount());
+
+	const Matrix model = read_model_file(path("tests/FA186_tgt.mdl"));
+	Matrix copy(model.r());
+	for(int y = 0; y < int(model.r()); ++y)
+	{
+		for(int x = 0; x < int(model.r()); ++x)
+		{
+			for(int z = 0; z < int(model.r()); ++z)
+			{
+				copy.set_voxel(Vec(x, y, z), model.voxel(Vec(x, y, z)));
+			}
+		}
+		BOOST_CHECK_EQUAL(model.layer_popcount(y), copy.layer_popcount(y));
+		if(model.layer_any(y))
+		{
+			BOOST_CHECK_EQUAL(model.layer_summary(y).region.a,
+				copy.layer_summary(y).region.a);
+			BOOST_CHECK_EQUAL(model.layer_summary(y).region.b,
+				copy.layer_summary(y).region.b);
+		}
+	}
+
+	// The box kept by the voids is the one of the rows written afresh.
+	const int y = model.calc_bounding_region().second.a.y + 1;
+	for(int x = 0; x < int(model.r()); ++x)
+	{
+		for(int z = int(model.r()) - 1; z >= 0; z -= 3)
+		{
+			copy.set_voxel(Vec(x, y, z), false);
+		}
+
+		const Matrix& voided = copy;
+		Matrix fresh(model.r());
+		for(int i = 0; i < int(model.r()); ++i)
+		{
+			std::copy(voided.row(i, y), voided.row(i, y) + voided.row_words(),
+				fresh.row(i, y));
+		}
+		fresh.summarize_all();
+		BOOST_CHECK_EQUAL(fresh.layer_popcount(y), copy.layer_popcount(y));
+		if(fresh.layer_any(y))
+		{
+			BOOST_CHECK_EQUAL(fresh.layer_summary(y).region.a,
+				copy.layer_summary(y).region.a);
+			BOOST_CHECK_EQUAL(fresh.layer_summary(y).region.b,
+				copy.layer_summary(y).region.b);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(Matrix_row_spans_test)
+{
+	Matrix m(130);
+
+	std::vector<Matrix::Span> spans;
+	m.row_spans(1, 2, spans);
+	BOOST_CHECK(spans.empty());
+
+	// Runs crossing the words boundaries.
+	for(int z : { 0, 5, 6, 7, 60, 61, 62, 63, 64, 65, 127, 128, 129 })
+	{
+		m.set_voxel(Vec(1, 2, z), true);
+	}
+
+	m.row_spans(1, 2, spans);
+	const std::vector<Matrix::Span> expected = {
+		{ 0, 0 }, { 5, 7 }, { 60, 65 }, { 127, 129 }
+	};
+	BOOST_CHECK(spans == expected);
+}
+
+BOOST_AUTO_TEST_CASE(Reassemble_test)
+{
+	const Matrix full = read_model_file(path("tests/FA001_tgt.mdl"));
+	const int h = full.calc_bounding_region().second.b.y;
+
+	Matrix cut = full;
+	for(int x = 0; x < int(full.r()); ++x)
+	{
+		for(int z = 0; z < int(full.r()); ++z)
+		{
+			cut.set_voxel(Vec(x, h, z), false);
+		}
+	}
+	BOOST_CHECK_EQUAL(h, full.common_layers(cut));
+	BOOST_CHECK_EQUAL(int(full.r()), full.common_layers(full));
+
+	for(int dir = 0; dir < 2; ++dir)
+	{
+		const Matrix& src = dir ? cut : full;
+		const Matrix& tgt = dir ? full : cut;
+
+		System s(src);
+		const System r = reassemble(s, tgt, 4, Tracer::Sweep::Rectangles);
+		BOOST_CHECK(r.out_matrix() == tgt);
+
+		// Only the top layer is touched.
+		System ds(src);
+		Disassembler d(ds);
+		d.run();
+		BOOST_CHECK(r.energy() < ds.energy());
+
+		Interpreter i(src);
+		i.run(r.trace());
+		BOOST_CHECK(i.halted());
+		BOOST_CHECK_EQUAL(r.energy(), i.energy());
+		BOOST_CHECK(i.matrix() == tgt);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(Reassemble_differences_test)
+{
+	const Matrix full = read_model_file(path("tests/FA001_tgt.mdl"));
+	const int y = full.calc_bounding_region().second.b.y;
+
+	// A voxel on top of the model.
+	Matrix more = full;
+	bool found = false;
+	for(int x = 0; x < int(full.r()) && !found; ++x)
+	{
+		for(int z = 0; z < int(full.r()) && !found; ++z)
+		{
+			found = full.voxel(Vec(x, y, z)) && !full.voxel(Vec(x, y + 1, z));
+			if(found)
+			{
+				more.set_voxel(Vec(x, y + 1, z), true);
+			}
+		}
+	}
+	BOOST_CHECK_EQUAL(1u, full.count_differences(more));
+
+	// The column goes ungrounded until its new base is filled.
+	Matrix moved(5);
+	moved.set_voxel(Vec(1, 0, 1), true);
+	moved.set_voxel(Vec(1, 1, 1), true);
+	moved.set_voxel(Vec(2, 1, 1), true);
+	Matrix column(5);
+	column.set_voxel(Vec(2, 0, 1), true);
+	column.set_voxel(Vec(2, 1, 1), true);
+
+	const std::vector<std::pair<const Matrix*, const Matrix*>> cases = {
+		{ &full, &more }, { &more, &full }, { &moved, &column } };
+	for(const auto& c : cases)
+	{
+		const Matrix& src = *c.first;
+		const Matrix& tgt = *c.second;
+
+		System s(src);
+		const System r = reassemble(s, tgt, 4, Tracer::Sweep::Rectangles);
+		BOOST_CHECK(r.out_matrix() == tgt);
+		BOOST_CHECK(r.steps() < 32);
+
+		Interpreter i(src);
+		i.run(r.trace());
+		BOOST_CHECK(i.halted());
+		BOOST_CHECK_EQUAL(r.energy(), i.energy());
+		BOOST_CHECK(i.matrix() == tgt);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(CostModel_test)
+{
+	const Matrix m = read_model_file(path("tests/FA001_tgt.mdl"));
+	const CostModel model(m);
+	BOOST_CHECK(model.high_spans().empty());
+
+	CostModel::Plan plan;
+	plan.bots = max_bots;
+
+	// Steps within 6% and energy within 7% on the large model, with some
+	// margin. Small models are dominated by the fixed costs.
+	const Matrix large = read_model_file(path("tests/FA186_tgt.mdl"));
+	const CostModel large_model(large);
+	for(auto dir : { Tracer::Direction::Up, Tracer::Direction::Down })
+	{
+		for(auto sweep : { Tracer::Sweep::Voxels, Tracer::Sweep::Rectangles,
+			Tracer::Sweep::Swaths })
+		{
+			CostModel::Plan p;
+			p.dir = dir;
+			p.bots = max_bots;
+			p.sweep = sweep;
+			const CostModel::Estimate e = large_model.estimate(p);
+
+			System s(large);
+			if(dir == Tracer::Direction::Up)
+			{
+				Assembler a(s, p.bots, sweep);
+				a.run();
+				a.halt();
+			}
+			else
+			{
+				Disassembler d(s, p.bots, sweep);
+				d.run();
+				d.halt();
+			}
+
+			BOOST_CHECK_CLOSE(double(e.steps), double(s.steps()), 7.0);
+			BOOST_CHECK_CLOSE(double(e.energy), double(s.energy()), 8.0);
+		}
+	}
+
+	// Sweeping every layer in High harmonics, only the way to the layers
+	// and back stays Low.
+	const CostModel::Estimate low = model.estimate(plan);
+	plan.high_spans.push_back(CostModel::Span(0, m.r() - 1));
+	const CostModel::Estimate high = model.estimate(plan);
+	BOOST_CHECK_EQUAL(low.steps, high.steps);
+	BOOST_CHECK(high.high_steps > low.high_steps);
+	BOOST_CHECK(high.high_steps < high.steps);
+	BOOST_CHECK(high.energy > low.energy);
+}
+
+BOOST_AUTO_TEST_CASE(Portfolio_test)
+{
+	const Matrix m = read_model_file(path("tests/FA001_tgt.mdl"));
+
+	const std::vector<Portfolio::Config> configs = {
+		{ 1, Tracer::Sweep::Voxels },
+		{ 8, Tracer::Sweep::Rectangles },
+		{ max_bots, Tracer::Sweep::Rectangles }
+	};
+
+	const auto solve = [&](const Portfolio::Config& c) {
+		System s(m);
+		Assembler a(s, c.bots, c.sweep);
+		a.run();
+		a.halt();
+		return s;
+	};
+
+	uint64_t lowest = std::numeric_limits<uint64_t>::max();
+	for(const auto& c : configs)
+	{
+		lowest = std::min(lowest, solve(c).energy());
+	}
+
+	ThreadPool pool(2);
+	Portfolio portfolio(pool, configs);
+	const System s = portfolio.run(solve);
+	BOOST_CHECK_EQUAL(lowest, s.energy());
+	BOOST_CHECK_EQUAL(lowest, solve(portfolio.best()).energy());
+
+	Interpreter i(Matrix(m.r()));
+	i.run(s.trace());
+	BOOST_CHECK(i.halted());
+	BOOST_CHECK(i.matrix() == m);
+
+	// Only the configs close to the best estimate stay.
+	portfolio.prune([](const Portfolio::Config& c) { return c.bots; }, 8);
+	BOOST_CHECK_EQUAL(2, portfolio.configs().size());
+	BOOST_CHECK_EQUAL(8, portfolio.configs().back().bots);
+
+	portfolio.prune([](const Portfolio::Config&) { return 0; });
+	BOOST_CHECK_EQUAL(2, portfolio.configs().size());
+
+	BOOST_CHECK_THROW(
+		portfolio.run([](const Portfolio::Config&) -> System {
+			throw std::runtime_error("failed");
+		}),
+		std::runtime_error);
+
+	// Portfolios run by the tasks of a single worker pool, as in batch.
+	ThreadPool single(1);
+	std::atomic<uint64_t> energies(0);
+	for(int i = 0; i < 3; ++i)
+	{
+		single.submit([&]() {
+			Portfolio p(single, configs);
+			energies += p.run(solve).energy();
+		});
+	}
+	single.wait();
+	BOOST_CHECK_EQUAL(3 * lowest, energies.load());
+}
+
+BOOST_AUTO_TEST_CASE(Stats_test)
+{
+	const Matrix m = read_model_file(path("tests/FA001_tgt.mdl"));
+
+	System s(m);
+	Assembler a(s, 8);
+	a.run();
+	a.halt();
+
+	const Stats& stats = s.stats();
+	if(!Stats::enabled)
+	{
+		BOOST_CHECK_EQUAL(0, stats.low_steps);
+		BOOST_CHECK(stats.phases.empty());
+		return;
+	}
+
+	BOOST_CHECK_EQUAL(s.steps(), stats.low_steps + stats.high_steps);
+
+	int64_t energy = 0;
+	for(int64_t e : stats.energy)
+	{
+		energy += e;
+	}
+	BOOST_CHECK_EQUAL(s.energy(), energy);
+	BOOST_CHECK_EQUAL(12 * m.popcount(), stats.energy[Stats::Fills]);
+	BOOST_CHECK_EQUAL(0, stats.energy[Stats::Voids]);
+	BOOST_CHECK_EQUAL(
+		24 * (int64_t(stats.commands[Command::Fission])
+			- int64_t(stats.commands[Command::FusionP])),
+		stats.energy[Stats::Fissions]);
+
+	BOOST_CHECK_EQUAL(1, stats.commands[Command::Halt]);
+	BOOST_CHECK_EQUAL(m.popcount(), stats.commands[Command::Fill]);
+	BOOST_CHECK_EQUAL(stats.commands[Command::FusionP],
+		stats.commands[Command::FusionS]);
+	BOOST_CHECK_EQUAL(s.trace().size(), stats.peak_trace_bytes);
+
+	BOOST_REQUIRE_EQUAL(2, stats.phases.size());
+	BOOST_CHECK_EQUAL("run", stats.phases[0].first);
+	BOOST_CHECK_EQUAL("halt", stats.phases[1].first);
+
+	Stats total;
+	total.merge(stats);
+	total.merge(stats);
+	BOOST_CHECK_EQUAL(2 * stats.low_steps, total.low_steps);
+	BOOST_CHECK_EQUAL(stats.peak_trace_bytes, total.peak_trace_bytes);
+	BOOST_CHECK_EQUAL(4, total.phases.size());
+
+	std::ostringstream json;
+	total.write_json(json);
+	BOOST_CHECK(json.str().find("\"field_low\"") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(System_fork_test)
+{
+	const Matrix m = read_model_file(path("tests/FA001_tgt.mdl"));
+
+	Matrix copy = m;
+	BOOST_CHECK(copy.layer(0) == m.layer(0));
+	copy.set_voxel(Vec(0, 19, 0), true);
+	BOOST_CHECK(copy.layer(0) == m.layer(0));
+	BOOST_CHECK(copy.layer(19) != m.layer(19));
+	BOOST_CHECK(!m.voxel(Vec(0, 19, 0)));
+	BOOST_CHECK(copy != m);
+	copy.set_voxel(Vec(0, 19, 0), false);
+	BOOST_CHECK(copy == m);
+
+	System s(m);
+	Assembler(s, 8).run();
+	const size_t trace_size = s.trace().size();
+	const uint64_t energy = s.energy();
+
+	// The trace is long enough to span the chunks.
+	System fork = s;
+	for(int i = 0; i < int(Trace::chunk_size); ++i)
+	{
+		fork.push_and_step(Command::wait());
+	}
+	fork.move_to(Vec());
+	fork.push_and_step(Command::halt());
+
+	BOOST_CHECK_EQUAL(trace_size, s.trace().size());
+	BOOST_CHECK_EQUAL(energy, s.energy());
+	BOOST_CHECK(s.out_matrix() == m);
+
+	Trace reencoded;
+	for(const auto& c : fork.trace())
+	{
+		reencoded.push_back(c);
+	}
+	std::ostringstream a, b;
+	fork.trace().serialize(a);
+	reencoded.serialize(b);
+	BOOST_CHECK(a.str() == b.str());
+
+	Interpreter i(Matrix(m.r()));
+	i.run(fork.trace());
+	BOOST_CHECK(i.halted());
+	BOOST_CHECK(i.matrix() == m);
+	BOOST_CHECK_EQUAL(fork.energy(), i.energy());
+
+	// The original goes on by its own.
+	s.move_to(Vec());
+	s.push_and_step(Command::halt());
+	Interpreter j(Matrix(m.r()));
+	j.run(s.trace());
+	BOOST_CHECK(j.halted());
+	BOOST_CHECK_EQUAL(s.energy(), j.energy());
+}
+
+BOOST_AUTO_TEST_CASE(TraceOptimizer_test)
+{
+	const Matrix m = read_model_file(path("tests/FA001_tgt.mdl"));
+
+	for(auto sweep : { Tracer::Sweep::Voxels, Tracer::Sweep::Rectangles })
+	{
+		System s(m);
+		Assembler a(s, 8, sweep);
+		a.run();
+		a.halt();
+
+		TraceOptimizer optimizer(m.r());
+		const Trace t = optimizer.run(s.trace());
+		BOOST_CHECK(optimizer.saved() > 0);
+		BOOST_CHECK(t.size() < s.trace().size());
+
+		Interpreter i(Matrix(m.r()));
+		i.run(t);
+		BOOST_CHECK(i.halted());
+		BOOST_CHECK(i.matrix() == m);
+		BOOST_CHECK_EQUAL(s.energy() - optimizer.saved(), i.energy());
+
+		if(Stats::enabled)
+		{
+			const Stats stats = optimizer.stats(s.stats());
+			BOOST_CHECK_EQUAL(i.steps(), stats.low_steps + stats.high_steps);
+			BOOST_CHECK_EQUAL(i.energy(), std::accumulate(
+				stats.energy.begin(), stats.energy.end(), int64_t(0)));
+		}
+	}
+
+	// Moves back and forth, a Flip pair over them and a Wait step.
+	System s(Matrix(3));
+	s.push_and_step(Command::flip());
+	s.push_and_step(Command::smove_y(1));
+	s.push_and_step(Command::smove_x(2));
+	s.push_and_step(Command::flip());
+	s.push_and_step(Command::wait());
+	s.push_and_step(Command::smove_x(-2));
+	s.push_and_step(Command::smove_y(-1));
+	s.push_and_step(Command::halt());
+
+	TraceOptimizer optimizer(3);
+	const Trace t = optimizer.run(s.trace());
+	BOOST_CHECK(t.begin() != t.end());
+	BOOST_CHECK_EQUAL(Command::halt(), *t.begin());
+	BOOST_CHECK_EQUAL(s.energy() - (3 * 27 + 20), optimizer.saved());
+
+	BOOST_CHECK_THROW(
+		optimizer.run(make_trace({ Command::fission(Vec(1, 0, 0), 0),
+			Command::wait() })),
+		std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(Matrix_sparse_test)
+{
+	Matrix m(130);
+	BOOST_CHECK_EQUAL(130, m.next_layer(0));
+	BOOST_CHECK_EQUAL(130, m.next_row(0, 5));
+
+	m.set_voxel(Vec(3, 5, 0), true);
+	m.set_voxel(Vec(3, 5, 100), true);
+	m.set_voxel(Vec(70, 5, 1), true);
+	m.set_voxel(Vec(129, 9, 129), true);
+
+	BOOST_CHECK_EQUAL(5, m.next_layer(0));
+	BOOST_CHECK_EQUAL(9, m.next_layer(6));
+	BOOST_CHECK_EQUAL(3, m.next_row(0, 5));
+	BOOST_CHECK_EQUAL(70, m.next_row(4, 5));
+	BOOST_CHECK_EQUAL(130, m.next_row(71, 5));
+	BOOST_CHECK_EQUAL(129, m.next_row(0, 9));
+
+	// The row stays marked until its last voxel is voided.
+	m.set_voxel(Vec(3, 5, 0), false);
+	BOOST_CHECK_EQUAL(3, m.next_row(0, 5));
+	m.set_voxel(Vec(3, 5, 100), false);
+	BOOST_CHECK_EQUAL(70, m.next_row(0, 5));
+
+	// Direct row writes are summarized on demand.
+	m.row(64, 5)[0] = 1;
+	m.summarize_all();
+	BOOST_CHECK_EQUAL(64, m.next_row(0, 5));
+	BOOST_CHECK_EQUAL(Vec(64, 5, 0), m.calc_bounding_region_y(5, 60, 69).second.a);
+	BOOST_CHECK(!m.calc_bounding_region_y(5, 0, 63).first);
+
+	// The empty layers of the model read are not allocated.
+	const Matrix model = read_model_file(path("tests/FA001_tgt.mdl"));
+	const Matrix empty(model.r());
+	BOOST_CHECK(!model.layer_any(model.r() - 1));
+	BOOST_CHECK(model.layer(model.r() - 1) == empty.layer(0));
+	BOOST_CHECK(model.layer(0) != empty.layer(0));
+}
+
+BOOST_AUTO_TEST_CASE(VolatilityGrid_test)
+{
+	VolatilityGrid grid;
+	grid.next_step(10);
+	BOOST_CHECK(grid.mark(Vec(1, 2, 3)));
+	BOOST_CHECK(!grid.mark(Vec(1, 2, 3)));
+	BOOST_CHECK_EQUAL(Vec(1, 2, 3), grid.clash());
+
+	BOOST_CHECK(grid.mark_segment(Vec(0, 0, 0), Vec(0, 0, 5)));
+	BOOST_CHECK(!grid.mark_segment(Vec(0, 0, 9), Vec(0, 0, -4)));
+	BOOST_CHECK_EQUAL(Vec(0, 0, 5), grid.clash());
+
+	BOOST_CHECK(grid.mark_region(Region(Vec(5, 5, 5), Vec(6, 6, 6))));
+	BOOST_CHECK(!grid.mark_region(Region(Vec(6, 6, 6), Vec(7, 7, 7))));
+
+	// The marks of the previous step are gone.
+	grid.next_step(10);
+	BOOST_CHECK(grid.mark(Vec(1, 2, 3)));
+	BOOST_CHECK(grid.mark_region(Region(Vec(5, 5, 5), Vec(6, 6, 6))));
+}
+
+BOOST_AUTO_TEST_CASE(System_strict_test)
+{
+	const Matrix m = read_model_file(path("tests/FA001_tgt.mdl"));
+	for(auto sweep : { Tracer::Sweep::Voxels, Tracer::Sweep::Rectangles,
+		Tracer::Sweep::Swaths })
+	{
+		System s(m);
+		s.set_strict(true);
+		Assembler a(s, 8, sweep);
+		a.run();
+		a.halt();
+		BOOST_CHECK(s.out_matrix() == m);
+
+		System d(m);
+		d.set_strict(true);
+		d.set_out_matrix(m);
+		Disassembler(d, 8, sweep).run();
+		BOOST_CHECK(d.out_matrix().none());
+	}
+
+	System through(Matrix(5));
+	through.set_strict(true);
+	through.push_and_step(Command::smove_y(1));
+	through.push_and_step(Command::fill(Vec(0, 0, 1)));
+	BOOST_CHECK_THROW(through.push_and_step(Command::smove_z(2)),
+		std::runtime_error);
+
+	System halt(Matrix(5));
+	halt.set_strict(true);
+	halt.push_and_step(Command::smove_y(1));
+	BOOST_CHECK_THROW(halt.push_and_step(Command::halt()), std::runtime_error);
+
+	// Both bots pass the same voxel.
+	System pair(Matrix(5));
+	pair.set_strict(true);
+	pair.push_and_step(Command::fission(Vec(1, 0, 0), 0));
+	pair.push(Command::smove_z(2));
+	pair.push(Command::lmove(Vec(0, 0, 1), Vec(-1, 0, 0)));
+	BOOST_CHECK_THROW(pair.step(), std::runtime_error);
+
+	// The fill below the bot itself.
+	System fill(Matrix(5));
+	fill.set_strict(true);
+	BOOST_CHECK_THROW(fill.push_and_step(Command::fill(Vec(0, -1, 0))),
+		std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(Matrix_set_algebra_test)
+{
+	const Matrix m = read_model_file(path("tests/FA001_tgt.mdl"));
+
+	// The lowest full voxel of the model and an empty one.
+	const Vec full = m.first_difference(Matrix(m.r())).second;
+	const Vec empty(m.r() - 1, 5, m.r() - 1);
+	BOOST_REQUIRE(m.voxel(full) && !m.voxel(empty));
+
+	Matrix other(m.r());
+	other.set_voxel(full, true);
+	other.set_voxel(empty, true);
+
+	const auto by_voxels = [&](bool (*f)(bool, bool)) {
+		Matrix result(m.r());
+		for(int y = 0; y < int(m.r()); ++y)
+		{
+			for(int x = 0; x < int(m.r()); ++x)
+			{
+				for(int z = 0; z < int(m.r()); ++z)
+				{
+					const Vec p(x, y, z);
+					result.set_voxel(p, f(m.voxel(p), other.voxel(p)));
+				}
+			}
+		}
+		return result;
+	};
+
+	BOOST_CHECK((m & other)
+		== by_voxels([](bool a, bool b) { return a && b; }));
+	BOOST_CHECK((m | other)
+		== by_voxels([](bool a, bool b) { return a || b; }));
+	BOOST_CHECK((m ^ other)
+		== by_voxels([](bool a, bool b) { return a != b; }));
+	BOOST_CHECK(Matrix(m).subtract(other)
+		== by_voxels([](bool a, bool b) { return a && !b; }));
+
+	// The summaries follow.
+	const Matrix both = m | other;
+	BOOST_CHECK_EQUAL(m.popcount() + 1, both.popcount());
+	BOOST_CHECK_EQUAL(1, (m & other).popcount());
+	BOOST_CHECK_EQUAL(m.popcount(), m.count_differences(other));
+	BOOST_CHECK_EQUAL(1, both.count_differences(m));
+	BOOST_CHECK_EQUAL(1, both.count_layer_differences(m, 5));
+
+	BOOST_CHECK(!m.first_difference(m).first);
+	BOOST_CHECK(!(m ^ m).any());
+	const auto difference = both.first_difference(m);
+	BOOST_CHECK(difference.first);
+	BOOST_CHECK_EQUAL(empty, difference.second);
+	BOOST_CHECK_EQUAL(5, both.common_layers(m));
+}
+
+BOOST_AUTO_TEST_CASE(TraceIndex_test)
+{
+	const Matrix m = read_model_file(path("tests/FA001_tgt.mdl"));
+
+	System s(m);
+	Assembler a(s, 8, Tracer::Sweep::Rectangles);
+	a.run();
+	a.halt();
+	{
+		std::ofstream f("/tmp/test001.nbt", std::ios::binary);
+		s.serialize_trace(f);
+	}
+
+	BOOST_CHECK_NO_THROW(TraceIndex::write("/tmp/test001.nbt", Matrix(m.r()),
+		"/tmp/test001.nbt.idx", 16, 3));
+	const TraceIndex index("/tmp/test001.nbt.idx");
+	BOOST_CHECK_EQUAL(m.r(), index.r());
+	BOOST_CHECK_EQUAL(s.steps() / 16 + 2, index.entries().size());
+	BOOST_CHECK_EQUAL(0, index.find(15));
+	BOOST_CHECK_EQUAL(1, index.find(16));
+
+	for(uint64_t step : { uint64_t(0), uint64_t(1), uint64_t(47), uint64_t(50),
+		s.steps() / 2, s.steps() - 1, s.steps() })
+	{
+		const System sought =
+			index.seek("/tmp/test001.nbt", Matrix(m.r()), m, step);
+
+		System replayed(m);
+		auto it = s.trace().begin();
+		for(uint64_t i = 0; i < step; ++i)
+		{
+			for(size_t b = replayed.bots().size(); b > 0; --b)
+			{
+				replayed.push(*it);
+				++it;
+			}
+			replayed.step();
+		}
+
+		BOOST_CHECK_EQUAL(step, sought.steps());
+		BOOST_CHECK_EQUAL(replayed.energy(), sought.energy());
+		BOOST_CHECK(replayed.harmonics() == sought.harmonics());
+		BOOST_CHECK(replayed.out_matrix() == sought.out_matrix());
+		BOOST_REQUIRE_EQUAL(replayed.bots().size(), sought.bots().size());
+		for(size_t b = 0; b < sought.bots().size(); ++b)
+		{
+			BOOST_CHECK_EQUAL(replayed.bots()[b].id(), sought.bots()[b].id());
+			BOOST_CHECK_EQUAL(replayed.bots()[b].pos(), sought.bots()[b].pos());
+			BOOST_CHECK(replayed.bots()[b].seeds() == sought.bots()[b].seeds());
+		}
+	}
+
+	BOOST_CHECK_THROW(
+		index.seek("/tmp/test001.nbt", Matrix(m.r()), m, s.steps() + 1),
+		std::runtime_error);
+
+	// Indexed from the empty matrix, not from the target.
+	BOOST_CHECK_THROW(index.seek("/tmp/test001.nbt", m, m, 1),
+		std::runtime_error);
+	BOOST_CHECK_THROW(TraceIndex("/tmp/test001.mdl"), std::runtime_error);
+}
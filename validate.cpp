@@ -0,0 +1,73 @@
+/// ICFPC2018 solution code chunks.
+/// Copyright (C) 2018 cybevnm
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+#include "icfpc-2018.hpp"
+
+using namespace icfpc2018;
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		if(argc != 4)
+		{
+			throw std::runtime_error("Wrong argv");
+		}
+
+		const std::string src_path = argv[2];
+		const std::string tgt_path = argv[3];
+		if(src_path == "-" && tgt_path == "-")
+		{
+			throw std::runtime_error("No models given");
+		}
+
+		std::cerr
+			<< "Validating trace " << argv[1]
+			<< " for " << src_path << " -> " << tgt_path
+			<< std::endl;
+
+		const Matrix tgt = (tgt_path != "-")
+			? read_model_file(tgt_path) : Matrix(read_model_file(src_path).r());
+		const Matrix src = (src_path != "-")
+			? read_model_file(src_path) : Matrix(tgt.r());
+		if(src.r() != tgt.r())
+		{
+			throw std::runtime_error("Models resolutions differ");
+		}
+
+		Interpreter i(src);
+		i.run(read_trace_file(argv[1]));
+
+		if(!i.halted())
+		{
+			throw std::runtime_error("Trace is not halted");
+		}
+
+		const auto difference = i.matrix().first_difference(tgt);
+		if(difference.first)
+		{
+			std::ostringstream os;
+			os << "Resulting model differs from the target in "
+				<< i.matrix().count_differences(tgt) << " voxels, first at "
+				<< difference.second;
+			throw std::runtime_error(os.str());
+		}
+
+		std::cerr << "Steps: " << i.steps() << std::endl;
+		std::cerr << "Energy: " << i.energy() << std::endl;
+	}
+	catch(const std::runtime_error& e)
+	{
+		std::cerr << e.what() << std::endl;
+		std::cout
+			<< "Usage: validate trace source_model|- target_model|-"
+			<< std::endl;
+		return 1;
+	}
+
+	return 0;
+}